@@ -34,6 +34,7 @@ import java.io.File
 import java.io.FileOutputStream
 import java.math.BigInteger
 import java.util.concurrent.TimeUnit
+import java.util.zip.ZipFile
 
 /**
  * Instrumented test, which will execute on an Android device.
@@ -115,6 +116,56 @@ class RoundTripTests {
         }
     }
 
+    /**
+     * Matches the diagnosis keys ZIP file as is, and the export.bin extracted from it, against an
+     * RPI of one of its keys (0x06df8ad1668fd259e51782d90b613259). Both must give the same result.
+     */
+    @Test
+    fun testMatchKeyArchiveAsExtractedKeyFile() {
+        val appContext = InstrumentationRegistry.getInstrumentation().targetContext
+        val keyArchive = File(appContext.filesDir, "sample_export.zip")
+        val extractedKeyFile = File(appContext.filesDir, "sample_export.bin")
+        appContext.resources.openRawResource(R.raw.sample_diagnosis_key_file).use { inputStream ->
+            FileOutputStream(keyArchive).use { fileOutputStream ->
+                inputStream.copyTo(fileOutputStream)
+            }
+        }
+        ZipFile(keyArchive).use { zipFile ->
+            zipFile.getInputStream(zipFile.getEntry("export.bin")).use { inputStream ->
+                FileOutputStream(extractedKeyFile).use { fileOutputStream ->
+                    inputStream.copyTo(fileOutputStream)
+                }
+            }
+        }
+
+        try {
+            val testDataStore =
+                TestSelfTemporaryExposureKeyDataStore("06df8ad1668fd259e51782d90b613259", 2655216)
+            val rpiManager = RollingProximityIdManager(
+                testDataStore,
+                TestBleDatabaseWriter(),
+                Supplier { rollingPeriodStartToMillis(2655216) }
+            )
+            val seenRpi = rpiManager.currentRollingProximityId.get()
+            val matchingJni = MatchingJni(appContext, arrayOf(seenRpi))
+
+            val extractedResults = matchingJni.matching(listOf(extractedKeyFile.toString()))
+            val extractedKeyCount = matchingJni.lastProcessedKeyCount
+            val archiveResults = matchingJni.matching(listOf(keyArchive.toString()))
+
+            Assert.assertEquals(1, extractedResults.size)
+            Assert.assertEquals(extractedResults, archiveResults)
+            Assert.assertEquals(extractedKeyCount, matchingJni.lastProcessedKeyCount)
+            Assert.assertArrayEquals(
+                keyStringToByteArray("06df8ad1668fd259e51782d90b613259"),
+                archiveResults.first().keyData
+            )
+        } finally {
+            keyArchive.delete()
+            extractedKeyFile.delete()
+        }
+    }
+
     private fun rollingPeriodStartToMillis(rollingPeriod: Int) =
         rollingPeriod *
                 TimeUnit.MINUTES.toMillis(ContactTracingFeature.idRollingPeriodMinutes().toLong())
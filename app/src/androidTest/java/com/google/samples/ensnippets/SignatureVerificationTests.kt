@@ -18,21 +18,39 @@ package com.google.samples.ensnippets
 
 import androidx.test.ext.junit.runners.AndroidJUnit4
 import androidx.test.platform.app.InstrumentationRegistry
+import com.google.protobuf.ByteString
+import com.google.samples.exposurenotification.ExposureKeyExportProto.TEKSignatureList
+import com.google.samples.exposurenotification.matching.MatchingJni
 import com.google.samples.exposurenotification.matching.ProvideDiagnosisKeys
+import com.google.samples.exposurenotification.matching.SignatureVerifier
+import com.google.samples.exposurenotification.matching.TemporaryExposureKeyFileMetadataParser
 import org.junit.After
+import org.junit.Assert.assertArrayEquals
+import org.junit.Assert.assertEquals
+import org.junit.Assert.assertFalse
 import org.junit.Assert.assertTrue
 import org.junit.Before
 import org.junit.Test
 import org.junit.runner.RunWith
+import java.io.ByteArrayInputStream
 import java.io.File
 import java.io.FileOutputStream
+import java.math.BigInteger
+import java.security.MessageDigest
+import java.util.zip.ZipEntry
+import java.util.zip.ZipFile
+import java.util.zip.ZipOutputStream
 
 /** Sample app package name */
 private const val SAMPLE_PACKAGE = "com.google.android.apps.exposurenotification"
 
+/** One of the keys of the sample diagnosis keys file */
+private const val SAMPLE_KEY = "06df8ad1668fd259e51782d90b613259"
+
 @RunWith(AndroidJUnit4::class)
 class SignatureVerificationTests {
     private lateinit var diagnosisKeyFile: File
+    private lateinit var tamperedKeyFile: File
 
     @Before
     fun setup() {
@@ -43,14 +61,13 @@ class SignatureVerificationTests {
                 inputStream.copyTo(fileOutputStream)
             }
         }
-
-        val targetFolder = File(appContext.filesDir, "en_diagnosis_keys")
-        targetFolder.deleteRecursively()
+        tamperedKeyFile = File(appContext.filesDir, "tampered_export.zip")
     }
 
     @After
     fun teardown() {
         if (diagnosisKeyFile.exists()) diagnosisKeyFile.delete()
+        if (tamperedKeyFile.exists()) tamperedKeyFile.delete()
     }
 
     @Test
@@ -61,4 +78,111 @@ class SignatureVerificationTests {
 
         assertTrue(provideDiagnosisKeys.verify(SAMPLE_PACKAGE, diagnosisKeyFile))
     }
+
+    /**
+     * Flips a bit of one of the keys in export.bin, which must fail verification while the file
+     * still parses.
+     */
+    @Test
+    fun testVerifyTamperedKeyFile() {
+        val appContext = InstrumentationRegistry.getInstrumentation().targetContext
+        val key = BigInteger(SAMPLE_KEY, 16).toByteArray()
+        rewriteArchive { name, bytes ->
+            if (name == "export.bin") {
+                val position = indexOf(bytes, key)
+                assertTrue(position >= 0)
+                bytes[position] = (bytes[position].toInt() xor 1).toByte()
+            }
+            bytes
+        }
+
+        assertFalse(ProvideDiagnosisKeys(appContext).verify(SAMPLE_PACKAGE, tamperedKeyFile))
+    }
+
+    /**
+     * Flips a bit of the last byte of the signature, which keeps it a well formed ASN.1 SEQUENCE
+     * that must not verify.
+     */
+    @Test
+    fun testVerifyTamperedSignature() {
+        val appContext = InstrumentationRegistry.getInstrumentation().targetContext
+        rewriteArchive { name, bytes ->
+            if (name == "export.sig") {
+                val signatureList = TEKSignatureList.parseFrom(bytes)
+                val signature = signatureList.getSignatures(0)
+                val signatureBytes = signature.signature.toByteArray()
+                val last = signatureBytes.size - 1
+                signatureBytes[last] = (signatureBytes[last].toInt() xor 1).toByte()
+                signatureList.toBuilder()
+                    .setSignatures(
+                        0,
+                        signature.toBuilder().setSignature(ByteString.copyFrom(signatureBytes))
+                    )
+                    .build()
+                    .toByteArray()
+            } else {
+                bytes
+            }
+        }
+
+        assertFalse(ProvideDiagnosisKeys(appContext).verify(SAMPLE_PACKAGE, tamperedKeyFile))
+    }
+
+    /**
+     * The metadata read natively while verifying must equal the one parsed by
+     * [TemporaryExposureKeyFileMetadataParser], and the key files hash must be the SHA-256 of
+     * export.bin.
+     */
+    @Test
+    fun testVerifiedMetadataAndKeyFilesHash() {
+        val appContext = InstrumentationRegistry.getInstrumentation().targetContext
+        val (keyFileBytes, signatureList) = ZipFile(diagnosisKeyFile).use { zipFile ->
+            Pair(
+                zipFile.getInputStream(zipFile.getEntry("export.bin")).use { it.readBytes() },
+                zipFile.getInputStream(zipFile.getEntry("export.sig")).use {
+                    TEKSignatureList.parseFrom(it)
+                }
+            )
+        }
+        val export = object : SignatureVerifier.KeyExport {
+            override fun signatureList() = signatureList
+            override fun keyFilePath() = diagnosisKeyFile.absolutePath
+        }
+
+        MatchingJni.loadNativeLibrary(appContext)
+        val signatureVerifier = SignatureVerifier()
+        assertTrue(signatureVerifier.verify(SAMPLE_PACKAGE, listOf(export)))
+
+        val expectedMetadata =
+            TemporaryExposureKeyFileMetadataParser.parse(ByteArrayInputStream(keyFileBytes))
+        assertEquals(listOf(expectedMetadata), signatureVerifier.keyMetadata)
+        assertArrayEquals(
+            MessageDigest.getInstance("SHA-256").digest(keyFileBytes),
+            signatureVerifier.keyFilesHash
+        )
+    }
+
+    /**
+     * Copies the sample diagnosis keys file to [tamperedKeyFile], passing the contents of each
+     * entry through transform.
+     */
+    private fun rewriteArchive(transform: (String, ByteArray) -> ByteArray) {
+        ZipFile(diagnosisKeyFile).use { zipFile ->
+            ZipOutputStream(FileOutputStream(tamperedKeyFile)).use { outputStream ->
+                for (entry in zipFile.entries()) {
+                    val bytes = zipFile.getInputStream(entry).use { it.readBytes() }
+                    outputStream.putNextEntry(ZipEntry(entry.name))
+                    outputStream.write(transform(entry.name, bytes))
+                    outputStream.closeEntry()
+                }
+            }
+        }
+    }
+
+    private fun indexOf(bytes: ByteArray, pattern: ByteArray): Int {
+        for (i in 0..bytes.size - pattern.size) {
+            if (pattern.indices.all { bytes[i + it] == pattern[it] }) return i
+        }
+        return -1
+    }
 }
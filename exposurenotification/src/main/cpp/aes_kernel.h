@@ -0,0 +1,53 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LOCATION_NEARBY_CPP_EXPOSURENOTIFICATION_JNI_AES_KERNEL_H_
+#define LOCATION_NEARBY_CPP_EXPOSURENOTIFICATION_JNI_AES_KERNEL_H_
+
+#include <stdint.h>
+
+#include "constants.h"
+
+namespace exposure {
+    constexpr static const int kAes128Rounds = 10;
+
+    // Number of RPI blocks the hardware kernels keep in flight at once.
+    constexpr static const int kAesKernelInterleave = 8;
+
+    struct Aes128KeySchedule {
+        alignas(16) uint8_t round_keys[kAes128Rounds + 1][16];
+    };
+
+    void ExpandAes128Key(const uint8_t *key, Aes128KeySchedule *schedule);
+
+    // Returns true if the CPU supports one of the hardware AES kernels below.
+    bool HasHardwareAes();
+
+    // Encrypts the count RPI padded data blocks for interval numbers
+    // start_interval, start_interval + 1, ... into out (count * kIdLength
+    // bytes). Must only be called if HasHardwareAes() returned true.
+    void EncryptRpiBlocks(const Aes128KeySchedule &schedule,
+                          uint32_t start_interval, int count, uint8_t *out);
+
+    // Architecture specific kernels, see aes_kernel_x86.cc and
+    // aes_kernel_armv8.cc. Only defined on the matching architecture.
+    void EncryptRpiBlocksAesNi(const Aes128KeySchedule &schedule,
+                               uint32_t start_interval, int count, uint8_t *out);
+
+    void EncryptRpiBlocksArmv8(const Aes128KeySchedule &schedule,
+                               uint32_t start_interval, int count, uint8_t *out);
+}  // namespace exposure
+#endif  // LOCATION_NEARBY_CPP_EXPOSURENOTIFICATION_JNI_AES_KERNEL_H_
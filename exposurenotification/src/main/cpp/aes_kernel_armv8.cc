@@ -0,0 +1,73 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// ARMv8 Crypto Extensions kernel. This file is compiled with
+// -march=armv8-a+crypto (see CMakeLists.txt) and is only entered after
+// HasHardwareAes() confirmed support at runtime.
+
+#include "aes_kernel.h"
+
+#if defined(__aarch64__)
+
+#include <arm_neon.h>
+
+namespace exposure {
+    void EncryptRpiBlocksArmv8(const Aes128KeySchedule &schedule,
+                               uint32_t start_interval, int count, uint8_t *out) {
+      uint8x16_t round_keys[kAes128Rounds + 1];
+      for (int i = 0; i <= kAes128Rounds; i++) {
+        round_keys[i] = vld1q_u8(schedule.round_keys[i]);
+      }
+      // AESE folds AddRoundKey in before SubBytes/ShiftRows, so a round here is
+      // AESE with round key r followed by AESMC, and the last round key is a
+      // plain XOR.
+      uint8_t padded_data[kIdLength] = {0};
+      memcpy(padded_data, kRpiPaddedData, kRpiPaddedDataLength);
+      const uint32x4_t base = vsetq_lane_u32(
+          start_interval, vreinterpretq_u32_u8(vld1q_u8(padded_data)), 3);
+
+      int i = 0;
+      for (; i + kAesKernelInterleave <= count; i += kAesKernelInterleave) {
+        uint8x16_t blocks[kAesKernelInterleave];
+        for (int j = 0; j < kAesKernelInterleave; j++) {
+          blocks[j] = vreinterpretq_u8_u32(
+              vaddq_u32(base, vsetq_lane_u32(i + j, vdupq_n_u32(0), 3)));
+        }
+        for (int round = 0; round < kAes128Rounds - 1; round++) {
+          for (int j = 0; j < kAesKernelInterleave; j++) {
+            blocks[j] = vaesmcq_u8(vaeseq_u8(blocks[j], round_keys[round]));
+          }
+        }
+        for (int j = 0; j < kAesKernelInterleave; j++) {
+          blocks[j] = veorq_u8(vaeseq_u8(blocks[j], round_keys[kAes128Rounds - 1]),
+                               round_keys[kAes128Rounds]);
+          vst1q_u8(out + (i + j) * kIdLength, blocks[j]);
+        }
+      }
+      for (; i < count; i++) {
+        uint8x16_t block = vreinterpretq_u8_u32(
+            vaddq_u32(base, vsetq_lane_u32(i, vdupq_n_u32(0), 3)));
+        for (int round = 0; round < kAes128Rounds - 1; round++) {
+          block = vaesmcq_u8(vaeseq_u8(block, round_keys[round]));
+        }
+        block = veorq_u8(vaeseq_u8(block, round_keys[kAes128Rounds - 1]),
+                         round_keys[kAes128Rounds]);
+        vst1q_u8(out + i * kIdLength, block);
+      }
+    }
+}  // namespace exposure
+
+#endif  // defined(__aarch64__)
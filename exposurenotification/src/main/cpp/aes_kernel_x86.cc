@@ -0,0 +1,73 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// AES-NI kernel. This file is compiled with -maes (see CMakeLists.txt) and is
+// only entered after HasHardwareAes() confirmed support at runtime.
+
+#include "aes_kernel.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+
+#include <emmintrin.h>
+#include <wmmintrin.h>
+
+namespace exposure {
+    void EncryptRpiBlocksAesNi(const Aes128KeySchedule &schedule,
+                               uint32_t start_interval, int count, uint8_t *out) {
+      __m128i round_keys[kAes128Rounds + 1];
+      for (int i = 0; i <= kAes128Rounds; i++) {
+        round_keys[i] = _mm_load_si128(
+            reinterpret_cast<const __m128i *>(schedule.round_keys[i]));
+      }
+      // The interval number is the last little-endian 32-bit lane of the
+      // padded data, so consecutive blocks differ by adding to that lane only.
+      uint8_t padded_data[kIdLength] = {0};
+      memcpy(padded_data, kRpiPaddedData, kRpiPaddedDataLength);
+      const __m128i base = _mm_add_epi32(
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(padded_data)),
+          _mm_set_epi32(static_cast<int>(start_interval), 0, 0, 0));
+
+      int i = 0;
+      for (; i + kAesKernelInterleave <= count; i += kAesKernelInterleave) {
+        __m128i blocks[kAesKernelInterleave];
+        for (int j = 0; j < kAesKernelInterleave; j++) {
+          blocks[j] = _mm_xor_si128(
+              _mm_add_epi32(base, _mm_set_epi32(i + j, 0, 0, 0)), round_keys[0]);
+        }
+        for (int round = 1; round < kAes128Rounds; round++) {
+          for (int j = 0; j < kAesKernelInterleave; j++) {
+            blocks[j] = _mm_aesenc_si128(blocks[j], round_keys[round]);
+          }
+        }
+        for (int j = 0; j < kAesKernelInterleave; j++) {
+          blocks[j] = _mm_aesenclast_si128(blocks[j], round_keys[kAes128Rounds]);
+          _mm_storeu_si128(
+              reinterpret_cast<__m128i *>(out + (i + j) * kIdLength), blocks[j]);
+        }
+      }
+      for (; i < count; i++) {
+        __m128i block = _mm_xor_si128(
+            _mm_add_epi32(base, _mm_set_epi32(i, 0, 0, 0)), round_keys[0]);
+        for (int round = 1; round < kAes128Rounds; round++) {
+          block = _mm_aesenc_si128(block, round_keys[round]);
+        }
+        block = _mm_aesenclast_si128(block, round_keys[kAes128Rounds]);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i * kIdLength), block);
+      }
+    }
+}  // namespace exposure
+
+#endif  // defined(__i386__) || defined(__x86_64__)
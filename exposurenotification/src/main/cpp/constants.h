@@ -43,10 +43,23 @@ namespace exposure {
     constexpr static const int kTekLength = 16;
     constexpr static const int kIdLength = 16;
     constexpr static const int kIdPerKey = 144;
+    constexpr static const int kIntervalsPerDay = 144;
+    // A scan record passed to the matcher: the contact record key, which is the
+    // big-endian day number of the sighting then the ID, followed by the first
+    // and last interval of that day the ID was sighted in.
+    constexpr static const int kDayNumberLength = 2;
+    constexpr static const int kContactRecordKeyLength = kDayNumberLength + kIdLength;
+    constexpr static const int kScanRecordLength = kContactRecordKeyLength + 2;
     constexpr static const int kHkdfInfoLength = 7;
     constexpr static const char kHkdfInfo[] = u8"EN-RPIK";
     constexpr static const int kRpiPaddedDataLength = 12;
     constexpr static const char kRpiPaddedData[] = u8"EN-RPI\0\0\0\0\0\0";
+    // Number of diagnosis keys whose IDs are derived in one batch.
+    constexpr static const size_t kIdGenerationBatchSize = 16;
+    // Upper bound for the number of worker threads used by one matching call.
+    constexpr static const int kMaxMatchingThreadCount = 8;
+    // Upper bound for the number of worker threads used to verify key files.
+    constexpr static const int kMaxVerificationThreadCount = 8;
 
 }  // namespace exposure
 
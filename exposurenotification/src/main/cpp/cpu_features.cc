@@ -0,0 +1,86 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "cpu_features.h"
+
+#include <atomic>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#ifndef bit_SHA
+#define bit_SHA (1 << 29)
+#endif
+#elif defined(__aarch64__)
+#include <sys/auxv.h>
+#ifndef HWCAP_AES
+#define HWCAP_AES (1 << 3)
+#endif
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+#endif
+
+namespace exposure {
+
+    namespace {
+        struct CpuFeatures {
+            bool aes = false;
+            bool sha256 = false;
+        };
+
+        CpuFeatures DetectCpuFeatures() {
+          CpuFeatures features;
+#if defined(__i386__) || defined(__x86_64__)
+          unsigned int eax, ebx, ecx, edx;
+          if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+            features.aes = (ecx & bit_AES) != 0;
+            const bool ssse3_and_sse41 =
+                (ecx & bit_SSSE3) != 0 && (ecx & bit_SSE4_1) != 0;
+            if (ssse3_and_sse41 && __get_cpuid_max(0, nullptr) >= 7) {
+              __cpuid_count(7, 0, eax, ebx, ecx, edx);
+              features.sha256 = (ebx & bit_SHA) != 0;
+            }
+          }
+#elif defined(__aarch64__)
+          unsigned long hwcap = getauxval(AT_HWCAP);
+          features.aes = (hwcap & HWCAP_AES) != 0;
+          features.sha256 = (hwcap & HWCAP_SHA2) != 0;
+#endif
+          return features;
+        }
+
+        const CpuFeatures &GetCpuFeatures() {
+          static const CpuFeatures features = DetectCpuFeatures();
+          return features;
+        }
+
+        std::atomic<bool> hardware_crypto_disabled(false);
+    }  // namespace
+
+    bool CpuHasAes() {
+      return !hardware_crypto_disabled.load(std::memory_order_relaxed) &&
+             GetCpuFeatures().aes;
+    }
+
+    bool CpuHasSha256() {
+      return !hardware_crypto_disabled.load(std::memory_order_relaxed) &&
+             GetCpuFeatures().sha256;
+    }
+
+    void DisableHardwareCryptoForTesting(bool disabled) {
+      hardware_crypto_disabled.store(disabled, std::memory_order_relaxed);
+    }
+}  // namespace exposure
@@ -0,0 +1,35 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LOCATION_NEARBY_CPP_EXPOSURENOTIFICATION_JNI_CPU_FEATURES_H_
+#define LOCATION_NEARBY_CPP_EXPOSURENOTIFICATION_JNI_CPU_FEATURES_H_
+
+namespace exposure {
+    // Runtime CPU feature checks for the hardware crypto kernels. Features are
+    // detected once and cached; all functions are safe to call from any thread.
+
+    // AES-NI on x86, ARMv8 AES on arm64.
+    bool CpuHasAes();
+
+    // SHA extensions (with SSSE3/SSE4.1) on x86, ARMv8 SHA2 on arm64.
+    bool CpuHasSha256();
+
+    // While disabled is true, both checks above return false whatever the CPU
+    // supports, so that tests can run the portable SHA-256 compression and the
+    // EVP AES path on any machine.
+    void DisableHardwareCryptoForTesting(bool disabled);
+}  // namespace exposure
+#endif  // LOCATION_NEARBY_CPP_EXPOSURENOTIFICATION_JNI_CPU_FEATURES_H_
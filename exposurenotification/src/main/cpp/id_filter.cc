@@ -0,0 +1,202 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "id_filter.h"
+
+#include <math.h>
+
+#include <algorithm>
+
+namespace exposure {
+
+    namespace {
+        // Construction retries with a new seed when peeling fails; it almost
+        // always succeeds on the first attempt.
+        constexpr int kMaxBuildAttempts = 100;
+        constexpr uint32_t kMaxSegmentLength = 262144;
+
+        uint64_t NextSeed(uint64_t *state) {
+          uint64_t z = (*state += UINT64_C(0x9e3779b97f4a7c15));
+          z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+          z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+          return z ^ (z >> 31);
+        }
+
+        inline uint8_t Mod3(uint8_t x) { return x > 2 ? x - 3 : x; }
+    }  // namespace
+
+    bool IdFilter::Build(const uint8_t *ids, int n, size_t stride) {
+      params = {0, 0, 0, 0};
+      fingerprints = nullptr;
+      owned_fingerprints.clear();
+      if (n <= 0) {
+        return false;
+      }
+
+      // Equal IDs would never peel, so build over distinct keys only.
+      std::vector<uint64_t> keys(n);
+      for (int i = 0; i < n; i++) {
+        keys[i] = KeyOf(ids + i * stride);
+      }
+      std::sort(keys.begin(), keys.end());
+      keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+      const uint32_t size = static_cast<uint32_t>(keys.size());
+
+      uint32_t segment_length =
+          1u << static_cast<int>(floor(log(static_cast<double>(size)) / log(3.33) + 2.25));
+      segment_length = std::min(segment_length, kMaxSegmentLength);
+      double size_factor =
+          size <= 1 ? 0.0
+                    : std::max(1.125, 0.875 + 0.25 * log(1000000.0) /
+                                                  log(static_cast<double>(size)));
+      uint32_t capacity = static_cast<uint32_t>(round(size * size_factor));
+      uint32_t segment_count =
+          std::max<uint32_t>((capacity + segment_length - 1) / segment_length, 3) - 2;
+      const uint32_t array_length = (segment_count + 2) * segment_length;
+      // Set every parameter but array_length, which marks the filter as
+      // usable, up front: Hashes() needs them during construction.
+      params.segment_length = segment_length;
+      params.segment_count_length = segment_count * segment_length;
+      segment_length_mask = segment_length - 1;
+
+      int block_bits = 1;
+      while ((1u << block_bits) < segment_count) {
+        block_bits++;
+      }
+      const uint32_t block = 1u << block_bits;
+
+      std::vector<uint64_t> reverse_order(size + 1);
+      std::vector<uint8_t> reverse_h(size);
+      std::vector<uint32_t> alone(array_length);
+      std::vector<uint8_t> t2count(array_length);
+      std::vector<uint64_t> t2hash(array_length);
+      std::vector<uint32_t> start_pos(block);
+
+      uint64_t rng = UINT64_C(0x726b2b9d438b9d4d);
+      params.seed = NextSeed(&rng);
+      bool built = false;
+      for (int attempt = 0; attempt < kMaxBuildAttempts && !built; attempt++) {
+        if (attempt > 0) {
+          std::fill(reverse_order.begin(), reverse_order.begin() + size, 0);
+          std::fill(t2count.begin(), t2count.end(), 0);
+          std::fill(t2hash.begin(), t2hash.end(), 0);
+          params.seed = NextSeed(&rng);
+        }
+        // Order hashes by segment so that the counting pass walks memory roughly
+        // sequentially. The sentinel stops the probe for a free slot.
+        reverse_order[size] = 1;
+        for (uint32_t i = 0; i < block; i++) {
+          start_pos[i] = static_cast<uint32_t>((static_cast<uint64_t>(i) * size) >> block_bits);
+        }
+        for (uint32_t i = 0; i < size; i++) {
+          uint64_t hash = Mix(keys[i] + params.seed);
+          uint32_t segment_index = static_cast<uint32_t>(hash >> (64 - block_bits));
+          while (reverse_order[start_pos[segment_index]] != 0) {
+            segment_index = (segment_index + 1) & (block - 1);
+          }
+          reverse_order[start_pos[segment_index]] = hash;
+          start_pos[segment_index]++;
+        }
+
+        bool overflow = false;
+        for (uint32_t i = 0; i < size; i++) {
+          uint64_t hash = reverse_order[i];
+          for (int j = 0; j < 3; j++) {
+            uint32_t h = Hash(j, hash);
+            t2count[h] += 4;
+            t2count[h] ^= j;
+            t2hash[h] ^= hash;
+            overflow |= t2count[h] < 4;
+          }
+        }
+        if (overflow) {
+          continue;
+        }
+
+        // Peel: repeatedly take a slot that only one hash maps to.
+        uint32_t queue_size = 0;
+        for (uint32_t i = 0; i < array_length; i++) {
+          alone[queue_size] = i;
+          queue_size += (t2count[i] >> 2) == 1 ? 1 : 0;
+        }
+        uint32_t stack_size = 0;
+        while (queue_size > 0) {
+          uint32_t index = alone[--queue_size];
+          if ((t2count[index] >> 2) != 1) {
+            continue;
+          }
+          uint64_t hash = t2hash[index];
+          uint32_t h012[5];
+          Hashes(hash, &h012[0], &h012[1], &h012[2]);
+          h012[3] = h012[0];
+          h012[4] = h012[1];
+          uint8_t found = t2count[index] & 3;
+          reverse_h[stack_size] = found;
+          reverse_order[stack_size] = hash;
+          stack_size++;
+          for (int j = 1; j <= 2; j++) {
+            uint32_t other_index = h012[found + j];
+            alone[queue_size] = other_index;
+            queue_size += (t2count[other_index] >> 2) == 2 ? 1 : 0;
+            t2count[other_index] -= 4;
+            t2count[other_index] ^= Mod3(found + j);
+            t2hash[other_index] ^= hash;
+          }
+        }
+        built = stack_size == size;
+      }
+      if (!built) {
+        LOG_W("IdFilter failed to build over %u IDs", size);
+        return false;
+      }
+
+      owned_fingerprints.assign(array_length, 0);
+      for (uint32_t i = size; i-- > 0;) {
+        uint64_t hash = reverse_order[i];
+        uint32_t h012[5];
+        Hashes(hash, &h012[0], &h012[1], &h012[2]);
+        h012[3] = h012[0];
+        h012[4] = h012[1];
+        uint8_t found = reverse_h[i];
+        owned_fingerprints[h012[found]] = static_cast<uint8_t>(hash ^ (hash >> 32)) ^
+                                          owned_fingerprints[h012[found + 1]] ^
+                                          owned_fingerprints[h012[found + 2]];
+      }
+      fingerprints = owned_fingerprints.data();
+      params.array_length = array_length;
+      return true;
+    }
+
+    bool IdFilter::Attach(const IdFilterParams &filter_params,
+                          const uint8_t *filter_fingerprints) {
+      params = {0, 0, 0, 0};
+      fingerprints = nullptr;
+      owned_fingerprints.clear();
+      const uint32_t segment_length = filter_params.segment_length;
+      if (filter_fingerprints == nullptr || segment_length == 0 ||
+          segment_length > kMaxSegmentLength ||
+          (segment_length & (segment_length - 1)) != 0 ||
+          filter_params.segment_count_length % segment_length != 0 ||
+          static_cast<uint64_t>(filter_params.segment_count_length) + 2 * segment_length !=
+              filter_params.array_length) {
+        return false;
+      }
+      params = filter_params;
+      segment_length_mask = segment_length - 1;
+      fingerprints = filter_fingerprints;
+      return true;
+    }
+}  // namespace exposure
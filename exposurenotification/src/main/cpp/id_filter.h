@@ -0,0 +1,142 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LOCATION_NEARBY_CPP_EXPOSURENOTIFICATION_JNI_ID_FILTER_H_
+#define LOCATION_NEARBY_CPP_EXPOSURENOTIFICATION_JNI_ID_FILTER_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+#include "constants.h"
+
+namespace exposure {
+    // Approximate membership filter over a set of IDs: a binary fuse filter with
+    // 8-bit fingerprints, about 9 bits per ID and a false positive rate of about
+    // 1/256. A lookup reads three bytes of one small array, so checking it before
+    // the exact lookup keeps the many misses of matching out of the prefix table.
+    // Everything besides the fingerprints needed to query a built filter.
+    struct IdFilterParams {
+        uint64_t seed;
+        uint32_t segment_length;
+        uint32_t segment_count_length;
+        uint32_t array_length;
+    };
+
+    class IdFilter {
+    public:
+        IdFilter() = default;
+
+        IdFilter(const IdFilter &) = delete;
+        IdFilter &operator=(const IdFilter &) = delete;
+
+        // Builds the filter over n IDs of kIdLength bytes, stride bytes apart.
+        // Returns false, and leaves the filter empty, if construction did not
+        // converge; callers should then skip the filter.
+        bool Build(const uint8_t *ids, int n, size_t stride);
+
+        bool IsEmpty() const { return params.array_length == 0; }
+
+        // Parameters and fingerprints (params.array_length bytes) of the filter,
+        // e.g. to persist it.
+        const IdFilterParams &Params() const { return params; }
+        const uint8_t *Fingerprints() const { return fingerprints; }
+
+        // Uses a filter built earlier, whose fingerprints must outlive this
+        // object, instead of building one. Returns false, and leaves the filter
+        // empty, if params are inconsistent.
+        bool Attach(const IdFilterParams &filter_params, const uint8_t *filter_fingerprints);
+
+        // Returns false only if id is definitely not one of the built IDs.
+        bool MayContain(const uint8_t *id) const { return MayContainHash(HashOf(id)); }
+
+        // MayContain split in two, so that batched lookups can prefetch the
+        // fingerprints of many IDs before reading any of them.
+        uint64_t HashOf(const uint8_t *id) const { return Mix(KeyOf(id) + params.seed); }
+
+        void Prefetch(uint64_t hash) const {
+          uint32_t h0, h1, h2;
+          Hashes(hash, &h0, &h1, &h2);
+          __builtin_prefetch(&fingerprints[h0]);
+          __builtin_prefetch(&fingerprints[h1]);
+          __builtin_prefetch(&fingerprints[h2]);
+        }
+
+        bool MayContainHash(uint64_t hash) const {
+          uint8_t fingerprint = static_cast<uint8_t>(hash ^ (hash >> 32));
+          uint32_t h0, h1, h2;
+          Hashes(hash, &h0, &h1, &h2);
+          return (fingerprint ^ fingerprints[h0] ^ fingerprints[h1] ^
+                  fingerprints[h2]) == 0;
+        }
+
+    private:
+        static uint64_t KeyOf(const uint8_t *id) {
+          uint64_t hi, lo;
+          memcpy(&hi, id, sizeof(hi));
+          memcpy(&lo, id + sizeof(hi), sizeof(lo));
+          return Mix(hi) ^ lo;
+        }
+
+        static uint64_t Mix(uint64_t h) {
+          h ^= h >> 33;
+          h *= UINT64_C(0xff51afd7ed558ccd);
+          h ^= h >> 33;
+          h *= UINT64_C(0xc4ceb9fe1a85ec53);
+          h ^= h >> 33;
+          return h;
+        }
+
+        static uint64_t MulHi(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+          return static_cast<uint64_t>((static_cast<unsigned __int128>(a) * b) >> 64);
+#else
+          uint64_t a_lo = static_cast<uint32_t>(a), a_hi = a >> 32;
+          uint64_t b_lo = static_cast<uint32_t>(b), b_hi = b >> 32;
+          uint64_t lo_lo = a_lo * b_lo;
+          uint64_t hi_lo = a_hi * b_lo;
+          uint64_t lo_hi = a_lo * b_hi;
+          uint64_t cross = (lo_lo >> 32) + static_cast<uint32_t>(hi_lo) + lo_hi;
+          return a_hi * b_hi + (hi_lo >> 32) + (cross >> 32);
+#endif
+        }
+
+        void Hashes(uint64_t hash, uint32_t *h0, uint32_t *h1, uint32_t *h2) const {
+          uint64_t h = MulHi(hash, params.segment_count_length);
+          *h0 = static_cast<uint32_t>(h);
+          *h1 = *h0 + params.segment_length;
+          *h2 = *h1 + params.segment_length;
+          *h1 ^= static_cast<uint32_t>(hash >> 18) & segment_length_mask;
+          *h2 ^= static_cast<uint32_t>(hash) & segment_length_mask;
+        }
+
+        uint32_t Hash(int index, uint64_t hash) const {
+          uint32_t h0, h1, h2;
+          Hashes(hash, &h0, &h1, &h2);
+          return index == 0 ? h0 : (index == 1 ? h1 : h2);
+        }
+
+        IdFilterParams params = {0, 0, 0, 0};
+        uint32_t segment_length_mask = 0;
+        // Points into owned_fingerprints for a built filter and to the caller's
+        // memory for an attached one.
+        const uint8_t *fingerprints = nullptr;
+        std::vector<uint8_t> owned_fingerprints;
+    };
+}  // namespace exposure
+
+#endif  // LOCATION_NEARBY_CPP_EXPOSURENOTIFICATION_JNI_ID_FILTER_H_
@@ -0,0 +1,97 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "id_generator.h"
+
+#include <openssl/aes.h>
+#include <openssl/cipher.h>
+
+#include <algorithm>
+
+#include "aes_kernel.h"
+#include "rpik_hkdf.h"
+
+namespace exposure {
+    IdGenerator::IdGenerator() {
+      EVP_CIPHER_CTX_init(&context);
+      for (int i = 0; i < kIdPerKey; i++) {
+        memcpy(&aesInputStorage[i * kIdLength], kRpiPaddedData,
+               kRpiPaddedDataLength);
+      }
+    }
+
+    IdGenerator::~IdGenerator() { EVP_CIPHER_CTX_cleanup(&context); }
+
+#if _BYTE_ORDER != _LITTLE_ENDIAN
+#error "Must use little endian"
+#endif
+
+    // PaddedData[0 - 5]: "EN-RPI".getBytes(UTF_8).
+    // PaddedData[6 - 11]: 0x000000000000.
+    // PaddedData[12 -15]: enIntervalNumber, uint32 little-endian.
+    bool IdGenerator::EncryptWithEvp(const uint8_t *rpi_key,
+                                     uint32_t start_interval, int id_count,
+                                     uint8_t *ids) {
+      if (EVP_EncryptInit_ex(&context, EVP_aes_128_ecb(), /*impl=*/nullptr, rpi_key,
+          /*iv=*/nullptr) != 1) {
+        return false;
+      }
+
+      uint32_t en_interval_number = start_interval;
+      for (int index = 0; index < id_count * kIdLength;
+           index += kIdLength, en_interval_number++) {
+        *((uint32_t *) (&aesInputStorage[index + 12])) = en_interval_number;
+      }
+
+      int out_length;
+      return EVP_EncryptUpdate(&context, ids, &out_length, aesInputStorage,
+                               id_count * kIdLength) == 1;
+    }
+
+    bool IdGenerator::GenerateIds(const uint8_t *diagnosis_key,
+                                  uint32_t rolling_start_number, uint8_t *ids) {
+      const int id_count = kIdPerKey;
+      return GenerateIdsBatch(diagnosis_key, &rolling_start_number, &id_count, 1,
+                              ids);
+    }
+
+    bool IdGenerator::GenerateIdsBatch(const uint8_t *teks,
+                                       const uint32_t *start_intervals,
+                                       const int *id_counts, size_t n,
+                                       uint8_t *out) {
+      const bool hardware_aes = HasHardwareAes();
+      uint8_t rpi_keys[kIdGenerationBatchSize * kRpikLength];
+      Aes128KeySchedule schedule;
+      for (size_t i = 0; i < n; i++) {
+        if (i % kIdGenerationBatchSize == 0) {
+          // RPIK <- HKDF(tek, NULL, UTF8("EN-PRIK"), 16).
+          DeriveRpiks(teks + i * kTekLength,
+                      std::min(n - i, kIdGenerationBatchSize), rpi_keys);
+        }
+        const uint8_t *rpi_key =
+            &rpi_keys[(i % kIdGenerationBatchSize) * kRpikLength];
+        uint8_t *ids = out + i * kIdPerKey * kIdLength;
+        if (hardware_aes) {
+          ExpandAes128Key(rpi_key, &schedule);
+          EncryptRpiBlocks(schedule, start_intervals[i], id_counts[i], ids);
+        } else if (!EncryptWithEvp(rpi_key, start_intervals[i], id_counts[i],
+                                   ids)) {
+          return false;
+        }
+      }
+      return true;
+    }
+}  // namespace exposure
@@ -0,0 +1,61 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LOCATION_NEARBY_CPP_EXPOSURENOTIFICATION_JNI_ID_GENERATOR_H_
+#define LOCATION_NEARBY_CPP_EXPOSURENOTIFICATION_JNI_ID_GENERATOR_H_
+
+#include <openssl/aes.h>
+#include <openssl/cipher.h>
+
+#include "constants.h"
+
+namespace exposure {
+    // Generates the rolling proximity IDs of a diagnosis key. The cipher context
+    // and the AES input buffer are mutable scratch state, so an IdGenerator must
+    // not be shared between threads; each matching worker owns its own.
+    class IdGenerator {
+    public:
+        IdGenerator();
+
+        ~IdGenerator();
+
+        IdGenerator(const IdGenerator &) = delete;
+
+        IdGenerator &operator=(const IdGenerator &) = delete;
+
+        // Writes kIdPerKey IDs (kIdPerKey * kIdLength bytes) starting at
+        // rolling_start_number into ids.
+        bool GenerateIds(const uint8_t *diagnosis_key, uint32_t rolling_start_number,
+                         uint8_t *ids);
+
+        // Batched form of GenerateIds for n keys: teks holds n * kTekLength bytes,
+        // and key i gets id_counts[i] (at most kIdPerKey) IDs starting at interval
+        // start_intervals[i]. out receives n * kIdPerKey * kIdLength bytes, one
+        // kIdPerKey slot per key even if it is only partially filled. Uses the interleaved
+        // hardware AES kernel if the CPU has one and the EVP path otherwise; the
+        // RPIKs are derived with the batched HKDF in rpik_hkdf.h.
+        bool GenerateIdsBatch(const uint8_t *teks, const uint32_t *start_intervals,
+                              const int *id_counts, size_t n, uint8_t *out);
+
+    private:
+        bool EncryptWithEvp(const uint8_t *rpi_key, uint32_t start_interval,
+                            int id_count, uint8_t *ids);
+
+        EVP_CIPHER_CTX context;
+        uint8_t aesInputStorage[kIdPerKey * kIdLength];
+    };
+}  // namespace exposure
+#endif  // LOCATION_NEARBY_CPP_EXPOSURENOTIFICATION_JNI_ID_GENERATOR_H_
@@ -0,0 +1,317 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#include "id_generator.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+#include "aes_kernel.h"
+#include "cpu_features.h"
+
+namespace exposure {
+    namespace {
+        // Key, interval and RPI0 ... RPI143 of the specification's test vectors,
+        // see TestVectors.java.
+        constexpr char kTek[] = "75c734c6dd1a782de7a965da5eb93125";
+        constexpr char kRpik[] = "185ad91db69ec7dd048960f1f3ba6175";
+        constexpr uint32_t kStartInterval = 2642976;
+        constexpr const char *kRpis[kIdPerKey] = {
+            "8be6cd371c5c891604bfbe49df845096",
+            "3c9a1de5dd6b02afa7fded7b570b3e56",
+            "243ffe9a3b08bded3094bac8630bb8ad",
+            "dfc3ed265e97d0eabb630e168b4214ed",
+            "b3b85a69ebaec78db739852d1f34e0fa",
+            "298abd6fdad29efbf0f85a63956cf188",
+            "105e8221dd603d25b94aba0c3cc8dee1",
+            "9888ca7e6738ec4bc6e420b20f878b3a",
+            "8694a79ae99671be3f18aaf6b090657a",
+            "b8cde28ad20d1cd2fdd7369dc0c6f7c8",
+            "f60123c67bd2fc4b62002b4b7d595ba6",
+            "8a84c86e05f7a8772aae7a80686e1a1c",
+            "ac461bf2b93b0d90841746f51aded6c0",
+            "f2567eed0aa1cdf2cd3d0bd28252f196",
+            "a255225baa9e37b730a95f997a6972f5",
+            "04cfaee41021cb7d4d020b306b24bea8",
+            "f5372bbc92f7805964701e879b48d431",
+            "f2c811546382b10df1ac06c32c617ba7",
+            "f8f3441f76223dac15ec6b35fdb25140",
+            "d07183db3c8045087d61ee9e730c9306",
+            "c742dd9c96a3e6fa7c4f22621dacc24d",
+            "082333fad9fa292ab899d6000c659797",
+            "be4300dafb8d07c88cb2b5077a061166",
+            "5fed1b4d3b3a13332f05447560352632",
+            "fd1ee2cc5c60e6eee61f04919f6759a7",
+            "96adf5b8dc7ee75df46fbd8a1fc4ad0d",
+            "fa4ba2206d42a1c80d5248ae688309a4",
+            "a590f95dbf240261da101a7cdb24dbba",
+            "67e81b91d1cf9e0958135429dad01e82",
+            "183cac2236c3e0533be4704d836e4755",
+            "341162551c29319bc53538edfcf23040",
+            "2251687018214b65dd8ee83eaed330ab",
+            "a4cf6e50215fe278cc5cff1b0534a3e0",
+            "df8f2ac303232b2e5b3efd8681aaa8dd",
+            "ba2e75d7f48cf55c0c868fd45cf16b5c",
+            "ec6a40058debffff3c51977f24562e21",
+            "6a68e30b2fb93b5df78ee3a9a350a6ce",
+            "8d33a70562629994f8df99052b0eb69a",
+            "21053ccb8f925111e254bd694e97946b",
+            "e1c9cdf20f900ae6d24bf7bcb4e66135",
+            "baf789f550946b431064450771b2a143",
+            "f7f91ec25085d0353e0278e598cc6201",
+            "c8933d70220ba9c8c148393a3959d256",
+            "f2932e6e6ef60f0f5bbce439100a90e4",
+            "18f5d8102a5930d80230f2c39a4266d6",
+            "e6075c28939fb0c67246ce38c5ff938a",
+            "66168862bc445f48e5b0ed07e1df3f5a",
+            "1d0a01c38da4ac41ec7a638f5df705a9",
+            "a737001a2d2f802c64789a9952e6d1a7",
+            "7c3725b6084e681fb34d26c3a394a643",
+            "26d1f836557a259a81b5db5419c6a729",
+            "ebc2a6062854d1ec627b1f6e8432e166",
+            "113274e80c31cfcd81c2ad0864445178",
+            "4567976c48be725906247d0bd81bb811",
+            "748154ba523a1aa810b7062a13e5aa68",
+            "30bceb3345745153352365998587cd10",
+            "8f2d7b8700a82fd4514dfa4202ee298f",
+            "0e664953700cdfc0d2792fadf07329eb",
+            "f44958c4dd70d9968a26fd60ba927290",
+            "55fd2f6cbde0e13fd22c0b3db16228e5",
+            "49f3f9d12469dcc9ed356364c30066e4",
+            "c57d2d6e0d25a0651cd72786f8c951ce",
+            "88ef256351ac49dfd15ab5a2de97c013",
+            "d0fb6fd6db89da52361f1a30fb436ce7",
+            "8a42a330f01928e51631231981603fd5",
+            "6e51b2a2aecbab1df80826ef6d1e1958",
+            "3ce681a28b1be19c9e36b9c580b123ab",
+            "1e958ed89b86b98977f79e1b83f3d05f",
+            "1d667b01d6634b5f3b6f33ac4b150d23",
+            "67f222156c517debc07068cbc5eec1dd",
+            "a8454b9c947d1625ee3fba2607c23aff",
+            "416ffc7a32fcfda9a316d01790e31945",
+            "c19a30c39c9c3a089bcadde1c6699447",
+            "786ddfae6fc77c4c410c4ec32d34247d",
+            "ef0fd3a95b9661e1fccb4e30cde32c51",
+            "fc1f8a66f405ccb63dc3e48207da7788",
+            "0eacc28631b10f4498368666130ff0c9",
+            "e8db4a4626385ae6e3b2451d0a66edbf",
+            "c600678d4fbe9245ad4973b1c8971bc5",
+            "081926c361834c5c1d4319b840f315ae",
+            "1d829eafa04232a6bb4d3c2022ac3d0f",
+            "798abce8c8f62510de595a9973fb218e",
+            "61fc0deb47084fdaf1483e342d73b148",
+            "4969edd40f3eab468b8a8d49685a4edd",
+            "1d69d6d4158a318f1d9cafba13587017",
+            "ab7c61f1cca813fd36e8f1b1e5df6a0f",
+            "94f24fdec17aa31f74f202ae4a6874be",
+            "6e5de02579d3dfb194cc7bd49270253d",
+            "fe3e1e3621773f188040aa5db3ff1d4e",
+            "d7376e0d77255de23d540f027183f1ba",
+            "64a71e48a50e7b5a37ac91816e2b0f53",
+            "0f22a2c0b699e189d59e30d1745d67d3",
+            "de876baf31228e3b7fe0f08e1f38ea7b",
+            "8c6927bcf5f7aee1eed8abbe43e2e2d1",
+            "bc96830f182a72c89e65cea9c47d88c0",
+            "7b2fbe746dd2da86e9866a0e6aadbc4d",
+            "93e20f14a13d56567594aa962350f170",
+            "9e3814f951fa03796b9a66f89a9f400d",
+            "95fa09845aa8d4b60047faf99aebca0c",
+            "ef0a7579331853b9ebc250b4d6f3ebcc",
+            "7fe9a90de00c9f0737d3b45fda651115",
+            "443b7b5ab9a86a1fee67e18cb8c40764",
+            "e8a6fa9a5ca9fb061c4cdbe217c61d59",
+            "087a08040686fd635ef389752741cc1f",
+            "587c0486644ceb2d0b7ebdd39dd3a860",
+            "dd827ba60f8a35b1dd4e4cdfe49c4263",
+            "cf234000080a4e8da8feb533aa5904d3",
+            "c50fb1ec3ef54e916178ca9d56ee4f5c",
+            "d45fde46f467d76ed28dd4d2496dcb7f",
+            "e9baf81c961f510d08a663c7524f36df",
+            "e3b02cc031e144fae61a3899501b4921",
+            "a75eea58232e7366cea1a0e72da0cec5",
+            "6ad7621fe1da0139ff8bad7f379cabf6",
+            "6fe2ac45f65c8ac69fdc5ef7fa9ff7f0",
+            "2fbec68fd27ddddb4223044efc779851",
+            "32bf688a7c834be1bfab7c8e0e580adb",
+            "dae3a7d8c62427b09c0e7bbf489d34bd",
+            "3c4b02bd5ed28c67829c97791079afd2",
+            "e2faeac3dbd150ec8ea8e7b3e5bb8454",
+            "69942a7213eaf3c14a69996ba6c6bfeb",
+            "1c5c4dd25452e97dd187dd7ce1d1ee81",
+            "fbf5607a7c612aced160e755a987262d",
+            "3e2de13070f27443d9ba3eb43f9a71ea",
+            "8a12d25f006fab5a2707da9e6c4e96be",
+            "6fd98c22e227838e6f67369764437725",
+            "3da212aebdb78ba819809d03c6cf56e2",
+            "8c48da73e29effc9b74bb097096e0a0a",
+            "e53c68b4b01c68f37e65a0dc8e67f45d",
+            "8331dde6364b119527af76fee17aabcf",
+            "8c14471f5571926396dde6f7b7b35b56",
+            "4eb6b2deb40e5ec9bc39838102a4f4f9",
+            "77f2141ceffd0aa3bee4b67c450d9aa6",
+            "043d78e20cb59c0bcb1578ff93ea544a",
+            "65b8ecc4561c1cca053d814ffd8961d4",
+            "32f25a1724f2bdcad05abc1482e1329e",
+            "203ba3f3f7230266b993b3ee7b2d8608",
+            "e5e7a47069216e1a887b90ef0394a35c",
+            "3ffc8bb91dbcd8ee924948f5080b190d",
+            "32375391077fbf7686bafa7dc156be1c",
+            "a8904965aec5ddb655e97007d223db48",
+            "415cf7af1dc9feacb3978488f5046893",
+            "86f8ddc0c93e53e3a582e61f01f7df2f",
+            "a65ef7ba9752c4173ba48a33849c5e52",
+            "f431b62ecf443102ce4ed0407de54bd4",
+        };
+
+        std::vector<uint8_t> FromHex(const std::string &hex) {
+          std::vector<uint8_t> bytes(hex.size() / 2);
+          for (size_t i = 0; i < bytes.size(); i++) {
+            bytes[i] = static_cast<uint8_t>(std::stoi(hex.substr(2 * i, 2), nullptr, 16));
+          }
+          return bytes;
+        }
+
+        std::vector<uint8_t> ExpectedRpis(int first, int count) {
+          std::vector<uint8_t> rpis;
+          for (int i = first; i < first + count; i++) {
+            std::vector<uint8_t> rpi = FromHex(kRpis[i]);
+            rpis.insert(rpis.end(), rpi.begin(), rpi.end());
+          }
+          return rpis;
+        }
+
+        // Runs kernel for every (first, count) pair of RPIs, which covers
+        // counts below, at and above the interleave width at every offset.
+        template<typename Kernel>
+        void ExpectKernelMatchesSpec(Kernel kernel) {
+          Aes128KeySchedule schedule;
+          ExpandAes128Key(FromHex(kRpik).data(), &schedule);
+
+          std::vector<uint8_t> ids(kIdPerKey * kIdLength);
+          kernel(schedule, kStartInterval, kIdPerKey, ids.data());
+          EXPECT_EQ(ExpectedRpis(0, kIdPerKey), ids);
+
+          for (int first = 0; first < 2 * kAesKernelInterleave; first++) {
+            for (int count = 1; count <= 2 * kAesKernelInterleave + 1; count++) {
+              SCOPED_TRACE(testing::Message() << "first " << first << " count " << count);
+              ids.assign(count * kIdLength, 0);
+              kernel(schedule, kStartInterval + first, count, ids.data());
+              EXPECT_EQ(ExpectedRpis(first, count), ids);
+            }
+          }
+        }
+
+        // Makes the CPU feature checks fail for the lifetime of the object.
+        class ScopedHardwareCryptoDisabled {
+        public:
+            ScopedHardwareCryptoDisabled() { DisableHardwareCryptoForTesting(true); }
+
+            ~ScopedHardwareCryptoDisabled() { DisableHardwareCryptoForTesting(false); }
+        };
+
+        // FIPS-197 appendix A.1.
+        TEST(IdGenerator, ExpandsAesKeyAsFips197) {
+          Aes128KeySchedule schedule;
+          ExpandAes128Key(FromHex("2b7e151628aed2a6abf7158809cf4f3c").data(), &schedule);
+
+          const std::vector<uint8_t> round_keys(&schedule.round_keys[0][0],
+                                                &schedule.round_keys[0][0] + sizeof(schedule));
+          EXPECT_EQ(FromHex("2b7e151628aed2a6abf7158809cf4f3c"
+                            "a0fafe1788542cb123a339392a6c7605"
+                            "f2c295f27a96b9435935807a7359f67f"
+                            "3d80477d4716fe3e1e237e446d7a883b"
+                            "ef44a541a8525b7fb671253bdb0bad00"
+                            "d4d1c6f87c839d87caf2b8bc11f915bc"
+                            "6d88a37a110b3efddbf98641ca0093fd"
+                            "4e54f70e5f5fc9f384a64fb24ea6dc4f"
+                            "ead27321b58dbad2312bf5607f8d292f"
+                            "ac7766f319fadc2128d12941575c006e"
+                            "d014f9a8c9ee2589e13f0cc8b6630ca6"),
+                    round_keys);
+        }
+
+#if defined(__i386__) || defined(__x86_64__)
+        TEST(IdGenerator, AesNiKernelMatchesSpec) {
+          if (!CpuHasAes()) {
+            GTEST_SKIP() << "No AES-NI";
+          }
+          ExpectKernelMatchesSpec(EncryptRpiBlocksAesNi);
+        }
+#elif defined(__aarch64__)
+        TEST(IdGenerator, Armv8KernelMatchesSpec) {
+          if (!CpuHasAes()) {
+            GTEST_SKIP() << "No ARMv8 AES";
+          }
+          ExpectKernelMatchesSpec(EncryptRpiBlocksArmv8);
+        }
+#endif
+
+        TEST(IdGenerator, GeneratesSpecIdsWithHardwareAes) {
+          if (!HasHardwareAes()) {
+            GTEST_SKIP() << "No hardware AES";
+          }
+          IdGenerator id_generator;
+          std::vector<uint8_t> ids(kIdPerKey * kIdLength);
+          ASSERT_TRUE(id_generator.GenerateIds(FromHex(kTek).data(), kStartInterval, ids.data()));
+          EXPECT_EQ(ExpectedRpis(0, kIdPerKey), ids);
+        }
+
+        TEST(IdGenerator, GeneratesSpecIdsWithEvpAndPortableHkdf) {
+          ScopedHardwareCryptoDisabled disabled;
+          ASSERT_FALSE(HasHardwareAes());
+          IdGenerator id_generator;
+          std::vector<uint8_t> ids(kIdPerKey * kIdLength);
+          ASSERT_TRUE(id_generator.GenerateIds(FromHex(kTek).data(), kStartInterval, ids.data()));
+          EXPECT_EQ(ExpectedRpis(0, kIdPerKey), ids);
+        }
+
+        // Keys of a batch get partial ID counts at different offsets, and the
+        // batch spans more than one RPIK derivation batch.
+        TEST(IdGenerator, BatchMatchesSpecOnBothPaths) {
+          constexpr int kKeyCount = static_cast<int>(kIdGenerationBatchSize) + 3;
+          std::vector<uint8_t> teks;
+          std::vector<uint32_t> start_intervals;
+          std::vector<int> id_counts;
+          for (int i = 0; i < kKeyCount; i++) {
+            std::vector<uint8_t> tek = FromHex(kTek);
+            teks.insert(teks.end(), tek.begin(), tek.end());
+            start_intervals.push_back(kStartInterval + i % 7);
+            id_counts.push_back(1 + (i * 37) % (kIdPerKey - 7));
+          }
+
+          for (bool hardware : {true, false}) {
+            SCOPED_TRACE(hardware ? "hardware" : "portable");
+            if (hardware && !HasHardwareAes()) {
+              continue;
+            }
+            DisableHardwareCryptoForTesting(!hardware);
+            IdGenerator id_generator;
+            std::vector<uint8_t> ids(kKeyCount * kIdPerKey * kIdLength);
+            ASSERT_TRUE(id_generator.GenerateIdsBatch(teks.data(), start_intervals.data(),
+                                                      id_counts.data(), kKeyCount, ids.data()));
+            DisableHardwareCryptoForTesting(false);
+            for (int i = 0; i < kKeyCount; i++) {
+              const uint8_t *slot = &ids[i * kIdPerKey * kIdLength];
+              EXPECT_EQ(ExpectedRpis(i % 7, id_counts[i]),
+                        std::vector<uint8_t>(slot, slot + id_counts[i] * kIdLength))
+                  << "key " << i;
+            }
+          }
+        }
+    }  // namespace
+}  // namespace exposure
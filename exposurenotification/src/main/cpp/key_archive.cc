@@ -0,0 +1,291 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "key_archive.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+#include "constants.h"
+
+namespace exposure {
+    namespace {
+        constexpr static const uint32_t kLocalFileHeaderSignature = 0x04034b50;
+        constexpr static const uint32_t kCentralDirectorySignature = 0x02014b50;
+        constexpr static const uint32_t kEndOfCentralDirectorySignature = 0x06054b50;
+        constexpr static const size_t kLocalFileHeaderSize = 30;
+        constexpr static const size_t kCentralDirectoryHeaderSize = 46;
+        constexpr static const size_t kEndOfCentralDirectorySize = 22;
+        constexpr static const size_t kMaxCommentSize = 0xFFFF;
+        constexpr static const uint16_t kEncryptedFlag = 1 << 0;
+        constexpr static const uint16_t kStoredMethod = 0;
+        constexpr static const uint16_t kDeflatedMethod = 8;
+
+        inline uint16_t ReadLe16(const uint8_t *p) {
+          return static_cast<uint16_t>(p[0] | (p[1] << 8));
+        }
+
+        inline uint32_t ReadLe32(const uint8_t *p) {
+          return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+                 (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+        }
+
+        // Returns the offset of the end of central directory record, or size if
+        // there is none.
+        size_t FindEndOfCentralDirectory(const uint8_t *data, size_t size) {
+          if (size < kEndOfCentralDirectorySize) {
+            return size;
+          }
+          // The record is followed by a comment of up to kMaxCommentSize bytes.
+          const size_t last = size - kEndOfCentralDirectorySize;
+          const size_t first = last > kMaxCommentSize ? last - kMaxCommentSize : 0;
+          for (size_t offset = last + 1; offset-- > first;) {
+            if (ReadLe32(&data[offset]) == kEndOfCentralDirectorySignature) {
+              return offset;
+            }
+          }
+          return size;
+        }
+    }  // namespace
+
+    KeyFileStream::KeyFileStream(const uint8_t *data, size_t size)
+        : data_(data),
+          data_size_(size),
+          size_(size),
+          position_(0),
+          block_(nullptr),
+          block_left_(0),
+          inflating_(false),
+          check_crc_(false),
+          crc_(0),
+          expected_crc_(0),
+          failed_(false) {}
+
+    KeyFileStream::KeyFileStream(const uint8_t *compressed, size_t compressed_size,
+                                 uint16_t method, uint32_t size, uint32_t crc)
+        : KeyFileStream(compressed, compressed_size) {
+      size_ = size;
+      check_crc_ = true;
+      crc_ = crc32(0L, Z_NULL, 0);
+      expected_crc_ = crc;
+      failed_ = size == 0 && crc != crc_;
+      if (method == kDeflatedMethod && size > 0) {
+        memset(&inflater_, 0, sizeof(inflater_));
+        // Zip entries are raw deflate streams, without a zlib header.
+        inflating_ = inflateInit2(&inflater_, -MAX_WBITS) == Z_OK;
+        failed_ = !inflating_;
+        inflater_.next_in = const_cast<Bytef *>(compressed);
+        inflater_.avail_in = static_cast<uInt>(compressed_size);
+        window_.reset(new uint8_t[kKeyFileBlockSize]);
+      }
+    }
+
+    KeyFileStream::~KeyFileStream() {
+      if (inflating_) {
+        inflateEnd(&inflater_);
+      }
+    }
+
+    bool KeyFileStream::Advance() {
+      if (failed_) {
+        return false;
+      }
+      const size_t block_size = std::min(kKeyFileBlockSize, size_ - position_);
+      if (!inflating_) {
+        block_ = data_ + position_;
+      } else {
+        inflater_.next_out = window_.get();
+        inflater_.avail_out = static_cast<uInt>(block_size);
+        int result = inflate(&inflater_, Z_NO_FLUSH);
+        failed_ = (result != Z_OK && result != Z_STREAM_END) || inflater_.avail_out != 0;
+        if (!failed_ && position_ + block_size == size_ && result != Z_STREAM_END) {
+          // The entry must end right after its last byte.
+          uint8_t extra;
+          inflater_.next_out = &extra;
+          inflater_.avail_out = 1;
+          result = inflate(&inflater_, Z_FINISH);
+          failed_ = result != Z_STREAM_END || inflater_.avail_out != 1;
+        }
+        block_ = window_.get();
+      }
+      position_ += block_size;
+      block_left_ = block_size;
+      if (check_crc_ && !failed_) {
+        crc_ = static_cast<uint32_t>(crc32(crc_, block_, static_cast<uInt>(block_size)));
+        failed_ = position_ == size_ && crc_ != expected_crc_;
+      }
+      if (failed_) {
+        block_left_ = 0;
+        LOG_E("Key archive entry is corrupt");
+      }
+      return !failed_;
+    }
+
+    bool KeyFileStream::NextBlock(const uint8_t **block, size_t *block_size) {
+      if (block_left_ == 0) {
+        if (position_ == size_) {
+          *block_size = 0;
+          return !failed_;
+        }
+        if (!Advance()) {
+          return false;
+        }
+      }
+      *block = block_;
+      *block_size = block_left_;
+      block_left_ = 0;
+      return true;
+    }
+
+    bool KeyFileStream::Read(uint8_t *out, size_t size) {
+      if (failed_) {
+        return false;
+      }
+      while (size > 0) {
+        if (block_left_ == 0 && (position_ == size_ || !Advance())) {
+          return false;
+        }
+        const size_t count = std::min(size, block_left_);
+        memcpy(out, block_, count);
+        block_ += count;
+        block_left_ -= count;
+        out += count;
+        size -= count;
+      }
+      return true;
+    }
+
+    bool KeyArchive::IsKeyArchive(const uint8_t *data, size_t size) {
+      return size >= 4 && ReadLe32(data) == kLocalFileHeaderSignature;
+    }
+
+    std::unique_ptr<KeyArchive> KeyArchive::Read(const uint8_t *data, size_t size) {
+      const size_t end_offset = FindEndOfCentralDirectory(data, size);
+      if (end_offset == size) {
+        LOG_E("Key archive has no central directory");
+        return nullptr;
+      }
+      const uint8_t *end_record = &data[end_offset];
+      const int entry_count = ReadLe16(&end_record[10]);
+      const size_t directory_size = ReadLe32(&end_record[12]);
+      size_t offset = ReadLe32(&end_record[16]);
+      if (offset > end_offset || directory_size > end_offset - offset) {
+        LOG_E("Key archive central directory out of bounds");
+        return nullptr;
+      }
+      const size_t directory_end = offset + directory_size;
+
+      std::unique_ptr<KeyArchive> archive(new KeyArchive());
+      Entry signature_file;
+      bool has_key_file = false;
+      bool has_signature_file = false;
+      for (int i = 0; i < entry_count; i++) {
+        if (directory_end - offset < kCentralDirectoryHeaderSize ||
+            ReadLe32(&data[offset]) != kCentralDirectorySignature) {
+          LOG_E("Malformed key archive central directory");
+          return nullptr;
+        }
+        const uint8_t *header = &data[offset];
+        const uint16_t flags = ReadLe16(&header[8]);
+        const uint16_t method = ReadLe16(&header[10]);
+        const uint32_t crc = ReadLe32(&header[16]);
+        const uint32_t compressed_size = ReadLe32(&header[20]);
+        const uint32_t entry_size = ReadLe32(&header[24]);
+        const size_t name_size = ReadLe16(&header[28]);
+        const size_t header_size = kCentralDirectoryHeaderSize + name_size +
+                                   ReadLe16(&header[30]) + ReadLe16(&header[32]);
+        const size_t local_offset = ReadLe32(&header[42]);
+        if (directory_end - offset < header_size) {
+          LOG_E("Malformed key archive central directory");
+          return nullptr;
+        }
+        offset += header_size;
+
+        const std::string name(reinterpret_cast<const char *>(&header[46]), name_size);
+        Entry *entry;
+        bool *has_entry;
+        uint32_t max_entry_size;
+        if (name == kKeyArchiveKeyFileName) {
+          entry = &archive->key_file_;
+          has_entry = &has_key_file;
+          max_entry_size = kMaxKeyArchiveEntrySize;
+        } else if (name == kKeyArchiveSignatureFileName) {
+          entry = &signature_file;
+          has_entry = &has_signature_file;
+          max_entry_size = kMaxKeyArchiveSignatureSize;
+        } else {
+          LOG_E("Invalid key archive entry %s", name.c_str());
+          return nullptr;
+        }
+        if (*has_entry) {
+          LOG_E("Key archive contains multiple %s", name.c_str());
+          return nullptr;
+        }
+        if ((flags & kEncryptedFlag) != 0 || entry_size > max_entry_size) {
+          LOG_E("Unsupported key archive entry %s", name.c_str());
+          return nullptr;
+        }
+        if (method != kStoredMethod && method != kDeflatedMethod) {
+          LOG_E("Unsupported key archive compression method %d", method);
+          return nullptr;
+        }
+
+        // The data follows the local header, whose name and extra field may
+        // differ from those in the central directory.
+        if (local_offset > end_offset ||
+            end_offset - local_offset < kLocalFileHeaderSize ||
+            ReadLe32(&data[local_offset]) != kLocalFileHeaderSignature) {
+          LOG_E("Malformed key archive entry %s", name.c_str());
+          return nullptr;
+        }
+        const size_t data_offset = local_offset + kLocalFileHeaderSize +
+                                   ReadLe16(&data[local_offset + 26]) +
+                                   ReadLe16(&data[local_offset + 28]);
+        if (data_offset > end_offset || end_offset - data_offset < compressed_size ||
+            (method == kStoredMethod && compressed_size != entry_size)) {
+          LOG_E("Malformed key archive entry %s", name.c_str());
+          return nullptr;
+        }
+        *entry = Entry{&data[data_offset], compressed_size, method, entry_size, crc};
+        *has_entry = true;
+      }
+
+      if (!has_key_file || !has_signature_file) {
+        LOG_E("Key archive lacks %s", has_key_file ? kKeyArchiveSignatureFileName
+                                                   : kKeyArchiveKeyFileName);
+        return nullptr;
+      }
+      archive->signature_file_.resize(signature_file.size);
+      if (!OpenEntry(signature_file)->Read(archive->signature_file_.data(),
+                                           signature_file.size)) {
+        LOG_E("Failed to inflate key archive entry %s", kKeyArchiveSignatureFileName);
+        return nullptr;
+      }
+      return archive;
+    }
+
+    std::unique_ptr<KeyFileStream> KeyArchive::OpenKeyFile() const {
+      return OpenEntry(key_file_);
+    }
+
+    std::unique_ptr<KeyFileStream> KeyArchive::OpenEntry(const Entry &entry) {
+      return std::unique_ptr<KeyFileStream>(new KeyFileStream(
+          entry.data, entry.compressed_size, entry.method, entry.size, entry.crc));
+    }
+}  // namespace exposure
@@ -0,0 +1,134 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LOCATION_NEARBY_CPP_EXPOSURENOTIFICATION_JNI_KEY_ARCHIVE_H_
+#define LOCATION_NEARBY_CPP_EXPOSURENOTIFICATION_JNI_KEY_ARCHIVE_H_
+
+#include <zlib.h>
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace exposure {
+    static const char kKeyArchiveKeyFileName[] = "export.bin";
+    static const char kKeyArchiveSignatureFileName[] = "export.sig";
+    // Upper bound of the inflated size of export.bin, so that a malicious
+    // archive cannot keep matching busy for long.
+    constexpr static const uint32_t kMaxKeyArchiveEntrySize = 256 * 1024 * 1024;  // 256 MB
+    // Upper bound of the inflated size of export.sig, which is held whole.
+    constexpr static const uint32_t kMaxKeyArchiveSignatureSize = 64 * 1024;  // 64 KB
+    // Bytes a KeyFileStream returns at a time, small enough to still be cached
+    // when they are walked after being hashed.
+    constexpr static const size_t kKeyFileBlockSize = 64 * 1024;  // 64 KB
+
+    // The bytes of a key file, read front to back a block at a time: in place
+    // from memory, or inflated from a key archive entry into a single block,
+    // so that the entry is never held whole in memory.
+    class KeyFileStream {
+    public:
+        // Reads the size bytes at data in place.
+        KeyFileStream(const uint8_t *data, size_t size);
+
+        ~KeyFileStream();
+
+        KeyFileStream(const KeyFileStream &) = delete;
+        KeyFileStream &operator=(const KeyFileStream &) = delete;
+
+        inline size_t Size() const { return size_; }
+
+        // Points block at the next bytes, at most kKeyFileBlockSize of them and
+        // valid until the following call, or sets block_size to 0 once all are
+        // read. Returns false if an archive entry is corrupt or, once read
+        // whole, fails its CRC.
+        bool NextBlock(const uint8_t **block, size_t *block_size);
+
+        // Copies the next size bytes to out. Returns false if fewer are left,
+        // or as NextBlock does.
+        bool Read(uint8_t *out, size_t size);
+
+    private:
+        friend class KeyArchive;
+
+        // Inflates the compressed_size bytes at compressed, an archive entry of
+        // size bytes stored with method, and checks them against crc.
+        KeyFileStream(const uint8_t *compressed, size_t compressed_size, uint16_t method,
+                      uint32_t size, uint32_t crc);
+
+        // Moves block_ to the bytes following it.
+        bool Advance();
+
+        const uint8_t *data_;
+        size_t data_size_;
+        size_t size_;
+        // Bytes up to the end of block_.
+        size_t position_;
+        const uint8_t *block_;
+        size_t block_left_;
+        bool inflating_;
+        z_stream inflater_;
+        std::unique_ptr<uint8_t[]> window_;
+        bool check_crc_;
+        uint32_t crc_;
+        uint32_t expected_crc_;
+        bool failed_;
+    };
+
+    // A diagnosis key zip archive, as downloaded from a key server, read in
+    // place. export.sig is inflated into memory, and export.bin as it is
+    // read, so that keys are decoded and verified without writing them to a
+    // file first.
+    class KeyArchive {
+    public:
+        // Returns whether the size bytes at data start like a zip archive
+        // rather than a key file.
+        static bool IsKeyArchive(const uint8_t *data, size_t size);
+
+        // Reads the central directory of the size bytes of zip archive at data,
+        // which must outlive the archive, and inflates its export.sig. Returns
+        // null if the archive is malformed, an entry is missing or repeated, it
+        // has any other entry, as ProvideDiagnosisKeys.unzip does, or export.sig
+        // fails its CRC.
+        static std::unique_ptr<KeyArchive> Read(const uint8_t *data, size_t size);
+
+        KeyArchive(const KeyArchive &) = delete;
+        KeyArchive &operator=(const KeyArchive &) = delete;
+
+        // Starts inflating the export.bin entry from its first byte.
+        std::unique_ptr<KeyFileStream> OpenKeyFile() const;
+
+        // The export.sig entry, a serialized TEKSignatureList.
+        inline const std::vector<uint8_t> &SignatureFile() const { return signature_file_; }
+
+    private:
+        // Where an entry is stored in the archive.
+        struct Entry {
+            const uint8_t *data;
+            uint32_t compressed_size;
+            uint16_t method;
+            uint32_t size;
+            uint32_t crc;
+        };
+
+        KeyArchive() = default;
+
+        static std::unique_ptr<KeyFileStream> OpenEntry(const Entry &entry);
+
+        Entry key_file_;
+        std::vector<uint8_t> signature_file_;
+    };
+}  // namespace exposure
+#endif  // LOCATION_NEARBY_CPP_EXPOSURENOTIFICATION_JNI_KEY_ARCHIVE_H_
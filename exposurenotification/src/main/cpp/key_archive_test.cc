@@ -0,0 +1,160 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "key_archive.h"
+
+#include <gtest/gtest.h>
+
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+namespace exposure {
+    namespace {
+        // A key server archive, and the entries unzip extracts from it.
+        constexpr char kSampleArchive[] = MATCHING_TESTDATA_DIR "/sample_diagnosis_key_file.zip";
+        constexpr char kSampleKeyFile[] =
+            MATCHING_TESTDATA_DIR "/sample_diagnosis_key_file_export.bin";
+        constexpr char kSampleSignatureFile[] =
+            MATCHING_TESTDATA_DIR "/sample_diagnosis_key_file_export.sig";
+
+        std::vector<uint8_t> ReadFile(const char *path) {
+          std::ifstream file(path, std::ios::binary);
+          return std::vector<uint8_t>(std::istreambuf_iterator<char>(file),
+                                      std::istreambuf_iterator<char>());
+        }
+
+        // Reads stream whole a block at a time. Returns false if it fails.
+        bool ReadBlocks(KeyFileStream *stream, std::vector<uint8_t> *contents) {
+          const uint8_t *block;
+          size_t block_size;
+          while (stream->NextBlock(&block, &block_size)) {
+            if (block_size == 0) {
+              return true;
+            }
+            EXPECT_LE(block_size, kKeyFileBlockSize);
+            contents->insert(contents->end(), block, block + block_size);
+          }
+          return false;
+        }
+
+        // The offset of the first 4 bytes of archive from begin equal to
+        // signature, or the size of archive if there are none.
+        size_t FindSignature(const std::vector<uint8_t> &archive, uint32_t signature,
+                             size_t begin = 0) {
+          for (size_t offset = begin; offset + 4 <= archive.size(); offset++) {
+            if (archive[offset] == (signature & 0xFF) &&
+                archive[offset + 1] == ((signature >> 8) & 0xFF) &&
+                archive[offset + 2] == ((signature >> 16) & 0xFF) &&
+                archive[offset + 3] == signature >> 24) {
+              return offset;
+            }
+          }
+          return archive.size();
+        }
+
+        TEST(KeyArchiveTest, InflatesSampleArchiveAsUnzip) {
+          const std::vector<uint8_t> archive_data = ReadFile(kSampleArchive);
+          const std::vector<uint8_t> key_file = ReadFile(kSampleKeyFile);
+          ASSERT_FALSE(key_file.empty());
+          ASSERT_TRUE(KeyArchive::IsKeyArchive(archive_data.data(), archive_data.size()));
+          std::unique_ptr<KeyArchive> archive =
+              KeyArchive::Read(archive_data.data(), archive_data.size());
+          ASSERT_NE(nullptr, archive);
+          EXPECT_EQ(ReadFile(kSampleSignatureFile), archive->SignatureFile());
+
+          std::vector<uint8_t> contents;
+          std::unique_ptr<KeyFileStream> stream = archive->OpenKeyFile();
+          EXPECT_EQ(key_file.size(), stream->Size());
+          EXPECT_TRUE(ReadBlocks(stream.get(), &contents));
+          EXPECT_EQ(key_file, contents);
+
+          // Reads of any size, each entry read from its first byte.
+          stream = archive->OpenKeyFile();
+          contents.assign(key_file.size(), 0);
+          for (size_t offset = 0; offset < contents.size(); offset += 7) {
+            ASSERT_TRUE(stream->Read(&contents[offset],
+                                     std::min<size_t>(7, contents.size() - offset)));
+          }
+          EXPECT_EQ(key_file, contents);
+          uint8_t extra;
+          EXPECT_FALSE(stream->Read(&extra, 1));
+        }
+
+        TEST(KeyArchiveTest, ReadsKeyFileInPlace) {
+          std::vector<uint8_t> key_file(3 * kKeyFileBlockSize + 5);
+          for (size_t i = 0; i < key_file.size(); i++) {
+            key_file[i] = static_cast<uint8_t>(i * 7);
+          }
+          KeyFileStream stream(key_file.data(), key_file.size());
+          std::vector<uint8_t> contents;
+          EXPECT_TRUE(ReadBlocks(&stream, &contents));
+          EXPECT_EQ(key_file, contents);
+        }
+
+        TEST(KeyArchiveTest, FailsOnCorruptKeyFileEntry) {
+          const std::vector<uint8_t> archive_data = ReadFile(kSampleArchive);
+          const size_t directory = FindSignature(archive_data, 0x02014b50);
+          ASSERT_LT(directory, archive_data.size());
+
+          // A wrong CRC is found once the entry is read whole.
+          std::vector<uint8_t> corrupt = archive_data;
+          corrupt[directory + 16] ^= 1;
+          std::unique_ptr<KeyArchive> archive = KeyArchive::Read(corrupt.data(), corrupt.size());
+          ASSERT_NE(nullptr, archive);
+          std::vector<uint8_t> contents;
+          EXPECT_FALSE(ReadBlocks(archive->OpenKeyFile().get(), &contents));
+
+          // So are corrupt deflated data, and a size the data does not have.
+          corrupt = archive_data;
+          corrupt[100] ^= 0x55;
+          archive = KeyArchive::Read(corrupt.data(), corrupt.size());
+          ASSERT_NE(nullptr, archive);
+          contents.clear();
+          EXPECT_FALSE(ReadBlocks(archive->OpenKeyFile().get(), &contents));
+
+          corrupt = archive_data;
+          corrupt[directory + 24]--;
+          archive = KeyArchive::Read(corrupt.data(), corrupt.size());
+          ASSERT_NE(nullptr, archive);
+          contents.clear();
+          EXPECT_FALSE(ReadBlocks(archive->OpenKeyFile().get(), &contents));
+        }
+
+        TEST(KeyArchiveTest, RejectsMalformedArchive) {
+          const std::vector<uint8_t> archive_data = ReadFile(kSampleArchive);
+          const size_t directory = FindSignature(archive_data, 0x02014b50);
+          ASSERT_LT(directory, archive_data.size());
+
+          // No central directory.
+          EXPECT_EQ(nullptr, KeyArchive::Read(archive_data.data(), directory));
+
+          // An entry other than export.bin and export.sig.
+          std::vector<uint8_t> corrupt = archive_data;
+          corrupt[directory + 46] = 'E';
+          EXPECT_EQ(nullptr, KeyArchive::Read(corrupt.data(), corrupt.size()));
+
+          // A corrupt export.sig, which is inflated up front.
+          corrupt = archive_data;
+          const size_t signature_directory =
+              FindSignature(archive_data, 0x02014b50, directory + 1);
+          ASSERT_LT(signature_directory, archive_data.size());
+          corrupt[signature_directory + 16] ^= 1;
+          EXPECT_EQ(nullptr, KeyArchive::Read(corrupt.data(), corrupt.size()));
+        }
+    }  // namespace
+}  // namespace exposure
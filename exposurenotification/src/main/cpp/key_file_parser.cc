@@ -16,7 +16,327 @@
 
 #include "key_file_parser.h"
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "key_archive.h"
+
 namespace exposure {
+    namespace {
+        // Bits of KeyBatch::present_fields_.
+        constexpr static const uint8_t kHasRollingStartIntervalNumber = 1 << 0;
+        constexpr static const uint8_t kHasRollingPeriod = 1 << 1;
+        constexpr static const uint8_t kHasTransmissionRiskLevel = 1 << 2;
+        constexpr static const uint8_t kHasReportType = 1 << 3;
+        constexpr static const uint8_t kHasDaysSinceOnsetOfSymptoms = 1 << 4;
+
+        // Keys larger than this, which only unknown fields make them, are
+        // copied to the heap when read through stdio.
+        constexpr static const size_t kMaxInlineKeyMessageSize = 128;
+
+        constexpr pb_byte_t FieldKey(int tag, pb_wire_type_t wire_type) {
+          return static_cast<pb_byte_t>((tag << 3) | wire_type);
+        }
+
+        constexpr static const pb_byte_t kKeyDataKey = FieldKey(
+            com_google_samples_exposurenotification_TemporaryExposureKey_key_data_tag,
+            PB_WT_STRING);
+        constexpr static const pb_byte_t kTransmissionRiskLevelKey = FieldKey(
+            com_google_samples_exposurenotification_TemporaryExposureKey_transmission_risk_level_tag,
+            PB_WT_VARINT);
+        constexpr static const pb_byte_t kRollingStartIntervalNumberKey = FieldKey(
+            com_google_samples_exposurenotification_TemporaryExposureKey_rolling_start_interval_number_tag,
+            PB_WT_VARINT);
+        constexpr static const pb_byte_t kRollingPeriodKey = FieldKey(
+            com_google_samples_exposurenotification_TemporaryExposureKey_rolling_period_tag,
+            PB_WT_VARINT);
+        constexpr static const pb_byte_t kReportTypeKey = FieldKey(
+            com_google_samples_exposurenotification_TemporaryExposureKey_report_type_tag,
+            PB_WT_VARINT);
+        constexpr static const pb_byte_t kDaysSinceOnsetOfSymptomsKey = FieldKey(
+            com_google_samples_exposurenotification_TemporaryExposureKey_days_since_onset_of_symptoms_tag,
+            PB_WT_VARINT);
+        constexpr static const pb_byte_t kKeysKey =
+            FieldKey(TemporaryExposureKeyExportNano_keys_tag, PB_WT_STRING);
+        constexpr static const pb_byte_t kStartTimestampKey = FieldKey(
+            com_google_samples_exposurenotification_TemporaryExposureKeyExport_start_timestamp_tag,
+            PB_WT_64BIT);
+        constexpr static const pb_byte_t kEndTimestampKey = FieldKey(
+            com_google_samples_exposurenotification_TemporaryExposureKeyExport_end_timestamp_tag,
+            PB_WT_64BIT);
+        constexpr static const pb_byte_t kRegionKey = FieldKey(
+            com_google_samples_exposurenotification_TemporaryExposureKeyExport_region_tag,
+            PB_WT_STRING);
+        constexpr static const pb_byte_t kBatchNumKey = FieldKey(
+            com_google_samples_exposurenotification_TemporaryExposureKeyExport_batch_num_tag,
+            PB_WT_VARINT);
+        constexpr static const pb_byte_t kBatchSizeKey = FieldKey(
+            com_google_samples_exposurenotification_TemporaryExposureKeyExport_batch_size_tag,
+            PB_WT_VARINT);
+        // Largest tag whose field key fits in a single byte.
+        constexpr static const uint32_t kMaxSingleByteKeyTag = 15;
+        // Regions are country codes; longer ones are skipped rather than copied.
+        constexpr static const uint32_t kMaxRegionSize = 64;
+
+        // Reads a varint of at most 5 bytes holding a 32-bit value, as encoded
+        // for non-negative int32 and all sint32 values. Returns false for
+        // anything else.
+        inline bool ReadVarint32(const pb_byte_t **cursor, const pb_byte_t *end,
+                                 uint32_t *value) {
+          const pb_byte_t *p = *cursor;
+          uint32_t result = 0;
+          for (int shift = 0; shift < 35 && p < end; shift += 7) {
+            pb_byte_t byte = *p++;
+            if (shift == 28 && byte > 0x0F) {
+              return false;
+            }
+            result |= static_cast<uint32_t>(byte & 0x7F) << shift;
+            if (byte < 0x80) {
+              *cursor = p;
+              *value = result;
+              return true;
+            }
+          }
+          return false;
+        }
+
+        // Decodes the export field at stream, whose tag was just read, into
+        // metadata if it is a header field, and skips it otherwise. Returns false
+        // if it cannot be read.
+        bool ReadExportField(pb_istream_t *stream, uint32_t tag, pb_wire_type_t wire_type,
+                             KeyFileMetadata *metadata) {
+          const pb_byte_t key =
+              tag <= kMaxSingleByteKeyTag ? FieldKey(static_cast<int>(tag), wire_type) : 0;
+          uint64_t value;
+          uint32_t length;
+          switch (key) {
+            case kStartTimestampKey:
+              metadata->has_start_timestamp =
+                  pb_decode_fixed64(stream, &metadata->start_timestamp);
+              return metadata->has_start_timestamp;
+            case kEndTimestampKey:
+              metadata->has_end_timestamp = pb_decode_fixed64(stream, &metadata->end_timestamp);
+              return metadata->has_end_timestamp;
+            case kBatchNumKey:
+              metadata->has_batch_num = pb_decode_varint(stream, &value);
+              metadata->batch_num = static_cast<int32_t>(value);
+              return metadata->has_batch_num;
+            case kBatchSizeKey:
+              metadata->has_batch_size = pb_decode_varint(stream, &value);
+              metadata->batch_size = static_cast<int32_t>(value);
+              return metadata->has_batch_size;
+            case kRegionKey:
+              if (!pb_decode_varint32(stream, &length) || length > stream->bytes_left) {
+                return false;
+              }
+              if (length > kMaxRegionSize) {
+                return pb_read(stream, nullptr, length);
+              }
+              metadata->region.resize(length);
+              return pb_read(stream, reinterpret_cast<pb_byte_t *>(&metadata->region[0]),
+                             length);
+            default:
+              return pb_skip_field(stream, wire_type);
+          }
+        }
+
+        void AddRollingStart(int32_t rolling_start_interval_number, KeyFileMetadata *metadata) {
+          if (metadata->decoded_key_count++ == 0) {
+            metadata->min_rolling_start_interval_number = rolling_start_interval_number;
+            metadata->max_rolling_start_interval_number = rolling_start_interval_number;
+            return;
+          }
+          metadata->min_rolling_start_interval_number =
+              std::min(metadata->min_rolling_start_interval_number, rolling_start_interval_number);
+          metadata->max_rolling_start_interval_number =
+              std::max(metadata->max_rolling_start_interval_number, rolling_start_interval_number);
+        }
+    }  // namespace
+
+    void KeyFileMetadata::Merge(const KeyFileMetadata &other) {
+      if (other.has_start_timestamp) {
+        has_start_timestamp = true;
+        start_timestamp = other.start_timestamp;
+      }
+      if (other.has_end_timestamp) {
+        has_end_timestamp = true;
+        end_timestamp = other.end_timestamp;
+      }
+      if (!other.region.empty()) {
+        region = other.region;
+      }
+      if (other.has_batch_num) {
+        has_batch_num = true;
+        batch_num = other.batch_num;
+      }
+      if (other.has_batch_size) {
+        has_batch_size = true;
+        batch_size = other.batch_size;
+      }
+      key_count += other.key_count;
+      if (other.decoded_key_count == 0) {
+        return;
+      }
+      if (decoded_key_count == 0) {
+        min_rolling_start_interval_number = other.min_rolling_start_interval_number;
+        max_rolling_start_interval_number = other.max_rolling_start_interval_number;
+      } else {
+        min_rolling_start_interval_number = std::min(min_rolling_start_interval_number,
+                                                     other.min_rolling_start_interval_number);
+        max_rolling_start_interval_number = std::max(max_rolling_start_interval_number,
+                                                     other.max_rolling_start_interval_number);
+      }
+      decoded_key_count += other.decoded_key_count;
+    }
+
+    bool DecodeKeyFast(const pb_byte_t *message, size_t length,
+                       TemporaryExposureKeyNano *key) {
+      const pb_byte_t *p = message;
+      const pb_byte_t *end = message + length;
+      uint32_t value;
+      while (p < end) {
+        switch (*p++) {
+          case kKeyDataKey:
+            if (end - p < 1 + kTekLength || *p != kTekLength) {
+              return false;
+            }
+            memcpy(key->key_data.bytes, p + 1, kTekLength);
+            key->key_data.size = kTekLength;
+            key->has_key_data = true;
+            p += 1 + kTekLength;
+            break;
+          case kTransmissionRiskLevelKey:
+            if (!ReadVarint32(&p, end, &value)) {
+              return false;
+            }
+            key->transmission_risk_level = static_cast<int32_t>(value);
+            key->has_transmission_risk_level = true;
+            break;
+          case kRollingStartIntervalNumberKey:
+            if (!ReadVarint32(&p, end, &value)) {
+              return false;
+            }
+            key->rolling_start_interval_number = static_cast<int32_t>(value);
+            key->has_rolling_start_interval_number = true;
+            break;
+          case kRollingPeriodKey:
+            if (!ReadVarint32(&p, end, &value)) {
+              return false;
+            }
+            key->rolling_period = static_cast<int32_t>(value);
+            key->has_rolling_period = true;
+            break;
+          case kReportTypeKey:
+            if (!ReadVarint32(&p, end, &value)) {
+              return false;
+            }
+            key->report_type =
+                static_cast<decltype(key->report_type)>(static_cast<int32_t>(value));
+            key->has_report_type = true;
+            break;
+          case kDaysSinceOnsetOfSymptomsKey:
+            if (!ReadVarint32(&p, end, &value)) {
+              return false;
+            }
+            // Zigzag decoding.
+            key->days_since_onset_of_symptoms =
+                static_cast<int32_t>((value >> 1) ^ (0u - (value & 1)));
+            key->has_days_since_onset_of_symptoms = true;
+            break;
+          default:
+            return false;
+        }
+      }
+      return true;
+    }
+
+    bool DecodeKey(const pb_byte_t *message, size_t length,
+                   TemporaryExposureKeyNano *key) {
+      *key = TemporaryExposureKeyNano_init_default;
+      if (DecodeKeyFast(message, length, key)) {
+        return true;
+      }
+      *key = TemporaryExposureKeyNano_init_default;
+      pb_istream_t message_stream = pb_istream_from_buffer(message, length);
+      return pb_decode(&message_stream, TemporaryExposureKeyNano_fields, key);
+    }
+
+    std::unique_ptr<KeyFileContents> KeyFileContents::Map(const std::string &key_file) {
+      int fd = open(key_file.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0) {
+        return nullptr;
+      }
+      struct stat file_stat;
+      void *mapped = MAP_FAILED;
+      size_t file_size = 0;
+      if (fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode) &&
+          file_stat.st_size > 0) {
+        file_size = static_cast<size_t>(file_stat.st_size);
+        mapped = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      }
+      close(fd);
+      if (mapped == MAP_FAILED) {
+        return nullptr;
+      }
+      madvise(mapped, file_size, MADV_SEQUENTIAL);
+      return std::unique_ptr<KeyFileContents>(new KeyFileContents(mapped, file_size));
+    }
+
+    std::unique_ptr<KeyFileContents> KeyFileContents::Open(const std::string &key_file) {
+      std::unique_ptr<KeyFileContents> contents = Map(key_file);
+      if (contents == nullptr) {
+        LOG_E("Failed to map file %s", key_file.c_str());
+        return nullptr;
+      }
+      if (contents->IsKeyArchive() && !contents->OpenArchive()) {
+        LOG_E("Failed to open key archive %s", key_file.c_str());
+        return nullptr;
+      }
+      if (!contents->HasHeader()) {
+        LOG_E("Failed to verify the file header %s", key_file.c_str());
+        return nullptr;
+      }
+      return contents;
+    }
+
+    KeyFileContents::KeyFileContents(void *mapped, size_t mapped_size)
+        : mapped_(mapped), data_(static_cast<const uint8_t *>(mapped)), size_(mapped_size) {}
+
+    KeyFileContents::~KeyFileContents() {
+      // The archive reads from the mapping.
+      archive_.reset();
+      munmap(mapped_, size_);
+    }
+
+    bool KeyFileContents::IsKeyArchive() const {
+      return KeyArchive::IsKeyArchive(data_, size_);
+    }
+
+    bool KeyFileContents::OpenArchive() {
+      archive_ = KeyArchive::Read(data_, size_);
+      return archive_ != nullptr;
+    }
+
+    std::unique_ptr<KeyFileStream> KeyFileContents::NewStream() const {
+      if (archive_ != nullptr) {
+        return archive_->OpenKeyFile();
+      }
+      return std::make_unique<KeyFileStream>(data_, size_);
+    }
+
+    bool KeyFileContents::HasHeader() const {
+      if (archive_ == nullptr) {
+        return size_ >= kFileHeaderSize && memcmp(data_, kFileHeader, kFileHeaderSize) == 0;
+      }
+      uint8_t header[kFileHeaderSize];
+      return archive_->OpenKeyFile()->Read(header, kFileHeaderSize) &&
+             memcmp(header, kFileHeader, kFileHeaderSize) == 0;
+    }
+
     bool VerifyHeader(pb_istream_t *pb_istream) {
       char header[kFileHeaderSize] = {0};
       pb_read(pb_istream, reinterpret_cast<pb_byte_t *>(header), kFileHeaderSize);
@@ -30,6 +350,32 @@ namespace exposure {
 
     std::unique_ptr<KeyFileIterator> CreateKeyFileIterator(
         const std::string &key_file) {
+      std::unique_ptr<KeyFileContents> contents = KeyFileContents::Map(key_file);
+      if (contents != nullptr && contents->IsKeyArchive()) {
+        if (!contents->OpenArchive()) {
+          LOG_E("Failed to open key archive %s", key_file.c_str());
+          return nullptr;
+        }
+        std::unique_ptr<KeyFileStream> stream = contents->NewStream();
+        pb_istream_t pb_istream = CreatePbInputStream(stream.get());
+        if (!VerifyHeader(&pb_istream)) {
+          LOG_E("Failed to verify the file header %s", key_file.c_str());
+          return nullptr;
+        }
+        LOG_I("Created archive iterator for %s", key_file.c_str());
+        return std::make_unique<KeyFileIterator>(std::move(contents), std::move(stream),
+                                                 pb_istream);
+      }
+      if (contents != nullptr) {
+        if (!contents->HasHeader()) {
+          LOG_E("Failed to verify the file header %s", key_file.c_str());
+          return nullptr;
+        }
+        LOG_I("Created mapped iterator for %s", key_file.c_str());
+        const size_t size = contents->Size();
+        return std::make_unique<KeyFileIterator>(std::move(contents), kFileHeaderSize, size);
+      }
+
       FILE *file = fopen(key_file.c_str(), "rb");
       if (file == nullptr) {
         LOG_E("Failed to open file %s", key_file.c_str());
@@ -50,33 +396,290 @@ namespace exposure {
       return std::make_unique<KeyFileIterator>(file, std::move(buffer), pb_istream);
     }
 
+    std::vector<KeyFileChunk> SplitKeyFile(const std::string &key_file,
+                                           int max_chunk_count) {
+      std::vector<KeyFileChunk> chunks;
+      std::unique_ptr<KeyFileContents> contents = KeyFileContents::Map(key_file);
+      // Archives are inflated front to back by a single iterator.
+      if (contents == nullptr || !contents->HasHeader()) {
+        return chunks;
+      }
+      const pb_byte_t *data = contents->Data();
+      const size_t file_size = contents->Size();
+
+      const size_t chunk_count = std::max<size_t>(
+          1, std::min(static_cast<size_t>(std::max(1, max_chunk_count)),
+                      file_size / kMinKeyFileChunkSize));
+      if (chunk_count == 1) {
+        chunks.push_back(KeyFileChunk{kFileHeaderSize, file_size});
+        return chunks;
+      }
+
+      // Chunk i ends at the first keys field at or past byte
+      // file_size / chunk_count * (i + 1); keys are about the same size, so the
+      // chunks hold about as many keys.
+      size_t chunk_begin = kFileHeaderSize;
+      size_t chunk_end = file_size / chunk_count;
+      size_t offset = kFileHeaderSize;
+      bool malformed = false;
+      while (offset < file_size) {
+        if (data[offset] == kKeysKey) {
+          if (offset >= chunk_end && offset > chunk_begin) {
+            chunks.push_back(KeyFileChunk{chunk_begin, offset});
+            chunk_begin = offset;
+            chunk_end = file_size / chunk_count * (chunks.size() + 1);
+          }
+          // Almost all fields, and the only ones skipped inline.
+          const pb_byte_t *p = &data[offset + 1];
+          uint32_t key_size;
+          if (!ReadVarint32(&p, data + file_size, &key_size) ||
+              key_size > static_cast<size_t>(data + file_size - p)) {
+            malformed = true;
+            break;
+          }
+          offset = static_cast<size_t>(p - data) + key_size;
+          continue;
+        }
+        pb_istream_t pb_istream = pb_istream_from_buffer(&data[offset], file_size - offset);
+        pb_wire_type_t wire_type;
+        uint32_t tag;
+        bool eof;
+        if (!pb_decode_tag(&pb_istream, &wire_type, &tag, &eof) ||
+            !pb_skip_field(&pb_istream, wire_type)) {
+          malformed = true;
+          break;
+        }
+        offset = file_size - pb_istream.bytes_left;
+      }
+      if (malformed) {
+        // Parsed as a whole, the keys before the malformed field still match.
+        LOG_E("Failed to split key file %s", key_file.c_str());
+        chunks.clear();
+        return chunks;
+      }
+      chunks.push_back(KeyFileChunk{chunk_begin, file_size});
+      return chunks;
+    }
+
+    std::unique_ptr<KeyFileIterator> CreateKeyFileIterator(
+        const std::string &key_file, const KeyFileChunk &chunk) {
+      std::unique_ptr<KeyFileContents> contents = KeyFileContents::Map(key_file);
+      if (contents == nullptr) {
+        LOG_E("Failed to map file %s", key_file.c_str());
+        return nullptr;
+      }
+      if (chunk.begin > chunk.end || chunk.end > contents->Size()) {
+        LOG_E("Key file %s changed since it was split", key_file.c_str());
+        return nullptr;
+      }
+      return std::make_unique<KeyFileIterator>(std::move(contents), chunk.begin, chunk.end);
+    }
+
     void KeyFileIterator::ReadUntilNextKeyTagOrEnd() {
       pb_wire_type_t wire_type;
       bool eof = false;
       while (!eof) {
-        pb_decode_tag(&pb_istream_, &wire_type, &next_tag_, &eof);
+        if (!pb_decode_tag(&pb_istream_, &wire_type, &next_tag_, &eof)) {
+          if (!eof) {
+            LOG_E("Failed to decode key file field, the file is truncated");
+          }
+          next_tag_ = 0;
+          break;
+        }
         if (IsTagForKeys(next_tag_)) {
           break;
         }
-        pb_skip_field(&pb_istream_, wire_type);
+        if (next_tag_ == TemporaryExposureKeyExportNano_revised_keys_tag &&
+            wire_type == PB_WT_STRING) {
+          if (!ReadRevisedKey()) {
+            next_tag_ = 0;
+            break;
+          }
+          continue;
+        }
+        if (!ReadExportField(&pb_istream_, next_tag_, wire_type, &metadata_)) {
+          LOG_E("Failed to read key file field %u", next_tag_);
+          next_tag_ = 0;
+          break;
+        }
+      }
+    }
+
+    void KeyFileIterator::ReadHeaderFields(size_t end) {
+      pb_istream_t header_stream =
+          pb_istream_from_buffer(data_ + kFileHeaderSize, end - kFileHeaderSize);
+      pb_wire_type_t wire_type;
+      uint32_t tag;
+      bool eof;
+      while (pb_decode_tag(&header_stream, &wire_type, &tag, &eof) && !IsTagForKeys(tag)) {
+        if (!ReadExportField(&header_stream, tag, wire_type, &metadata_)) {
+          break;
+        }
+      }
+    }
+
+    size_t KeyFileIterator::SkipKeys() {
+      size_t skipped_key_count = 0;
+      while (IsTagForKeys(next_tag_)) {
+        uint32_t message_size;
+        // Reading into null only advances a buffer stream, and reads into a
+        // scratch buffer otherwise.
+        if (!pb_decode_varint32(&pb_istream_, &message_size) ||
+            message_size > pb_istream_.bytes_left ||
+            !pb_read(&pb_istream_, nullptr, message_size)) {
+          LOG_E("Failed to skip exposure key");
+          next_tag_ = 0;
+          break;
+        }
+        metadata_.key_count++;
+        skipped_key_count++;
+        ReadUntilNextKeyTagOrEnd();
+      }
+      return skipped_key_count;
+    }
+
+    KeyBatch::KeyBatch(size_t capacity)
+        : capacity_(capacity),
+          size_(0),
+          arena_(new uint8_t[capacity * (kTekLength + 5 * sizeof(int32_t) + 1)]) {
+      teks_ = arena_.get();
+      rolling_start_interval_numbers_ =
+          reinterpret_cast<int32_t *>(teks_ + capacity * kTekLength);
+      rolling_periods_ = rolling_start_interval_numbers_ + capacity;
+      transmission_risk_levels_ = rolling_periods_ + capacity;
+      report_types_ = transmission_risk_levels_ + capacity;
+      days_since_onset_of_symptoms_ = report_types_ + capacity;
+      present_fields_ = reinterpret_cast<uint8_t *>(days_since_onset_of_symptoms_ + capacity);
+    }
+
+    void KeyBatch::Append(const TemporaryExposureKeyNano &key) {
+      if (size_ == capacity_) {
+        return;
       }
+      memcpy(&teks_[size_ * kTekLength], key.key_data.bytes, kTekLength);
+      rolling_start_interval_numbers_[size_] = key.rolling_start_interval_number;
+      rolling_periods_[size_] = key.rolling_period;
+      transmission_risk_levels_[size_] = key.transmission_risk_level;
+      report_types_[size_] = static_cast<int32_t>(key.report_type);
+      days_since_onset_of_symptoms_[size_] = key.days_since_onset_of_symptoms;
+      present_fields_[size_] = static_cast<uint8_t>(
+          (key.has_rolling_start_interval_number ? kHasRollingStartIntervalNumber : 0) |
+          (key.has_rolling_period ? kHasRollingPeriod : 0) |
+          (key.has_transmission_risk_level ? kHasTransmissionRiskLevel : 0) |
+          (key.has_report_type ? kHasReportType : 0) |
+          (key.has_days_since_onset_of_symptoms ? kHasDaysSinceOnsetOfSymptoms : 0));
+      size_++;
     }
 
-    std::unique_ptr<TemporaryExposureKeyNano> KeyFileIterator::ReadNextKey() {
+    TemporaryExposureKeyNano KeyBatch::GetKey(size_t i) const {
+      TemporaryExposureKeyNano key = TemporaryExposureKeyNano_init_default;
+      key.has_key_data = true;
+      key.key_data.size = kTekLength;
+      memcpy(key.key_data.bytes, Tek(i), kTekLength);
+      key.rolling_start_interval_number = rolling_start_interval_numbers_[i];
+      key.rolling_period = rolling_periods_[i];
+      key.transmission_risk_level = transmission_risk_levels_[i];
+      key.report_type = static_cast<decltype(key.report_type)>(report_types_[i]);
+      key.days_since_onset_of_symptoms = days_since_onset_of_symptoms_[i];
+      const uint8_t present_fields = present_fields_[i];
+      key.has_rolling_start_interval_number =
+          (present_fields & kHasRollingStartIntervalNumber) != 0;
+      key.has_rolling_period = (present_fields & kHasRollingPeriod) != 0;
+      key.has_transmission_risk_level = (present_fields & kHasTransmissionRiskLevel) != 0;
+      key.has_report_type = (present_fields & kHasReportType) != 0;
+      key.has_days_since_onset_of_symptoms =
+          (present_fields & kHasDaysSinceOnsetOfSymptoms) != 0;
+      return key;
+    }
+
+    size_t KeyFileIterator::NextBatch(KeyBatch *batch) {
+      batch->Clear();
+      TemporaryExposureKeyNano key;
+      while (HasNext() && batch->Size() < batch->Capacity()) {
+        if (!ReadNextKey(&key)) {
+          continue;
+        }
+        if (!key.has_key_data || key.key_data.size != kTekLength) {
+          LOG_W("Skipped exposure key with %d bytes of key data",
+                key.has_key_data ? static_cast<int>(key.key_data.size) : 0);
+          continue;
+        }
+        batch->Append(key);
+      }
+      return batch->Size();
+    }
+
+    bool KeyFileIterator::ReadNextKey(TemporaryExposureKeyNano *key) {
       if (!IsTagForKeys(next_tag_)) {
         LOG_E("Unexpected proto buffer field");
-        return nullptr;
+        return false;
       }
 
-      TemporaryExposureKeyNano key = TemporaryExposureKeyNano_init_default;
-      if (!pb_decode_delimited(&pb_istream_, TemporaryExposureKeyNano_fields,
-                               &key)) {
-        LOG_E("Failed to decode exposure key");
-        return nullptr;
+      uint32_t message_size;
+      if (!pb_decode_varint32(&pb_istream_, &message_size) ||
+          message_size > pb_istream_.bytes_left) {
+        LOG_E("Failed to read exposure key size");
+        next_tag_ = 0;
+        return false;
+      }
+      // The key bytes, in place in a mapped file and copied out of stdio.
+      const pb_byte_t *message;
+      pb_byte_t message_copy[kMaxInlineKeyMessageSize];
+      std::vector<pb_byte_t> large_message_copy;
+      pb_byte_t *read_buffer = nullptr;
+      if (data_ != nullptr) {
+        message = data_ + (stream_end_ - pb_istream_.bytes_left);
+      } else if (message_size <= kMaxInlineKeyMessageSize) {
+        read_buffer = message_copy;
+        message = message_copy;
+      } else {
+        large_message_copy.resize(message_size);
+        read_buffer = large_message_copy.data();
+        message = read_buffer;
+      }
+      // Reading into null only advances a buffer stream.
+      if (!pb_read(&pb_istream_, read_buffer, message_size)) {
+        LOG_E("Failed to read exposure key");
+        next_tag_ = 0;
+        return false;
       }
 
+      const bool decoded = DecodeKey(message, message_size, key);
+      metadata_.key_count++;
+      if (decoded) {
+        AddRollingStart(key->rolling_start_interval_number, &metadata_);
+      }
+      // The key was read whole, so the following ones are still readable.
       ReadUntilNextKeyTagOrEnd();
-      return std::make_unique<TemporaryExposureKeyNano>(key);
+      if (!decoded) {
+        LOG_E("Failed to decode exposure key");
+      }
+      return decoded;
+    }
+
+    bool KeyFileIterator::ReadRevisedKey() {
+      uint32_t message_size;
+      if (!pb_decode_varint32(&pb_istream_, &message_size) ||
+          message_size > pb_istream_.bytes_left) {
+        LOG_E("Failed to read revised key size");
+        return false;
+      }
+      // Revised keys are few, so they are always copied.
+      std::vector<pb_byte_t> message(message_size);
+      if (!pb_read(&pb_istream_, message.data(), message_size)) {
+        LOG_E("Failed to read revised key");
+        return false;
+      }
+      TemporaryExposureKeyNano revised_key;
+      if (!DecodeKey(message.data(), message_size, &revised_key)) {
+        LOG_E("Failed to decode revised key");
+      } else if (!revised_key.has_key_data || revised_key.key_data.size != kTekLength) {
+        LOG_W("Skipped revised key with %d bytes of key data",
+              revised_key.has_key_data ? static_cast<int>(revised_key.key_data.size) : 0);
+      } else {
+        revised_keys_.push_back(revised_key);
+      }
+      return true;
     }
 
     bool ReadFromFileToStream(pb_istream_t *stream, pb_byte_t *buffer,
@@ -93,6 +696,20 @@ namespace exposure {
       return count == size;
     }
 
+    namespace {
+        bool ReadFromKeyFileStream(pb_istream_t *stream, pb_byte_t *buffer, size_t size) {
+          return reinterpret_cast<KeyFileStream *>(stream->state)->Read(buffer, size);
+        }
+    }  // namespace
+
+    pb_istream_t CreatePbInputStream(KeyFileStream *stream) {
+      pb_istream_t pb_istream;
+      pb_istream.callback = &ReadFromKeyFileStream;
+      pb_istream.state = reinterpret_cast<void *>(stream);
+      pb_istream.bytes_left = stream->Size();
+      return pb_istream;
+    }
+
     pb_istream_t CreatePbInputStream(FILE *file) {
       pb_istream_t pb_istream;
       pb_istream.callback = &ReadFromFileToStream;
@@ -17,18 +17,23 @@
 #ifndef LOCATION_NEARBY_CPP_EXPOSURENOTIFICATION_JNI_KEY_FILE_PARSER_H_
 #define LOCATION_NEARBY_CPP_EXPOSURENOTIFICATION_JNI_KEY_FILE_PARSER_H_
 
+#include <sys/mman.h>
+
 #include <string>
 #include <utility>
 #include <vector>
 
 #include "gen/exposure_key_export.pb.h"
 #include "constants.h"
+#include "key_archive.h"
 #include "pb_decode.h"
 
 #define TemporaryExposureKeyNano \
   com_google_samples_exposurenotification_TemporaryExposureKey
 #define TemporaryExposureKeyExportNano_keys_tag \
   com_google_samples_exposurenotification_TemporaryExposureKeyExport_keys_tag  // NOLINT
+#define TemporaryExposureKeyExportNano_revised_keys_tag \
+  com_google_samples_exposurenotification_TemporaryExposureKeyExport_revised_keys_tag  // NOLINT
 #define TemporaryExposureKeyNano_init_default \
   com_google_samples_exposurenotification_TemporaryExposureKey_init_default  // NOLINT
 #define TemporaryExposureKeyNano_fields \
@@ -38,6 +43,122 @@ namespace exposure {
     static const char kFileHeader[] = "EK Export v1    ";
     constexpr static const size_t kFileHeaderSize = sizeof(kFileHeader) - 1;
     constexpr static const int kDefaultBufferSize = 64 * 1024;  // 64 KB
+    // Smallest chunk SplitKeyFile cuts a key file into, about 8000 keys.
+    constexpr static const size_t kMinKeyFileChunkSize = 256 * 1024;  // 256 KB
+
+    // Keys decoded by KeyFileIterator::NextBatch, one column per field. The
+    // columns share a single allocation, made once and reused by every batch,
+    // and the key data is contiguous so that it can be passed as is to the
+    // batched ID derivation.
+    class KeyBatch {
+    public:
+        explicit KeyBatch(size_t capacity);
+
+        KeyBatch(const KeyBatch &) = delete;
+        KeyBatch &operator=(const KeyBatch &) = delete;
+
+        inline size_t Size() const { return size_; }
+        inline size_t Capacity() const { return capacity_; }
+        inline void Clear() { size_ = 0; }
+
+        // The key data of all keys, kTekLength bytes each.
+        inline const uint8_t *Teks() const { return teks_; }
+        inline const uint8_t *Tek(size_t i) const { return &teks_[i * kTekLength]; }
+        inline int32_t RollingStartIntervalNumber(size_t i) const {
+          return rolling_start_interval_numbers_[i];
+        }
+        // 144 for keys without a rolling period, as in the proto.
+        inline int32_t RollingPeriod(size_t i) const { return rolling_periods_[i]; }
+
+        // Appends key, which must have kTekLength bytes of key data, if the batch
+        // is not full.
+        void Append(const TemporaryExposureKeyNano &key);
+
+        // Returns key i with the fields present when it was decoded.
+        TemporaryExposureKeyNano GetKey(size_t i) const;
+
+    private:
+        size_t capacity_;
+        size_t size_;
+        std::unique_ptr<uint8_t[]> arena_;
+        uint8_t *teks_;
+        int32_t *rolling_start_interval_numbers_;
+        int32_t *rolling_periods_;
+        int32_t *transmission_risk_levels_;
+        int32_t *report_types_;
+        int32_t *days_since_onset_of_symptoms_;
+        // A bit per optional field, set if the key had it.
+        uint8_t *present_fields_;
+    };
+
+    // A key file mapped read-only, or a key archive whose export.bin is
+    // inflated a block at a time as it is read.
+    class KeyFileContents {
+    public:
+        // Maps key_file, advised for a single front to back pass. Returns null
+        // if it cannot be mapped, such as when it is empty.
+        static std::unique_ptr<KeyFileContents> Map(const std::string &key_file);
+
+        // Maps key_file, reading its central directory if it is a key archive,
+        // and checks the header of its key file. Returns null, and logs why, if
+        // any of these fails.
+        static std::unique_ptr<KeyFileContents> Open(const std::string &key_file);
+
+        ~KeyFileContents();
+
+        KeyFileContents(const KeyFileContents &) = delete;
+        KeyFileContents &operator=(const KeyFileContents &) = delete;
+
+        // The mapped file, a key archive if IsKeyArchive().
+        inline const uint8_t *Data() const { return data_; }
+        inline size_t Size() const { return size_; }
+
+        // Whether the mapped file is a key archive rather than a key file.
+        bool IsKeyArchive() const;
+
+        // Reads the central directory of the mapped key archive. Returns false
+        // if the archive is invalid, see KeyArchive::Read.
+        bool OpenArchive();
+
+        // Starts reading the key file from its first byte: the mapped file, or
+        // the export.bin of the archive once opened.
+        std::unique_ptr<KeyFileStream> NewStream() const;
+
+        // Whether the key file starts with the key file header.
+        bool HasHeader() const;
+
+    private:
+        KeyFileContents(void *mapped, size_t mapped_size);
+
+        void *mapped_;
+        const uint8_t *data_;
+        size_t size_;
+        std::unique_ptr<KeyArchive> archive_;
+    };
+
+    // The fields of a key file other than its keys, and bounds of its keys, as
+    // read by KeyFileIterator while it walks the file.
+    struct KeyFileMetadata {
+        bool has_start_timestamp = false;
+        uint64_t start_timestamp = 0;
+        bool has_end_timestamp = false;
+        uint64_t end_timestamp = 0;
+        std::string region;
+        bool has_batch_num = false;
+        int32_t batch_num = 0;
+        bool has_batch_size = false;
+        int32_t batch_size = 0;
+        // Number of keys fields passed, decoded or skipped.
+        size_t key_count = 0;
+        // Number of keys decoded. The bounds below are only set if it is not 0.
+        size_t decoded_key_count = 0;
+        int32_t min_rolling_start_interval_number = 0;
+        int32_t max_rolling_start_interval_number = 0;
+
+        // Adds the keys of other, read from a later chunk of the same file, and
+        // takes the header fields it has.
+        void Merge(const KeyFileMetadata &other);
+    };
 
     class KeyFileIterator {
     public:
@@ -47,25 +168,101 @@ namespace exposure {
                                  pb_istream_t pb_istream)
             : file_(file),
               buffer_(std::move(buffer)),
+              data_(nullptr),
+              stream_end_(0),
+              pb_istream_(pb_istream),
+              next_tag_(0) {
+          ReadUntilNextKeyTagOrEnd();
+        }
+
+        // Decodes keys in place from bytes [begin, end) of contents. Fields are
+        // read straight from memory, so a field read is a copy out of the page
+        // cache instead of a stdio call.
+        KeyFileIterator(std::unique_ptr<KeyFileContents> contents, size_t begin, size_t end)
+            : file_(nullptr),
+              contents_(std::move(contents)),
+              data_(contents_->Data()),
+              stream_end_(end),
+              pb_istream_(pb_istream_from_buffer(data_ + begin, end - begin)),
+              next_tag_(0) {
+          if (begin > kFileHeaderSize) {
+            ReadHeaderFields(begin);
+          }
+          ReadUntilNextKeyTagOrEnd();
+        }
+
+        // Decodes keys from the export.bin of a key archive as stream inflates
+        // it, pb_istream having read its header.
+        KeyFileIterator(std::unique_ptr<KeyFileContents> contents,
+                        std::unique_ptr<KeyFileStream> stream, pb_istream_t pb_istream)
+            : file_(nullptr),
+              contents_(std::move(contents)),
+              stream_(std::move(stream)),
+              data_(nullptr),
+              stream_end_(0),
               pb_istream_(pb_istream),
               next_tag_(0) {
           ReadUntilNextKeyTagOrEnd();
         }
 
-        ~KeyFileIterator() { fclose(file_); }
+        ~KeyFileIterator() {
+          if (file_ != nullptr) {
+            fclose(file_);
+          }
+        }
+
+        KeyFileIterator(const KeyFileIterator &) = delete;
+        KeyFileIterator &operator=(const KeyFileIterator &) = delete;
 
         inline bool HasNext() const { return next_tag_ != 0; }
 
         // Gets the next exposure key if HasNext() return true. If HasNext() return
         // false or failed parse the proto message, return nullptr.
         inline std::unique_ptr<TemporaryExposureKeyNano> Next() {
-          return ReadNextKey();
+          auto key = std::make_unique<TemporaryExposureKeyNano>();
+          if (!ReadNextKey(key.get())) {
+            return nullptr;
+          }
+          return key;
         }
 
+        // Clears batch and decodes the following keys into it, until it is full
+        // or there are no more. Keys that fail to parse, or whose key data is
+        // not kTekLength bytes, are left out. Returns the number of keys in
+        // batch, 0 once HasNext() returns false.
+        size_t NextBatch(KeyBatch *batch);
+
+        // The revised_keys fields passed so far with kTekLength bytes of key
+        // data, in file order. They are all there once HasNext() returns false.
+        inline const std::vector<TemporaryExposureKeyNano> &GetRevisedKeys() const {
+          return revised_keys_;
+        }
+
+        // Moves past the remaining keys without decoding them, still reading
+        // every other field. Returns the number of keys skipped.
+        size_t SkipKeys();
+
+        // The header fields and keys passed so far. Key servers write the
+        // header fields first, so they are known once the iterator is created;
+        // so are those of a later chunk of a mapped file, which are read from
+        // the start of the file.
+        inline const KeyFileMetadata &GetMetadata() const { return metadata_; }
+
     private:
         void ReadUntilNextKeyTagOrEnd();
 
-        std::unique_ptr<TemporaryExposureKeyNano> ReadNextKey();
+        // Reads the header fields of the mapped key file that come before its
+        // first key, and before offset end.
+        void ReadHeaderFields(size_t end);
+
+        // Decodes the revised_keys field at the stream into revised_keys_.
+        // Returns false if the file cannot be read any further.
+        bool ReadRevisedKey();
+
+        // Decodes the next key into key and moves to the following one. Returns
+        // false if it cannot be parsed; if the file cannot be read any further,
+        // HasNext() then returns false.
+        bool ReadNextKey(TemporaryExposureKeyNano *key);
 
         static inline bool IsTagForKeys(uint32_t tag) {
           return tag == TemporaryExposureKeyExportNano_keys_tag;
@@ -73,8 +270,19 @@ namespace exposure {
 
         FILE *file_;
         std::unique_ptr<char[]> buffer_;
+        std::unique_ptr<KeyFileContents> contents_;
+        // The key archive entry that pb_istream_ inflates, which reads from
+        // contents_.
+        std::unique_ptr<KeyFileStream> stream_;
+        // The key file that pb_istream_ reads in place, or null when reading
+        // through stdio or stream_, and the offset in it at which pb_istream_
+        // ends.
+        const pb_byte_t *data_;
+        size_t stream_end_;
         pb_istream_t pb_istream_;
         uint32_t next_tag_;
+        std::vector<TemporaryExposureKeyNano> revised_keys_;
+        KeyFileMetadata metadata_;
     };
 
     std::vector<std::unique_ptr<TemporaryExposureKeyNano>> ParseFileDirectly(
@@ -85,11 +293,52 @@ namespace exposure {
 
     bool VerifyHeader(pb_istream_t *pb_istream);
 
+    // Decodes the TemporaryExposureKey message of length bytes at message into
+    // key, through DecodeKeyFast when it can and pb_decode otherwise.
+    bool DecodeKey(const pb_byte_t *message, size_t length,
+                   TemporaryExposureKeyNano *key);
+
+    // Decodes a TemporaryExposureKey of length bytes, as produced by every key
+    // server: known fields only, a 16-byte key_data and short varints. Fields
+    // may repeat and come in any order, the last one winning as in nanopb.
+    // Returns false on any other layout, for pb_decode to handle; key is then
+    // partially written.
+    bool DecodeKeyFast(const pb_byte_t *message, size_t length,
+                       TemporaryExposureKeyNano *key);
+
+    // Maps key_file and decodes it in place, or reads it through stdio if it
+    // cannot be mapped. key_file may also be a diagnosis key zip archive, whose
+    // export.bin is then decoded as it is inflated. Returns null if it cannot
+    // be opened or has no valid header.
     std::unique_ptr<KeyFileIterator> CreateKeyFileIterator(
         const std::string &key_file);
 
+    // Bytes [begin, end) of a key file, starting at a keys field, that can be
+    // parsed on their own.
+    struct KeyFileChunk {
+        size_t begin;
+        size_t end;
+    };
+
+    // Splits the keys of key_file into at most max_chunk_count chunks of about
+    // the same size, and no smaller than kMinKeyFileChunkSize, in file order,
+    // by walking its top-level fields without decoding any key. Iterating
+    // over every chunk in turn yields the keys of the whole file, in the same
+    // order. Returns no chunks if the file cannot
+    // be mapped or is malformed.
+    std::vector<KeyFileChunk> SplitKeyFile(const std::string &key_file,
+                                           int max_chunk_count);
+
+    // Maps key_file and decodes the keys of chunk, one of those returned by
+    // SplitKeyFile for it. Returns null if it cannot be mapped.
+    std::unique_ptr<KeyFileIterator> CreateKeyFileIterator(
+        const std::string &key_file, const KeyFileChunk &chunk);
+
     pb_istream_t CreatePbInputStream(FILE *file);
 
+    // Reads stream from its first byte. stream must outlive the pb_istream_t.
+    pb_istream_t CreatePbInputStream(KeyFileStream *stream);
+
 // NanoPB Callback, reads the specified size in bytes into buffer from the key
 // file 'stream->state', and set the internal state of stream accordingly.
     bool ReadFromFileToStream(pb_istream_t *stream, pb_byte_t *buffer,
@@ -0,0 +1,255 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "key_file_parser.h"
+
+#include <gtest/gtest.h>
+
+#include <random>
+#include <vector>
+
+namespace exposure {
+    namespace {
+        constexpr int kMessageCount = 100000;
+
+        void PutVarint(uint64_t value, std::vector<uint8_t> *message) {
+          while (value >= 0x80) {
+            message->push_back(static_cast<uint8_t>(value | 0x80));
+            value >>= 7;
+          }
+          message->push_back(static_cast<uint8_t>(value));
+        }
+
+        // A value of an int32 field as key servers write it: non-negative and
+        // small.
+        uint64_t ServerVarint(std::mt19937 *random) {
+          switch ((*random)() % 3) {
+            case 0:
+              return (*random)() % 8;
+            case 1:
+              return 2650000 + (*random)() % 100000;
+            default:
+              return (*random)() % 145;
+          }
+        }
+
+        // Any value of a 32-bit varint field, including negative ones, which
+        // take 10 bytes, and values that do not fit in 32 bits.
+        uint64_t AnyVarint(std::mt19937 *random) {
+          switch ((*random)() % 4) {
+            case 0:
+              return static_cast<uint64_t>(static_cast<int64_t>(
+                  static_cast<int32_t>((*random)())));
+            case 1:
+              return (*random)();
+            case 2:
+              return (static_cast<uint64_t>((*random)()) << 32) | (*random)();
+            default:
+              return ServerVarint(random);
+          }
+        }
+
+        // Appends a field of the TemporaryExposureKey message. Unless server_only,
+        // the field may also be an unknown field, key_data of another length, or
+        // use a value or an encoding key servers never write.
+        void AppendField(std::mt19937 *random, bool server_only,
+                         std::vector<uint8_t> *message) {
+          const int tag = 1 + static_cast<int>((*random)() % (server_only ? 6 : 9));
+          if (tag == 1) {
+            size_t length = server_only || (*random)() % 4 != 0 ? kTekLength : (*random)() % 20;
+            PutVarint(tag << 3 | PB_WT_STRING, message);
+            PutVarint(length, message);
+            for (size_t i = 0; i < length; i++) {
+              message->push_back(static_cast<uint8_t>((*random)()));
+            }
+          } else if (tag <= 6) {
+            uint64_t key = tag << 3 | PB_WT_VARINT;
+            if (!server_only && (*random)() % 8 == 0) {
+              // The same field key in two bytes.
+              message->push_back(static_cast<uint8_t>(key | 0x80));
+              message->push_back(0);
+            } else {
+              PutVarint(key, message);
+            }
+            if (tag == 6) {
+              int32_t days = static_cast<int32_t>((*random)() % 29) - 14;
+              PutVarint(server_only ? static_cast<uint32_t>((days << 1) ^ (days >> 31))
+                                    : AnyVarint(random),
+                        message);
+            } else {
+              PutVarint(server_only ? ServerVarint(random) : AnyVarint(random), message);
+            }
+          } else if (tag == 7) {
+            PutVarint(tag << 3 | PB_WT_VARINT, message);
+            PutVarint(AnyVarint(random), message);
+          } else if (tag == 8) {
+            PutVarint(tag << 3 | PB_WT_STRING, message);
+            PutVarint(3, message);
+            message->insert(message->end(), {'a', 'b', 'c'});
+          } else {
+            PutVarint(tag << 3 | PB_WT_32BIT, message);
+            message->insert(message->end(), {1, 2, 3, 4});
+          }
+        }
+
+        // A message of up to 8 fields in any order, which may repeat.
+        std::vector<uint8_t> RandomMessage(std::mt19937 *random, bool server_only) {
+          std::vector<uint8_t> message;
+          int field_count = static_cast<int>((*random)() % 9);
+          for (int i = 0; i < field_count; i++) {
+            AppendField(random, server_only, &message);
+          }
+          return message;
+        }
+
+        // Flips, drops, inserts or duplicates a few bytes of message.
+        void Mutate(std::mt19937 *random, std::vector<uint8_t> *message) {
+          int mutation_count = 1 + static_cast<int>((*random)() % 3);
+          for (int i = 0; i < mutation_count; i++) {
+            size_t position = message->empty() ? 0 : (*random)() % message->size();
+            switch ((*random)() % 4) {
+              case 0:
+                if (!message->empty()) {
+                  (*message)[position] ^= static_cast<uint8_t>(1 << ((*random)() % 8));
+                }
+                break;
+              case 1:
+                message->resize(position);
+                break;
+              case 2:
+                message->insert(message->begin() + position,
+                                static_cast<uint8_t>((*random)()));
+                break;
+              default: {
+                std::vector<uint8_t> tail(message->begin() + position, message->end());
+                message->insert(message->end(), tail.begin(), tail.end());
+                break;
+              }
+            }
+          }
+        }
+
+        bool DecodeWithNanopb(const std::vector<uint8_t> &message,
+                              TemporaryExposureKeyNano *key) {
+          *key = TemporaryExposureKeyNano_init_default;
+          pb_istream_t stream = pb_istream_from_buffer(message.data(), message.size());
+          return pb_decode(&stream, TemporaryExposureKeyNano_fields, key);
+        }
+
+        void ExpectSameKey(const TemporaryExposureKeyNano &expected,
+                           const TemporaryExposureKeyNano &actual) {
+          EXPECT_EQ(expected.has_key_data, actual.has_key_data);
+          ASSERT_EQ(expected.key_data.size, actual.key_data.size);
+          EXPECT_EQ(0, memcmp(expected.key_data.bytes, actual.key_data.bytes,
+                              expected.key_data.size));
+          EXPECT_EQ(expected.has_transmission_risk_level, actual.has_transmission_risk_level);
+          EXPECT_EQ(expected.transmission_risk_level, actual.transmission_risk_level);
+          EXPECT_EQ(expected.has_rolling_start_interval_number,
+                    actual.has_rolling_start_interval_number);
+          EXPECT_EQ(expected.rolling_start_interval_number, actual.rolling_start_interval_number);
+          EXPECT_EQ(expected.has_rolling_period, actual.has_rolling_period);
+          EXPECT_EQ(expected.rolling_period, actual.rolling_period);
+          EXPECT_EQ(expected.has_report_type, actual.has_report_type);
+          EXPECT_EQ(expected.report_type, actual.report_type);
+          EXPECT_EQ(expected.has_days_since_onset_of_symptoms,
+                    actual.has_days_since_onset_of_symptoms);
+          EXPECT_EQ(expected.days_since_onset_of_symptoms, actual.days_since_onset_of_symptoms);
+        }
+
+        std::string Hex(const std::vector<uint8_t> &message) {
+          static const char kDigits[] = "0123456789abcdef";
+          std::string hex;
+          for (uint8_t byte : message) {
+            hex.push_back(kDigits[byte >> 4]);
+            hex.push_back(kDigits[byte & 0xF]);
+          }
+          return hex;
+        }
+
+        // Checks that DecodeKeyFast either gives up or decodes message exactly as
+        // pb_decode, and that DecodeKey always agrees with pb_decode. Returns
+        // whether DecodeKeyFast decoded it.
+        bool ExpectDecodedAsNanopb(const std::vector<uint8_t> &message) {
+          SCOPED_TRACE(Hex(message));
+          TemporaryExposureKeyNano expected;
+          const bool nanopb_decoded = DecodeWithNanopb(message, &expected);
+
+          TemporaryExposureKeyNano key = TemporaryExposureKeyNano_init_default;
+          const bool fast_decoded = DecodeKeyFast(message.data(), message.size(), &key);
+          if (fast_decoded) {
+            EXPECT_TRUE(nanopb_decoded);
+            ExpectSameKey(expected, key);
+          }
+
+          EXPECT_EQ(nanopb_decoded, DecodeKey(message.data(), message.size(), &key));
+          if (nanopb_decoded) {
+            ExpectSameKey(expected, key);
+          }
+          return fast_decoded;
+        }
+
+        TEST(DecodeKeyFastTest, DecodesServerKeysAsNanopb) {
+          std::mt19937 random(1);
+          for (int i = 0; i < kMessageCount && !HasFailure(); i++) {
+            std::vector<uint8_t> message = RandomMessage(&random, /*server_only=*/true);
+            EXPECT_TRUE(ExpectDecodedAsNanopb(message)) << "Slow path for " << Hex(message);
+          }
+        }
+
+        TEST(DecodeKeyFastTest, DecodesRandomMessagesAsNanopb) {
+          std::mt19937 random(2);
+          int fast_count = 0;
+          for (int i = 0; i < kMessageCount && !HasFailure(); i++) {
+            fast_count += ExpectDecodedAsNanopb(RandomMessage(&random, /*server_only=*/false));
+          }
+          // Both paths are exercised.
+          EXPECT_GT(fast_count, 0);
+          EXPECT_LT(fast_count, kMessageCount);
+        }
+
+        TEST(DecodeKeyFastTest, DecodesMutatedMessagesAsNanopb) {
+          std::mt19937 random(3);
+          for (int i = 0; i < kMessageCount && !HasFailure(); i++) {
+            std::vector<uint8_t> message = RandomMessage(&random, /*server_only=*/true);
+            Mutate(&random, &message);
+            ExpectDecodedAsNanopb(message);
+          }
+        }
+
+        TEST(DecodeKeyFastTest, DecodesEdgeCasesAsNanopb) {
+          // Empty, every varint width, the largest 32-bit values and a
+          // truncated key_data.
+          const std::vector<std::vector<uint8_t>> messages = {
+              {},
+              {0x18, 0x00},
+              {0x18, 0xff, 0xff, 0xff, 0xff, 0x07},
+              {0x18, 0xff, 0xff, 0xff, 0xff, 0x0f},
+              {0x18, 0xff, 0xff, 0xff, 0xff, 0x1f},
+              {0x18, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x01},
+              {0x30, 0xff, 0xff, 0xff, 0xff, 0x0f},
+              {0x30, 0xfe, 0xff, 0xff, 0xff, 0x0f},
+              {0x28, 0x80, 0x80, 0x80, 0x80, 0x00},
+              {0x20, 0x80},
+              {0x0a, 0x10, 1, 2, 3},
+              {0x0a, 0x00},
+          };
+          for (const std::vector<uint8_t> &message : messages) {
+            ExpectDecodedAsNanopb(message);
+          }
+        }
+    }  // namespace
+}  // namespace exposure
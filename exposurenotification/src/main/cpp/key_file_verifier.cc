@@ -0,0 +1,370 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "key_file_verifier.h"
+
+#include <openssl/bytestring.h>
+#include <openssl/ec_key.h>
+#include <openssl/ecdsa.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include "constants.h"
+#include "key_file_parser.h"
+
+namespace exposure {
+    namespace {
+        // Fields of TemporaryExposureKeyExport up to signature_infos, the ones
+        // TemporaryExposureKeyFileMetadataParser reads.
+        constexpr static const uint32_t kLastMetadataTag = 6;
+
+        // The public keys of all checks, each parsed once, then shared read-only
+        // by the workers.
+        class PublicKeys {
+        public:
+            PublicKeys() = default;
+
+            ~PublicKeys() {
+              for (auto &entry : keys_) {
+                EVP_PKEY_free(entry.second);
+              }
+            }
+
+            PublicKeys(const PublicKeys &) = delete;
+            PublicKeys &operator=(const PublicKeys &) = delete;
+
+            void Add(const std::vector<uint8_t> &public_key) {
+              if (keys_.count(public_key) > 0) {
+                return;
+              }
+              CBS cbs;
+              CBS_init(&cbs, public_key.data(), public_key.size());
+              EVP_PKEY *key = EVP_parse_public_key(&cbs);
+              if (key != nullptr && CBS_len(&cbs) != 0) {
+                EVP_PKEY_free(key);
+                key = nullptr;
+              }
+              if (key == nullptr) {
+                LOG_W("Failed to parse public key");
+                ERR_clear_error();
+              }
+              keys_[public_key] = key;
+            }
+
+            // Returns null if public_key is not a valid EC public key.
+            const EC_KEY *Get(const std::vector<uint8_t> &public_key) const {
+              auto it = keys_.find(public_key);
+              if (it == keys_.end() || it->second == nullptr) {
+                return nullptr;
+              }
+              return EVP_PKEY_get0_EC_KEY(it->second);
+            }
+
+        private:
+            std::map<std::vector<uint8_t>, EVP_PKEY *> keys_;
+        };
+
+        // The SHA-256 of all key files in order, while the files are verified in
+        // any order. Each file is handed over once verified, and whichever worker
+        // completes the next file in order hashes it and any following ones
+        // already handed over. A file handed over early stays mapped until its
+        // turn, so workers keep within a window of the next file to hash.
+        class KeyFilesHash {
+        public:
+            KeyFilesHash(size_t file_count, size_t window)
+                : contents_(file_count), done_(file_count, false), window_(window), next_(0),
+                  hashing_(false) {
+              SHA256_Init(&sha256_);
+            }
+
+            KeyFilesHash(const KeyFilesHash &) = delete;
+            KeyFilesHash &operator=(const KeyFilesHash &) = delete;
+
+            // Blocks until file index is within the window, so that at most
+            // window - 1 files are held awaiting their turn. The file next to
+            // hash is always within it, so the wait ends once the workers on
+            // the files before index hand them over.
+            void WaitForTurn(size_t index) {
+              std::unique_lock<std::mutex> lock(mutex_);
+              turn_.wait(lock, [this, index]() { return index < next_ + window_; });
+            }
+
+            // Hands over file index, or null if it could not be read.
+            void Add(size_t index, std::unique_ptr<KeyFileContents> contents) {
+              std::unique_lock<std::mutex> lock(mutex_);
+              contents_[index] = std::move(contents);
+              done_[index] = true;
+              if (hashing_) {
+                return;
+              }
+              hashing_ = true;
+              while (next_ < done_.size() && done_[next_]) {
+                std::unique_ptr<KeyFileContents> next = std::move(contents_[next_++]);
+                lock.unlock();
+                if (next != nullptr) {
+                  // An archive is inflated again rather than held inflated
+                  // until its turn.
+                  std::unique_ptr<KeyFileStream> stream = next->NewStream();
+                  const uint8_t *block;
+                  size_t block_size;
+                  while (stream->NextBlock(&block, &block_size) && block_size > 0) {
+                    SHA256_Update(&sha256_, block, block_size);
+                  }
+                }
+                // Unmaps the file.
+                next.reset();
+                lock.lock();
+                turn_.notify_all();
+              }
+              hashing_ = false;
+            }
+
+            // Once every file is handed over.
+            void Final(uint8_t *digest) { SHA256_Final(digest, &sha256_); }
+
+        private:
+            std::mutex mutex_;
+            std::condition_variable turn_;
+            std::vector<std::unique_ptr<KeyFileContents>> contents_;
+            std::vector<bool> done_;
+            const size_t window_;
+            size_t next_;
+            bool hashing_;
+            SHA256_CTX sha256_;
+        };
+
+        // Reads a key file for VerifyKeyFile through a pb_istream_t, feeding
+        // each block to the digests as it is reached, and copying the bytes
+        // read while capturing.
+        struct VerifiedStream {
+            KeyFileStream *stream;
+            const uint8_t *block;
+            size_t block_left;
+            SHA256_CTX *sha256;
+            SHA512_CTX *sha512;
+            std::vector<uint8_t> *capture;
+        };
+
+        bool ReadVerifiedStream(pb_istream_t *pb_istream, pb_byte_t *buffer, size_t size) {
+          VerifiedStream *state = reinterpret_cast<VerifiedStream *>(pb_istream->state);
+          while (size > 0) {
+            if (state->block_left == 0) {
+              if (!state->stream->NextBlock(&state->block, &state->block_left) ||
+                  state->block_left == 0) {
+                return false;
+              }
+              if (state->sha256 != nullptr) {
+                SHA256_Update(state->sha256, state->block, state->block_left);
+              }
+              if (state->sha512 != nullptr) {
+                SHA512_Update(state->sha512, state->block, state->block_left);
+              }
+            }
+            const size_t count = std::min(size, state->block_left);
+            memcpy(buffer, state->block, count);
+            if (state->capture != nullptr) {
+              state->capture->insert(state->capture->end(), state->block, state->block + count);
+            }
+            state->block += count;
+            state->block_left -= count;
+            buffer += count;
+            size -= count;
+          }
+          return true;
+        }
+
+        inline bool IsSameCheck(const SignatureCheck &a, const SignatureCheck &b) {
+          return a.digest_algorithm == b.digest_algorithm && a.signature == b.signature &&
+                 a.public_key == b.public_key;
+        }
+
+        bool VerifySignature(const EC_KEY *public_key, const std::vector<uint8_t> &signature,
+                             const uint8_t *digest, size_t digest_size) {
+          if (public_key == nullptr) {
+            return false;
+          }
+          const bool verified = ECDSA_verify(0, digest, digest_size, signature.data(),
+                                             signature.size(), public_key) == 1;
+          // A signature that does not verify leaves errors on the queue.
+          ERR_clear_error();
+          return verified;
+        }
+
+        // Verifies file, the index-th one, and hands it over to key_files_hash
+        // unless it is null.
+        bool VerifyKeyFile(KeyFileVerification *file, const PublicKeys &public_keys,
+                           size_t index, KeyFilesHash *key_files_hash) {
+          const std::vector<SignatureCheck> &checks = file->checks;
+          file->results.assign(checks.size(), false);
+          file->metadata.clear();
+          std::unique_ptr<KeyFileContents> contents = KeyFileContents::Open(file->key_file);
+          if (contents == nullptr) {
+            if (key_files_hash != nullptr) {
+              key_files_hash->Add(index, nullptr);
+            }
+            return false;
+          }
+
+          // Each digest is computed once, however many checks need it.
+          bool needs_sha256 = false;
+          bool needs_sha512 = false;
+          for (const SignatureCheck &check : checks) {
+            needs_sha256 |= check.digest_algorithm == kDigestSha256;
+            needs_sha512 |= check.digest_algorithm == kDigestSha512;
+          }
+          SHA256_CTX sha256;
+          SHA512_CTX sha512;
+          if (needs_sha256) {
+            SHA256_Init(&sha256);
+          }
+          if (needs_sha512) {
+            SHA512_Init(&sha512);
+          }
+
+          // Blocks are hashed as the walk reaches them, and keys are skipped by
+          // their length without being decoded.
+          std::unique_ptr<KeyFileStream> stream = contents->NewStream();
+          std::vector<uint8_t> field;
+          VerifiedStream verified_stream{stream.get(), nullptr, 0,
+                                         needs_sha256 ? &sha256 : nullptr,
+                                         needs_sha512 ? &sha512 : nullptr, nullptr};
+          pb_istream_t pb_istream;
+          pb_istream.callback = &ReadVerifiedStream;
+          pb_istream.state = &verified_stream;
+          pb_istream.bytes_left = stream->Size();
+          bool malformed = !pb_read(&pb_istream, nullptr, kFileHeaderSize);
+          while (!malformed && pb_istream.bytes_left > 0) {
+            field.clear();
+            verified_stream.capture = &field;
+            pb_wire_type_t wire_type;
+            uint32_t tag;
+            bool eof;
+            if (!pb_decode_tag(&pb_istream, &wire_type, &tag, &eof)) {
+              malformed = true;
+              break;
+            }
+            const bool is_metadata = tag >= 1 && tag <= kLastMetadataTag;
+            if (!is_metadata) {
+              verified_stream.capture = nullptr;
+            }
+            if (!pb_skip_field(&pb_istream, wire_type)) {
+              malformed = true;
+              break;
+            }
+            if (is_metadata) {
+              file->metadata.insert(file->metadata.end(), field.begin(), field.end());
+            }
+          }
+          // The stream reads from the mapping handed over.
+          stream.reset();
+          if (key_files_hash != nullptr) {
+            key_files_hash->Add(index, std::move(contents));
+          }
+          if (malformed) {
+            LOG_E("Malformed key file %s", file->key_file.c_str());
+            return false;
+          }
+
+          uint8_t sha256_digest[SHA256_DIGEST_LENGTH];
+          uint8_t sha512_digest[SHA512_DIGEST_LENGTH];
+          if (needs_sha256) {
+            SHA256_Final(sha256_digest, &sha256);
+          }
+          if (needs_sha512) {
+            SHA512_Final(sha512_digest, &sha512);
+          }
+          for (size_t i = 0; i < checks.size(); i++) {
+            const SignatureCheck &check = checks[i];
+            // Cosign sets, such as those of key rotations, often repeat a check.
+            size_t same = 0;
+            while (same < i && !IsSameCheck(checks[same], check)) {
+              same++;
+            }
+            if (same < i) {
+              file->results[i] = file->results[same];
+            } else if (check.digest_algorithm == kDigestSha256) {
+              file->results[i] = VerifySignature(public_keys.Get(check.public_key),
+                                                 check.signature, sha256_digest,
+                                                 sizeof(sha256_digest));
+            } else if (check.digest_algorithm == kDigestSha512) {
+              file->results[i] = VerifySignature(public_keys.Get(check.public_key),
+                                                 check.signature, sha512_digest,
+                                                 sizeof(sha512_digest));
+            } else {
+              LOG_W("Unsupported signature digest %d", check.digest_algorithm);
+            }
+          }
+          return true;
+        }
+    }  // namespace
+
+    bool VerifyKeyFiles(std::vector<KeyFileVerification> *files, int thread_count,
+                        uint8_t *key_files_hash) {
+      PublicKeys public_keys;
+      for (const KeyFileVerification &file : *files) {
+        for (const SignatureCheck &check : file.checks) {
+          public_keys.Add(check.public_key);
+        }
+      }
+      const size_t worker_count = std::min(
+          files->size(), static_cast<size_t>(std::max(
+                             1, std::min(thread_count, kMaxVerificationThreadCount))));
+      // Each worker holds at most one file ahead of the key files hash.
+      std::unique_ptr<KeyFilesHash> hash;
+      if (key_files_hash != nullptr) {
+        hash = std::make_unique<KeyFilesHash>(files->size(), worker_count);
+      }
+
+      // Workers claim files in order through next_file, and wait for a file
+      // far ahead of the key files hash to come within its window.
+      std::atomic<size_t> next_file(0);
+      std::atomic<bool> all_read(true);
+      auto worker = [&]() {
+        for (size_t i = next_file++; i < files->size(); i = next_file++) {
+          if (hash != nullptr) {
+            hash->WaitForTurn(i);
+          }
+          if (!VerifyKeyFile(&(*files)[i], public_keys, i, hash.get())) {
+            all_read = false;
+          }
+        }
+      };
+      LOG_I("Verifying %d files with %d threads", (int) files->size(), (int) worker_count);
+      std::vector<std::thread> threads;
+      for (size_t i = 1; i < worker_count; i++) {
+        threads.emplace_back(worker);
+      }
+      // The calling thread works as well instead of idling on join.
+      worker();
+      for (auto &thread : threads) {
+        thread.join();
+      }
+
+      if (hash != nullptr) {
+        hash->Final(key_files_hash);
+      }
+      return all_read;
+    }
+}  // namespace exposure
@@ -0,0 +1,66 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LOCATION_NEARBY_CPP_EXPOSURENOTIFICATION_JNI_KEY_FILE_VERIFIER_H_
+#define LOCATION_NEARBY_CPP_EXPOSURENOTIFICATION_JNI_KEY_FILE_VERIFIER_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace exposure {
+    // Digests of the signature algorithms in SignatureInfo, ECDSA with
+    // SHA-256 (1.2.840.10045.4.3.2) and with SHA-512 (1.2.840.10045.4.3.4).
+    constexpr static const int kDigestSha256 = 1;
+    constexpr static const int kDigestSha512 = 2;
+
+    // One ECDSA signature to check against a key file.
+    struct SignatureCheck {
+        // DER encoded X.509 SubjectPublicKeyInfo of the public key.
+        std::vector<uint8_t> public_key;
+        // kDigestSha256 or kDigestSha512.
+        int digest_algorithm;
+        // DER encoded ECDSA signature, as in TEKSignature.signature.
+        std::vector<uint8_t> signature;
+    };
+
+    // The signatures to check against one key file, and what VerifyKeyFiles
+    // read from it.
+    struct KeyFileVerification {
+        // A key file, or a key archive whose export.bin is checked.
+        std::string key_file;
+        std::vector<SignatureCheck> checks;
+        // Whether each check verified.
+        std::vector<bool> results;
+        // The fields before signature_infos, inclusive, copied while walking
+        // the file, so a serialized TemporaryExposureKeyExport without keys as
+        // parsed by TemporaryExposureKeyFileMetadataParser.
+        std::vector<uint8_t> metadata;
+    };
+
+    // Verifies files on up to thread_count threads, each file read once by a
+    // single worker: each block is fed to the digests its checks need, each
+    // computed once however many checks share it, and the top-level fields
+    // starting in it are walked while it is cached. Public keys are parsed
+    // once for all files, and a check repeated by several cosign sets is
+    // verified once. Unless key_files_hash is null, it receives the SHA-256
+    // of all key files in order, for which a key archive verified ahead of
+    // its turn is inflated again rather than held inflated. Returns false if
+    // a file cannot be read or is malformed.
+    bool VerifyKeyFiles(std::vector<KeyFileVerification> *files, int thread_count,
+                        uint8_t *key_files_hash);
+}  // namespace exposure
+#endif  // LOCATION_NEARBY_CPP_EXPOSURENOTIFICATION_JNI_KEY_FILE_VERIFIER_H_
@@ -23,7 +23,11 @@
 #include <openssl/hkdf.h>
 #include <stdio.h>
 
+#include <algorithm>
+#include <atomic>
+#include <limits>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "key_file_parser.h"
@@ -45,108 +49,444 @@ std::string hexStr(const unsigned char *data, int len) {
 extern "C" {
 
 namespace exposure {
-    MatchingHelper::MatchingHelper(JNIEnv *env, jobjectArray scan_record_ids) {
-      EVP_CIPHER_CTX_init(&context);
+    namespace {
+        constexpr static const uint64_t kSecondsPerInterval = 600;
 
-      prefix_key_map = std::make_unique<PrefixIdMap>(env, scan_record_ids);
-      for (int i = 0; i < kIdPerKey; i++) {
-        memcpy(&aesInputStorage[i * kIdLength], kRpiPaddedData,
-               kRpiPaddedDataLength);
+        inline bool IsRevoked(const TemporaryExposureKeyNano &key) {
+          return key.has_report_type &&
+                 key.report_type ==
+                     com_google_samples_exposurenotification_TemporaryExposureKey_ReportType_REVOKED;
+        }
+    }  // namespace
+
+    void RevisedKeys::Add(const TemporaryExposureKeyNano &key) {
+      Tek tek;
+      memcpy(tek.data(), key.key_data.bytes, kTekLength);
+      auto index = indexes_.find(tek);
+      if (index != indexes_.end()) {
+        keys_[index->second] = key;
+        return;
       }
+      indexes_.emplace(tek, keys_.size());
+      keys_.push_back(key);
+    }
+
+    const TemporaryExposureKeyNano *RevisedKeys::Find(const uint8_t *tek) const {
+      Tek key_data;
+      memcpy(key_data.data(), tek, kTekLength);
+      auto index = indexes_.find(key_data);
+      return index == indexes_.end() ? nullptr : &keys_[index->second];
+    }
+
+    MatchingHelper::MatchingHelper(JNIEnv *env, jobjectArray scan_record_ids,
+                                   const ScanWindow &scan_window)
+        : prefix_key_map(std::make_unique<PrefixIdMap>(env, scan_record_ids)),
+          scan_window(scan_window) {
       last_processed_key_count = 0;
     }
 
-    MatchingHelper::~MatchingHelper() { EVP_CIPHER_CTX_cleanup(&context); }
+    MatchingHelper::MatchingHelper(const uint8_t *packed_scan_ids,
+                                   const ScanRecordTime *scan_id_times, int scan_id_count,
+                                   const ScanWindow &scan_window)
+        : prefix_key_map(std::make_unique<PrefixIdMap>(packed_scan_ids, scan_id_times,
+                                                       scan_id_count)),
+          scan_window(scan_window) {
+      last_processed_key_count = 0;
+    }
+
+    MatchingHelper::MatchingHelper(std::unique_ptr<PrefixIdMap> prefix_id_map,
+                                   const ScanWindow &scan_window)
+        : prefix_key_map(std::move(prefix_id_map)), scan_window(scan_window) {
+      last_processed_key_count = 0;
+    }
 
-#if _BYTE_ORDER != _LITTLE_ENDIAN
-#error "Must use little endian"
-#endif
+    MatchingHelper::~MatchingHelper() {}
 
-    // PaddedData[0 - 5]: "EN-RPI".getBytes(UTF_8).
-    // PaddedData[6 - 11]: 0x000000000000.
-    // PaddedData[12 -15]: enIntervalNumber, uint32 little-endian.
     bool MatchingHelper::GenerateIds(const uint8_t *diagnosis_key,
                                      uint32_t rolling_start_number, uint8_t *ids) {
-      uint8_t rpi_key[kRpikLength];
-      // RPIK <- HKDF(tek, NULL, UTF8("EN-PRIK"), 16).
-      if (HKDF(rpi_key, kRpikLength, EVP_sha256(), diagnosis_key, kTekLength,
-          /*salt=*/nullptr, /*salt_len=*/0,
-               reinterpret_cast<const uint8_t *>(kHkdfInfo), kHkdfInfoLength) != 1) {
+      return id_generator.GenerateIds(diagnosis_key, rolling_start_number, ids);
+    }
+
+    bool MatchingHelper::GetIdWindow(int32_t rolling_start_interval_number,
+                                     int32_t rolling_period,
+                                     uint32_t *start_interval,
+                                     int *id_count) const {
+      if (rolling_period <= 0 || rolling_period > kIdPerKey) {
+        rolling_period = kIdPerKey;
+      }
+      const int64_t rolling_start = rolling_start_interval_number;
+      const int64_t key_end =
+          rolling_start +
+          std::min(rolling_period + scan_window.drift_tolerance, kIdPerKey);
+      // An RPI of interval i can be sighted during [i - drift, i + drift].
+      const int64_t start = std::max(
+          rolling_start, scan_window.start_interval - scan_window.drift_tolerance);
+      const int64_t end = std::min(
+          key_end, scan_window.end_interval + scan_window.drift_tolerance);
+      if (end <= start) {
         return false;
       }
+      *start_interval = static_cast<uint32_t>(start);
+      *id_count = static_cast<int>(end - start);
+      return true;
+    }
+
+    IntervalRange MatchingHelper::GetSightingWindow(uint32_t start_interval,
+                                                    int id_count) const {
+      // Same drift as in GetIdWindow, and as the final check of the sightings
+      // in Java.
+      const int64_t first_interval =
+          static_cast<int64_t>(start_interval) - scan_window.drift_tolerance;
+      const int64_t last_interval = static_cast<int64_t>(start_interval) + id_count - 1 +
+                                    scan_window.drift_tolerance;
+      return IntervalRange{static_cast<int>(first_interval),
+                           static_cast<int>(std::min<int64_t>(
+                               last_interval, std::numeric_limits<int>::max()))};
+    }
 
-      if (EVP_EncryptInit_ex(&context, EVP_aes_128_ecb(), /*impl=*/nullptr, rpi_key,
-          /*iv=*/nullptr) != 1) {
+    bool MatchingHelper::IsOutsideScanWindow(const KeyFileMetadata &metadata) const {
+      if (!metadata.has_end_timestamp) {
         return false;
       }
+      // An export holds the keys uploaded before its end_timestamp, and a key is
+      // only uploaded once its rolling period has started, so none starts
+      // later. GetIdWindow derives no ID of a key that starts kIdPerKey
+      // intervals or more before the drift-extended scan window, nor of any
+      // key before it.
+      const int64_t last_rolling_start =
+          static_cast<int64_t>(metadata.end_timestamp / kSecondsPerInterval);
+      return last_rolling_start + kIdPerKey <=
+             scan_window.start_interval - scan_window.drift_tolerance;
+    }
 
-      uint32_t en_interval_number = rolling_start_number;
-      for (int index = 0; index < kIdPerKey * kIdLength;
-           index += kIdLength, en_interval_number++) {
-        *((uint32_t *) (&aesInputStorage[index + 12])) = en_interval_number;
+    uint32_t MatchingHelper::MatchKeyFile(
+        const std::string &key_file, const KeyFileChunk *chunk,
+        const PrefixIdMap &scan_ids, const RevisedKeys &revised_keys,
+        IdGenerator *id_generator, std::vector<MatchedKey> *matched_keys,
+        KeyFileMetadata *metadata) {
+      std::unique_ptr<KeyFileIterator> key_file_iterator;
+      if (chunk == nullptr) {
+        LOG_I("Matching with %s", key_file.c_str());
+        key_file_iterator = CreateKeyFileIterator(key_file);
+      } else {
+        LOG_I("Matching with bytes [%zu, %zu) of %s", chunk->begin, chunk->end,
+              key_file.c_str());
+        key_file_iterator = CreateKeyFileIterator(key_file, *chunk);
       }
-
-      int out_length;
-      return EVP_EncryptUpdate(&context, ids, &out_length, aesInputStorage,
-                               kIdPerKey * kIdLength) == 1;
+      if (key_file_iterator.get() == nullptr) {
+        return 0;
+      }
+      // Keys are decoded in batches so that IDs are derived by the batched
+      // kernel, then every ID of every key in the batch is probed.
+      KeyBatch keys(kIdGenerationBatchSize);
+      uint32_t processed_key_count = 0;
+      uint32_t skipped_key_count = 0;
+      uint32_t revised_key_count = 0;
+      if (IsOutsideScanWindow(key_file_iterator->GetMetadata())) {
+        skipped_key_count = static_cast<uint32_t>(key_file_iterator->SkipKeys());
+        processed_key_count = skipped_key_count;
+      }
+      while (key_file_iterator->NextBatch(&keys) > 0) {
+        processed_key_count += keys.Size();
+        MatchKeyBatch(keys, scan_ids, revised_keys.Empty() ? nullptr : &revised_keys,
+                      id_generator, matched_keys, &skipped_key_count, &revised_key_count);
+      }
+      *metadata = key_file_iterator->GetMetadata();
+      LOG_I("Matched %d keys of %s, %d skipped outside the scan window, %d with a revision",
+            processed_key_count, key_file.c_str(), skipped_key_count, revised_key_count);
+      return processed_key_count;
     }
 
-    jobjectArray MatchingHelper::Matching(
-        JNIEnv *env, const std::vector<std::string> &key_files) {
-      std::vector<std::unique_ptr<TemporaryExposureKeyNano>> matched_keys;
-      uint8_t ids[kIdPerKey * kIdLength];
+    void MatchingHelper::MatchKeyBatch(const KeyBatch &keys, const PrefixIdMap &scan_ids,
+                                       const RevisedKeys *revised_keys,
+                                       IdGenerator *id_generator,
+                                       std::vector<MatchedKey> *matched_keys,
+                                       uint32_t *skipped_key_count,
+                                       uint32_t *revised_key_count) {
       static_assert(AES_BLOCK_SIZE == kIdLength, "Incorrect kIdLength.");
-      last_processed_key_count = 0;
+      // The keys of the batch worth deriving, and their key data when some
+      // were left out.
+      size_t key_indexes[kIdGenerationBatchSize];
+      uint8_t teks[kIdGenerationBatchSize * kTekLength];
+      uint32_t start_intervals[kIdGenerationBatchSize];
+      int id_counts[kIdGenerationBatchSize];
+      std::vector<uint8_t> ids(kIdGenerationBatchSize * kIdPerKey * kIdLength);
+      std::vector<int> scan_record_indexes;
+      int32_t probe_indexes[kIdPerKey];
+      size_t batch_size = 0;
+      for (size_t k = 0; k < keys.Size(); k++) {
+        if (revised_keys != nullptr && revised_keys->Find(keys.Tek(k)) != nullptr) {
+          // Its revision is matched instead, or not at all if it is revoked.
+          (*revised_key_count)++;
+          continue;
+        }
+        if (!GetIdWindow(keys.RollingStartIntervalNumber(k), keys.RollingPeriod(k),
+                         &start_intervals[batch_size], &id_counts[batch_size])) {
+          // None of its IDs can have been sighted, so skip the crypto.
+          (*skipped_key_count)++;
+          continue;
+        }
+        key_indexes[batch_size++] = k;
+      }
+      if (batch_size == 0) {
+        return;
+      }
+      const uint8_t *batch_teks = keys.Teks();
+      if (batch_size < keys.Size()) {
+        for (size_t i = 0; i < batch_size; i++) {
+          memcpy(&teks[i * kTekLength], keys.Tek(key_indexes[i]), kTekLength);
+        }
+        batch_teks = teks;
+      }
+
+      if (!id_generator->GenerateIdsBatch(batch_teks, start_intervals, id_counts,
+                                          batch_size, ids.data())) {
+        LOG_E("GenerateIds failed");
+        return;
+      }
+      for (size_t i = 0; i < batch_size; i++) {
+        const uint8_t *key_ids = &ids[i * kIdPerKey * kIdLength];
+        const jint first_offset = static_cast<jint>(
+            start_intervals[i] -
+            static_cast<uint32_t>(keys.RollingStartIntervalNumber(key_indexes[i])));
+        if (scan_ids.ProbeBatch(key_ids, id_counts[i], probe_indexes,
+                                GetSightingWindow(start_intervals[i], id_counts[i])) == 0) {
+          continue;
+        }
+        std::vector<jint> sightings;
+        for (int j = 0; j < id_counts[i]; j++) {
+          if (probe_indexes[j] < 0) {
+            continue;
+          }
+          // The batch probe reports one record sighted near some ID of the
+          // key; collect every duplicate sighted near this one.
+          scan_record_indexes.clear();
+          if (!scan_ids.GetScanRecordIndexes(
+                  &key_ids[j * kIdLength], &scan_record_indexes,
+                  GetSightingWindow(start_intervals[i] + j, 1))) {
+            continue;
+          }
+          for (int scan_record_index : scan_record_indexes) {
+            sightings.push_back(first_offset + j);
+            sightings.push_back(scan_record_index);
+          }
+        }
+        if (!sightings.empty()) {
+          matched_keys->push_back(
+              MatchedKey{keys.GetKey(key_indexes[i]), std::move(sightings)});
+        }
+      }
+    }
+
+    void MatchingHelper::MatchRevisedKeys(const RevisedKeys &revised_keys,
+                                          const PrefixIdMap &scan_ids,
+                                          std::vector<MatchedKey> *matched_keys) {
+      KeyBatch keys(kIdGenerationBatchSize);
+      uint32_t skipped_key_count = 0;
+      uint32_t revised_key_count = 0;
+      uint32_t revoked_key_count = 0;
+      for (const TemporaryExposureKeyNano &key : revised_keys.Keys()) {
+        if (IsRevoked(key)) {
+          revoked_key_count++;
+          continue;
+        }
+        keys.Append(key);
+        if (keys.Size() == keys.Capacity()) {
+          MatchKeyBatch(keys, scan_ids, nullptr, &id_generator, matched_keys,
+                        &skipped_key_count, &revised_key_count);
+          keys.Clear();
+        }
+      }
+      if (keys.Size() > 0) {
+        MatchKeyBatch(keys, scan_ids, nullptr, &id_generator, matched_keys,
+                      &skipped_key_count, &revised_key_count);
+      }
+      LOG_I("Matched %d revised keys, %d skipped outside the scan window, %d revoked",
+            (int) revised_keys.Keys().size(), skipped_key_count, revoked_key_count);
+    }
+
+    void MatchingHelper::ReadRevisedKeys(const std::vector<std::string> &key_files,
+                                         RevisedKeys *revised_keys) const {
       for (const auto &key_file : key_files) {
-        LOG_I("Matching with %s", key_file.c_str());
-        std::unique_ptr<KeyFileIterator> key_file_iterator(
-            CreateKeyFileIterator(key_file));
+        std::unique_ptr<KeyFileIterator> key_file_iterator = CreateKeyFileIterator(key_file);
         if (key_file_iterator.get() == nullptr) {
           continue;
         }
-        while (key_file_iterator->HasNext()) {
-          std::unique_ptr<TemporaryExposureKeyNano> key = key_file_iterator->Next();
-          if (key.get() == nullptr) {
-            continue;
+        key_file_iterator->SkipKeys();
+        for (const TemporaryExposureKeyNano &revised_key : key_file_iterator->GetRevisedKeys()) {
+          revised_keys->Add(revised_key);
+        }
+      }
+      LOG_I("Read %d revised keys from %d files", (int) revised_keys->Keys().size(),
+            (int) key_files.size());
+    }
+
+    std::vector<MatchedKey> MatchingHelper::MatchKeyFiles(
+        const std::vector<std::string> &key_files, int thread_count,
+        bool apply_revised_keys) {
+      std::vector<MatchedKey> matched_keys;
+      last_processed_key_count = 0;
+      last_revised_keys.clear();
+      last_key_file_metadata.assign(key_files.size(), KeyFileMetadata());
+      const PrefixIdMap &scan_ids = *prefix_key_map;
+      // Revisions may come after the keys they revise, or in another file, so
+      // they are all read before any key is matched, by a walk that decodes no
+      // key.
+      RevisedKeys revised_keys;
+      if (apply_revised_keys) {
+        ReadRevisedKeys(key_files, &revised_keys);
+      }
+
+      size_t worker_count = static_cast<size_t>(
+          std::max(1, std::min(thread_count, kMaxMatchingThreadCount)));
+      // A task is a whole file, or a chunk of one when there are fewer files than
+      // workers, so that a single large export keeps every worker busy. Tasks
+      // are in file order, then chunk order.
+      struct KeyFileTask {
+          size_t file_index;
+          bool whole_file;
+          KeyFileChunk chunk;
+      };
+      std::vector<KeyFileTask> tasks;
+      for (size_t i = 0; i < key_files.size(); i++) {
+        std::vector<KeyFileChunk> chunks;
+        if (worker_count > 1 && key_files.size() < worker_count) {
+          chunks = SplitKeyFile(key_files[i], static_cast<int>(worker_count));
+        }
+        if (chunks.size() <= 1) {
+          tasks.push_back(KeyFileTask{i, true, KeyFileChunk{0, 0}});
+          continue;
+        }
+        for (const KeyFileChunk &chunk : chunks) {
+          tasks.push_back(KeyFileTask{i, false, chunk});
+        }
+      }
+      worker_count = std::min(worker_count, tasks.size());
+      if (worker_count <= 1) {
+        for (size_t i = 0; i < key_files.size(); i++) {
+          last_processed_key_count +=
+              MatchKeyFile(key_files[i], nullptr, scan_ids, revised_keys, &id_generator,
+                           &matched_keys, &last_key_file_metadata[i]);
+        }
+      } else {
+        // Workers claim tasks through next_task and keep the matches of each
+        // task separate, so the merged result does not depend on which worker
+        // processed which task, and is the same as if every file had been
+        // matched whole.
+        LOG_I("Matching %d files in %d tasks with %d threads", (int) key_files.size(),
+              (int) tasks.size(), (int) worker_count);
+        std::vector<std::vector<MatchedKey>> matched_keys_per_task(tasks.size());
+        std::vector<uint32_t> processed_key_count_per_task(tasks.size(), 0);
+        std::vector<KeyFileMetadata> metadata_per_task(tasks.size());
+        std::atomic<size_t> next_task(0);
+        auto worker = [&](IdGenerator *worker_id_generator) {
+          for (size_t i = next_task++; i < tasks.size(); i = next_task++) {
+            const KeyFileTask &task = tasks[i];
+            processed_key_count_per_task[i] =
+                MatchKeyFile(key_files[task.file_index],
+                             task.whole_file ? nullptr : &task.chunk, scan_ids,
+                             revised_keys, worker_id_generator,
+                             &matched_keys_per_task[i], &metadata_per_task[i]);
           }
-//          LOG_I("TEK: %s - %d, %d", hexStr(key->key_data.bytes, 16).c_str(),
-//                key->has_rolling_start_interval_number ? key->rolling_start_interval_number : -1,
-//                key->has_rolling_period ? key->rolling_period : -1);
-          last_processed_key_count++;
-          if (GenerateIds(key->key_data.bytes,
-                          static_cast<uint32_t>(key->rolling_start_interval_number),
-                          ids)) {
-            for (int j = 0; j < kIdPerKey * kIdLength; j += kIdLength) {
-              if (prefix_key_map->GetIdIndex(&ids[j]) >= 0) {
-                matched_keys.emplace_back(std::move(key));
-                break;
-              }
-            }
-          } else {
-            LOG_E("GenerateIds failed");
+        };
+
+        std::vector<std::thread> threads;
+        std::vector<std::unique_ptr<IdGenerator>> worker_id_generators;
+        for (size_t i = 1; i < worker_count; i++) {
+          worker_id_generators.push_back(std::make_unique<IdGenerator>());
+          threads.emplace_back(worker, worker_id_generators.back().get());
+        }
+        // The calling thread works as well instead of idling on join.
+        worker(&id_generator);
+        for (auto &thread : threads) {
+          thread.join();
+        }
+
+        for (size_t i = 0; i < tasks.size(); i++) {
+          last_processed_key_count += processed_key_count_per_task[i];
+          last_key_file_metadata[tasks[i].file_index].Merge(metadata_per_task[i]);
+          for (auto &matched_key : matched_keys_per_task[i]) {
+            matched_keys.emplace_back(std::move(matched_key));
           }
         }
       }
 
+      if (!revised_keys.Empty()) {
+        // The keys with a revision were left out above, and match as their
+        // revision instead. Revisions are few, so they are matched on this
+        // thread alone.
+        MatchRevisedKeys(revised_keys, scan_ids, &matched_keys);
+        last_revised_keys = revised_keys.Keys();
+      }
+
       if (matched_keys.size() == 0) {
         LOG_I("Matching done, total %d keys, no key matches",
               last_processed_key_count);
-        return nullptr;
+      } else {
+        LOG_I("Matching done, total %d keys, find %d keys match",
+              last_processed_key_count, (int) matched_keys.size());
       }
+      return matched_keys;
+    }
 
-      LOG_I("Matching done, total %d keys, find %d keys match",
-            last_processed_key_count, (int) matched_keys.size());
+    jobjectArray MatchingHelper::Matching(
+        JNIEnv *env, const std::vector<std::string> &key_files, int thread_count,
+        bool apply_revised_keys) {
+      last_match_reports.clear();
+      std::vector<MatchedKey> matched_keys =
+          MatchKeyFiles(key_files, thread_count, apply_revised_keys);
+      if (matched_keys.empty()) {
+        return nullptr;
+      }
 
       jobjectArray proto_array = env->NewObjectArray(
           static_cast<jsize>(matched_keys.size()), env->FindClass("[B"), nullptr);
-      for (int i = 0; i < matched_keys.size(); i++) {
-        auto serialized = EncodeTemporaryExposureKey(matched_keys.at(i).get());
+      for (size_t i = 0; i < matched_keys.size(); i++) {
+        auto serialized = EncodeTemporaryExposureKey(&matched_keys.at(i).key);
+        jbyteArray byte_array =
+            env->NewByteArray(static_cast<jsize>(serialized.size()));
+        env->SetByteArrayRegion(byte_array, 0,
+                                static_cast<jsize>(serialized.size()),
+                                reinterpret_cast<const jbyte *>(serialized.c_str()));
+        env->SetObjectArrayElement(proto_array, static_cast<jsize>(i), byte_array);
+        env->DeleteLocalRef(byte_array);
+        last_match_reports.emplace_back(std::move(matched_keys.at(i).sightings));
+      }
+      return proto_array;
+    }
+
+    jobjectArray MatchingHelper::LastMatchReports(JNIEnv *env) const {
+      if (last_match_reports.empty()) {
+        return nullptr;
+      }
+      jobjectArray report_array = env->NewObjectArray(
+          static_cast<jsize>(last_match_reports.size()), env->FindClass("[I"),
+          nullptr);
+      for (size_t i = 0; i < last_match_reports.size(); i++) {
+        const std::vector<jint> &sightings = last_match_reports[i];
+        jintArray int_array = env->NewIntArray(static_cast<jsize>(sightings.size()));
+        env->SetIntArrayRegion(int_array, 0, static_cast<jsize>(sightings.size()),
+                               sightings.data());
+        env->SetObjectArrayElement(report_array, static_cast<jsize>(i), int_array);
+        env->DeleteLocalRef(int_array);
+      }
+      return report_array;
+    }
+
+    jobjectArray MatchingHelper::LastRevisedKeys(JNIEnv *env) const {
+      if (last_revised_keys.empty()) {
+        return nullptr;
+      }
+      jobjectArray proto_array = env->NewObjectArray(
+          static_cast<jsize>(last_revised_keys.size()), env->FindClass("[B"), nullptr);
+      for (size_t i = 0; i < last_revised_keys.size(); i++) {
+        auto serialized = EncodeTemporaryExposureKey(&last_revised_keys[i]);
         jbyteArray byte_array =
             env->NewByteArray(static_cast<jsize>(serialized.size()));
         env->SetByteArrayRegion(byte_array, 0,
                                 static_cast<jsize>(serialized.size()),
                                 reinterpret_cast<const jbyte *>(serialized.c_str()));
-        env->SetObjectArrayElement(proto_array, i, byte_array);
+        env->SetObjectArrayElement(proto_array, static_cast<jsize>(i), byte_array);
         env->DeleteLocalRef(byte_array);
       }
       return proto_array;
@@ -179,6 +519,7 @@ namespace exposure {
       jint *rolling_start_number_array =
           env->GetIntArrayElements(rolling_start_numbers, 0);
       uint8_t ids[kIdPerKey * kIdLength];
+      int32_t probe_indexes[kIdPerKey];
       static_assert(kIdLength == AES_BLOCK_SIZE, "Incorrect kIdLength.");
       uint8_t *key_bytes[kIdLength];
       for (int i = 0; i < key_count; i++) {
@@ -187,10 +528,16 @@ namespace exposure {
         env->GetByteArrayRegion(key_array, 0, kIdLength, (jbyte *) key_bytes);
         if (GenerateIds(reinterpret_cast<const uint8_t *>(key_bytes),
                         rolling_start_number_array[i], ids)) {
-          for (int j = 0; j < kIdPerKey * kIdLength; j += kIdLength) {
-            if (prefix_key_map->GetIdIndex(&ids[j]) >= 0) {
-              match_indexes.push_back(i);
-              break;
+          const uint32_t start_interval = rolling_start_number_array[i];
+          if (prefix_key_map->ProbeBatch(ids, kIdPerKey, probe_indexes,
+                                         GetSightingWindow(start_interval, kIdPerKey)) > 0) {
+            for (int j = 0; j < kIdPerKey; j++) {
+              if (probe_indexes[j] >= 0 &&
+                  prefix_key_map->GetIdIndex(&ids[j * kIdLength],
+                                             GetSightingWindow(start_interval + j, 1)) >= 0) {
+                match_indexes.push_back(i);
+                break;
+              }
             }
           }
         } else {
@@ -24,22 +24,106 @@
 #include <openssl/digest.h>
 #include <openssl/hkdf.h>
 
+#include <array>
+#include <cstring>
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "constants.h"
+#include "id_generator.h"
+#include "key_file_parser.h"
 #include "prefix_id_map.h"
 
 namespace exposure {
+    // The interval numbers [start_interval, end_interval) covered by the loaded
+    // scan records, and how many intervals past the end of its rolling period
+    // an RPI may still be sighted because of clock drift.
+    struct ScanWindow {
+        int64_t start_interval;
+        int64_t end_interval;
+        int drift_tolerance;
+    };
+
+    // A matched diagnosis key and where its IDs were sighted.
+    struct MatchedKey {
+        TemporaryExposureKeyNano key;
+        // Flattened (interval offset, scan record index) pairs, one per scan
+        // record equal to one of the key's IDs. The interval offset is relative to
+        // the key's rolling_start_interval_number, the scan record index is the
+        // position in the scan records passed to the constructor.
+        std::vector<jint> sightings;
+    };
+
+    // The latest revision of each key among the revised_keys of the key files
+    // being matched, found by key data.
+    class RevisedKeys {
+    public:
+        // Adds key, which must have kTekLength bytes of key data, replacing any
+        // earlier revision of the same key.
+        void Add(const TemporaryExposureKeyNano &key);
+
+        inline bool Empty() const { return keys_.empty(); }
+
+        // One revision per key, in the order the keys were first revised.
+        inline const std::vector<TemporaryExposureKeyNano> &Keys() const { return keys_; }
+
+        // Returns the revision of the key whose key data is tek, or null.
+        const TemporaryExposureKeyNano *Find(const uint8_t *tek) const;
+
+    private:
+        using Tek = std::array<uint8_t, kTekLength>;
+
+        // Key data is random, so any 8 bytes of it make a good hash.
+        struct TekHash {
+            size_t operator()(const Tek &tek) const {
+              uint64_t hash;
+              memcpy(&hash, tek.data(), sizeof(hash));
+              return static_cast<size_t>(hash);
+            }
+        };
+
+        std::vector<TemporaryExposureKeyNano> keys_;
+        std::unordered_map<Tek, size_t, TekHash> indexes_;
+    };
+
     class MatchingHelper {
     public:
-        MatchingHelper(JNIEnv *env, jobjectArray scan_record_ids);
+        MatchingHelper(JNIEnv *env, jobjectArray scan_record_ids,
+                       const ScanWindow &scan_window);
+
+        // Same as above for scan_id_count IDs packed back to back in
+        // packed_scan_ids, which is only read during construction, with the time
+        // each ID was sighted at, so that an ID of a key only matches scan IDs
+        // sighted within the drift tolerance of its interval.
+        MatchingHelper(const uint8_t *packed_scan_ids, const ScanRecordTime *scan_id_times,
+                       int scan_id_count, const ScanWindow &scan_window);
+
+        // Matches against an already built or mapped map, see PrefixIdMap::OpenFile.
+        MatchingHelper(std::unique_ptr<PrefixIdMap> prefix_id_map,
+                       const ScanWindow &scan_window);
 
         ~MatchingHelper();
 
-        // Doing the matching, and return matched diagnosis_keys set.
-        jobjectArray Matching(JNIEnv *env, const std::vector<std::string> &key_files);
+        // Doing the matching, and return matched diagnosis_keys set. Key files
+        // are distributed over at most thread_count workers; the result is
+        // ordered as if the files had been matched one after another.
+        //
+        // With apply_revised_keys, the revised_keys of all key_files are
+        // applied to their keys as well: a key with a revision is replaced by
+        // it, so that it matches with its revised report type, and dropped if
+        // it is revoked. The revisions are collected by a pass over the files
+        // that decodes nothing else, so that a key with a revision is dropped
+        // before any of its IDs is derived. Revisions of keys that are not
+        // among key_files are matched on their own as well.
+        jobjectArray Matching(JNIEnv *env, const std::vector<std::string> &key_files,
+                              int thread_count, bool apply_revised_keys);
+
+        // Same as Matching, returning the matched keys with their sightings
+        // instead of handing them to Java.
+        std::vector<MatchedKey> MatchKeyFiles(const std::vector<std::string> &key_files,
+                                              int thread_count, bool apply_revised_keys);
 
         // Doing the matching, and return int[] for matched diagnosis_keys indexes.
         jintArray MatchingLegacy(JNIEnv *env, jobjectArray diagnosis_keys,
@@ -48,13 +132,88 @@ namespace exposure {
         bool GenerateIds(const uint8_t *diagnosis_key, uint32_t rolling_start_number,
                          uint8_t *ids);
 
+        // Number of keys in the key files of the last Matching call. Revisions
+        // are not counted: most revise a key already counted, see
+        // LastRevisedKeys.
         inline jint LastProcessedKeyCount() const { return last_processed_key_count; }
 
+        inline jint ScanIdCount() const { return prefix_key_map->scan_record_size; }
+
+        // Persists the scan ID index, see PrefixIdMap::WriteFile.
+        bool WriteIndexFile(const std::string &path, int64_t generation) const {
+          return prefix_key_map->WriteFile(path, generation);
+        }
+
+        // Returns int[][] holding MatchedKey::sightings of each key returned by
+        // the last Matching call, in the same order, or nullptr if nothing
+        // matched.
+        jobjectArray LastMatchReports(JNIEnv *env) const;
+
+        // The metadata of each key file passed to the last Matching call, in the
+        // same order, read while its keys were matched.
+        inline const std::vector<KeyFileMetadata> &LastKeyFileMetadata() const {
+          return last_key_file_metadata;
+        }
+
+        // Returns byte[][] holding every revision applied by the last Matching
+        // call, revoked keys included, each a serialized TemporaryExposureKey,
+        // or nullptr if there were none.
+        jobjectArray LastRevisedKeys(JNIEnv *env) const;
+
     private:
+        // Computes the intervals of a key that are worth deriving: those covered
+        // by its rolling period plus drift tolerance that can have been sighted
+        // within scan_window. Returns false if there are none.
+        bool GetIdWindow(int32_t rolling_start_interval_number, int32_t rolling_period,
+                         uint32_t *start_interval, int *id_count) const;
+
+        // Returns the intervals in which the IDs of intervals [start_interval,
+        // start_interval + id_count) can have been sighted.
+        IntervalRange GetSightingWindow(uint32_t start_interval, int id_count) const;
+
+        // Returns whether none of the keys of a key file can have been sighted
+        // within scan_window, from the metadata read before its first key.
+        bool IsOutsideScanWindow(const KeyFileMetadata &metadata) const;
+
+        // Matches all keys of one key file, or of chunk of it if chunk is not
+        // null, other than those with a revision in revised_keys, appending
+        // the matched keys and their sightings to matched_keys and setting
+        // metadata to what it read of the file. The keys of a file outside
+        // scan_window are skipped without being decoded. Only reads the shared
+        // scan_ids and revised_keys, so it can run concurrently as long as each
+        // caller has its own id_generator.
+        uint32_t MatchKeyFile(
+            const std::string &key_file, const KeyFileChunk *chunk,
+            const PrefixIdMap &scan_ids, const RevisedKeys &revised_keys,
+            IdGenerator *id_generator, std::vector<MatchedKey> *matched_keys,
+            KeyFileMetadata *metadata);
+
+        // Matches the keys of batch as MatchKeyFile does, leaving out those with
+        // a revision in revised_keys if it is not null. Counts the keys left out
+        // outside scan_window in *skipped_key_count, and those with a revision
+        // in *revised_key_count.
+        void MatchKeyBatch(const KeyBatch &keys, const PrefixIdMap &scan_ids,
+                           const RevisedKeys *revised_keys, IdGenerator *id_generator,
+                           std::vector<MatchedKey> *matched_keys,
+                           uint32_t *skipped_key_count, uint32_t *revised_key_count);
+
+        // Adds the revised_keys of key_files to revised_keys, in file order,
+        // walking the files without decoding their keys.
+        void ReadRevisedKeys(const std::vector<std::string> &key_files,
+                             RevisedKeys *revised_keys) const;
+
+        // Matches the revisions of revised_keys that are not revoked.
+        void MatchRevisedKeys(const RevisedKeys &revised_keys,
+                              const PrefixIdMap &scan_ids,
+                              std::vector<MatchedKey> *matched_keys);
+
         std::unique_ptr<PrefixIdMap> prefix_key_map;
-        EVP_CIPHER_CTX context;
-        uint8_t aesInputStorage[kIdPerKey * kIdLength];
+        ScanWindow scan_window;
+        IdGenerator id_generator;
         uint32_t last_processed_key_count;
+        std::vector<std::vector<jint>> last_match_reports;
+        std::vector<TemporaryExposureKeyNano> last_revised_keys;
+        std::vector<KeyFileMetadata> last_key_file_metadata;
     };
 }  // namespace exposure
 #endif  // LOCATION_NEARBY_CPP_EXPOSURENOTIFICATION_JNI_MATCHING_HELPER_H_
\ No newline at end of file
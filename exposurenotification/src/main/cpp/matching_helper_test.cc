@@ -0,0 +1,602 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "matching_helper.h"
+
+#include <gtest/gtest.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace exposure {
+    namespace {
+        // Enough keys for SplitKeyFile to cut the export into 8 chunks.
+        constexpr int kKeyCount = 80000;
+        // Keys cover the 14 days up to kScanDay, the only day with scan records.
+        constexpr int kScanDay = 18500;
+        constexpr int kKeyDays = 14;
+        // One key in kSightedKeyRatio of kScanDay is sighted.
+        constexpr int kSightedKeyRatio = 40;
+        constexpr int kRevisedKeyRatio = 3;
+
+        void PutVarint(uint64_t value, std::string *message) {
+          while (value >= 0x80) {
+            message->push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+          }
+          message->push_back(static_cast<char>(value));
+        }
+
+        void PutField(int tag, const std::string &value, std::string *message) {
+          PutVarint(tag << 3 | PB_WT_STRING, message);
+          PutVarint(value.size(), message);
+          message->append(value);
+        }
+
+        std::string EncodeKey(const uint8_t *tek, int rolling_start_interval_number,
+                              int report_type, int rolling_period = kIdPerKey) {
+          std::string key;
+          PutField(1, std::string(reinterpret_cast<const char *>(tek), kTekLength), &key);
+          PutVarint(2 << 3 | PB_WT_VARINT, &key);
+          PutVarint(4, &key);
+          PutVarint(3 << 3 | PB_WT_VARINT, &key);
+          PutVarint(rolling_start_interval_number, &key);
+          PutVarint(4 << 3 | PB_WT_VARINT, &key);
+          PutVarint(rolling_period, &key);
+          PutVarint(5 << 3 | PB_WT_VARINT, &key);
+          PutVarint(report_type, &key);
+          return key;
+        }
+
+        // The fields of the export other than its keys.
+        std::string EncodeOtherField(int field) {
+          std::string message;
+          switch (field % 5) {
+            case 0:
+              // start_timestamp
+              PutVarint(1 << 3 | PB_WT_64BIT, &message);
+              message.append(8, '\x01');
+              break;
+            case 1:
+              PutField(3, "US", &message);
+              break;
+            case 2:
+              // batch_num
+              PutVarint(4 << 3 | PB_WT_VARINT, &message);
+              PutVarint(1, &message);
+              break;
+            case 3:
+              PutField(6, std::string(40, 's'), &message);
+              break;
+            default:
+              // An unknown field.
+              PutVarint(15 << 3 | PB_WT_32BIT, &message);
+              message.append(4, '\x02');
+              break;
+          }
+          return message;
+        }
+
+        void PutFixed64(int tag, uint64_t value, std::string *message) {
+          PutVarint(tag << 3 | PB_WT_64BIT, message);
+          for (int i = 0; i < 8; i++) {
+            message->push_back(static_cast<char>(value >> (8 * i)));
+          }
+        }
+
+        // The header fields of the first of two batches from region "US".
+        std::string EncodeHeader(uint64_t start_timestamp, uint64_t end_timestamp) {
+          std::string header;
+          PutFixed64(1, start_timestamp, &header);
+          PutFixed64(2, end_timestamp, &header);
+          PutField(3, "US", &header);
+          PutVarint(4 << 3 | PB_WT_VARINT, &header);
+          PutVarint(1, &header);
+          PutVarint(5 << 3 | PB_WT_VARINT, &header);
+          PutVarint(2, &header);
+          return header;
+        }
+
+        std::string WriteKeyFile(const std::string &name, const std::string &contents) {
+          std::string path = ::testing::TempDir() + name;
+          std::ofstream file(path, std::ios::binary | std::ios::trunc);
+          file << kFileHeader << contents;
+          return path;
+        }
+
+        void PutLe(uint32_t value, int size, std::string *archive) {
+          for (int i = 0; i < size; i++) {
+            archive->push_back(static_cast<char>(value >> (8 * i)));
+          }
+        }
+
+        // Writes a key archive whose export.bin, deflated, holds the key file
+        // contents.
+        std::string WriteKeyArchive(const std::string &name, const std::string &contents) {
+          const std::string entries[2][2] = {
+              {kKeyArchiveKeyFileName, kFileHeader + contents},
+              {kKeyArchiveSignatureFileName, std::string(100, 's')}};
+          std::string archive;
+          std::string directory;
+          for (const auto &entry : entries) {
+            const std::string &data = entry[1];
+            z_stream stream;
+            memset(&stream, 0, sizeof(stream));
+            deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+                         Z_DEFAULT_STRATEGY);
+            std::string compressed(deflateBound(&stream, data.size()), '\0');
+            stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+            stream.avail_in = static_cast<uInt>(data.size());
+            stream.next_out = reinterpret_cast<Bytef *>(&compressed[0]);
+            stream.avail_out = static_cast<uInt>(compressed.size());
+            EXPECT_EQ(Z_STREAM_END, deflate(&stream, Z_FINISH));
+            compressed.resize(stream.total_out);
+            deflateEnd(&stream);
+            const uint32_t crc = static_cast<uint32_t>(crc32(
+                0, reinterpret_cast<const Bytef *>(data.data()), static_cast<uInt>(data.size())));
+
+            // The fields shared by the local and central directory headers.
+            std::string fields;
+            PutLe(20, 2, &fields);
+            PutLe(0, 2, &fields);
+            PutLe(8, 2, &fields);
+            PutLe(0, 4, &fields);
+            PutLe(crc, 4, &fields);
+            PutLe(static_cast<uint32_t>(compressed.size()), 4, &fields);
+            PutLe(static_cast<uint32_t>(data.size()), 4, &fields);
+            PutLe(static_cast<uint32_t>(entry[0].size()), 2, &fields);
+            PutLe(0, 2, &fields);
+
+            PutLe(0x02014b50, 4, &directory);
+            PutLe(20, 2, &directory);
+            directory += fields;
+            PutLe(0, 2 + 2 + 2 + 4, &directory);
+            PutLe(static_cast<uint32_t>(archive.size()), 4, &directory);
+            directory += entry[0];
+
+            PutLe(0x04034b50, 4, &archive);
+            archive += fields + entry[0] + compressed;
+          }
+          const uint32_t directory_offset = static_cast<uint32_t>(archive.size());
+          archive += directory;
+          PutLe(0x06054b50, 4, &archive);
+          PutLe(0, 4, &archive);
+          PutLe(2, 2, &archive);
+          PutLe(2, 2, &archive);
+          PutLe(static_cast<uint32_t>(directory.size()), 4, &archive);
+          PutLe(directory_offset, 4, &archive);
+          PutLe(0, 2, &archive);
+
+          std::string path = ::testing::TempDir() + name;
+          std::ofstream file(path, std::ios::binary | std::ios::trunc);
+          file << archive;
+          return path;
+        }
+
+        void ExpectSameMatches(const std::vector<MatchedKey> &expected,
+                               const std::vector<MatchedKey> &actual) {
+          ASSERT_EQ(expected.size(), actual.size());
+          for (size_t i = 0; i < expected.size(); i++) {
+            SCOPED_TRACE(i);
+            const TemporaryExposureKeyNano &expected_key = expected[i].key;
+            const TemporaryExposureKeyNano &actual_key = actual[i].key;
+            EXPECT_EQ(0, memcmp(expected_key.key_data.bytes, actual_key.key_data.bytes,
+                                kTekLength));
+            EXPECT_EQ(expected_key.rolling_start_interval_number,
+                      actual_key.rolling_start_interval_number);
+            EXPECT_EQ(expected_key.rolling_period, actual_key.rolling_period);
+            EXPECT_EQ(expected_key.report_type, actual_key.report_type);
+            EXPECT_EQ(expected[i].sightings, actual[i].sightings);
+          }
+        }
+
+        constexpr int kDriftTolerance = 12;
+
+        // Matches a key of rolling_start and rolling_period against a single scan
+        // record: the key's ID of interval id_interval, sighted in interval
+        // sighted_interval. Returns whether the key matched, expecting that
+        // sighting if it did.
+        bool MatchesSighting(int rolling_start, int rolling_period, int id_interval,
+                             int sighted_interval, const ScanWindow &scan_window) {
+          const uint8_t tek[kTekLength] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+          const int offset = id_interval - rolling_start;
+          EXPECT_TRUE(offset >= 0 && offset < kIdPerKey);
+          ScanRecordTime time = {static_cast<uint16_t>(sighted_interval / kIntervalsPerDay),
+                                 static_cast<uint8_t>(sighted_interval % kIntervalsPerDay),
+                                 static_cast<uint8_t>(sighted_interval % kIntervalsPerDay)};
+          uint8_t no_id[kIdLength] = {0};
+          MatchingHelper id_helper(no_id, &time, 1, scan_window);
+          uint8_t ids[kIdPerKey * kIdLength];
+          EXPECT_TRUE(id_helper.GenerateIds(tek, rolling_start, ids));
+          MatchingHelper helper(&ids[offset * kIdLength], &time, 1, scan_window);
+
+          std::string contents;
+          PutField(TemporaryExposureKeyExportNano_keys_tag,
+                   EncodeKey(tek, rolling_start, 1, rolling_period), &contents);
+          std::vector<MatchedKey> matched_keys = helper.MatchKeyFiles(
+              {WriteKeyFile("drift.bin", contents)}, 1, /*apply_revised_keys=*/false);
+          if (matched_keys.empty()) {
+            return false;
+          }
+          EXPECT_EQ(1u, matched_keys.size());
+          EXPECT_EQ(std::vector<jint>({offset, 0}), matched_keys[0].sightings);
+          return true;
+        }
+
+        // An ID may be sighted up to the drift tolerance before or after its
+        // interval, and no further, also across the day boundaries of the scan
+        // records.
+        TEST(MatchingHelperDriftTest, RejectsSightingsOutsideDriftOfTheirInterval) {
+          const int rolling_start = kScanDay * kIntervalsPerDay;
+          const ScanWindow scan_window = {rolling_start - kIntervalsPerDay,
+                                          rolling_start + 2 * kIntervalsPerDay, kDriftTolerance};
+          for (int offset : {0, 70, kIdPerKey - 1}) {
+            const int id_interval = rolling_start + offset;
+            for (int drift : {0, 1, kDriftTolerance, kDriftTolerance + 1, 2 * kIntervalsPerDay}) {
+              SCOPED_TRACE(testing::Message() << "offset " << offset << " drift " << drift);
+              const bool within = drift <= kDriftTolerance;
+              EXPECT_EQ(within, MatchesSighting(rolling_start, kIdPerKey, id_interval,
+                                                id_interval + drift, scan_window));
+              EXPECT_EQ(within, MatchesSighting(rolling_start, kIdPerKey, id_interval,
+                                                id_interval - drift, scan_window));
+            }
+          }
+        }
+
+        // A key shorter than a day is still derived for the drift tolerance past
+        // its rolling period, but not beyond.
+        TEST(MatchingHelperDriftTest, DerivesIdsUpToDriftPastRollingPeriod) {
+          constexpr int kRollingPeriod = 100;
+          const int rolling_start = kScanDay * kIntervalsPerDay;
+          const ScanWindow scan_window = {rolling_start, rolling_start + kIntervalsPerDay,
+                                          kDriftTolerance};
+          const int last_id = rolling_start + kRollingPeriod + kDriftTolerance - 1;
+          EXPECT_TRUE(MatchesSighting(rolling_start, kRollingPeriod, last_id, last_id,
+                                      scan_window));
+          EXPECT_FALSE(MatchesSighting(rolling_start, kRollingPeriod, last_id + 1, last_id + 1,
+                                       scan_window));
+          EXPECT_FALSE(MatchesSighting(rolling_start, kRollingPeriod, last_id + 1, last_id,
+                                       scan_window));
+        }
+
+        // Keys reaching past either end of the scan window are only derived for
+        // the intervals whose IDs can be sighted within it.
+        TEST(MatchingHelperDriftTest, ClipsKeysToScanWindow) {
+          const int start = kScanDay * kIntervalsPerDay;
+          const int end = start + kIntervalsPerDay;
+          const ScanWindow scan_window = {start, end, kDriftTolerance};
+
+          // Starts a day before the window.
+          const int early_start = start - kIntervalsPerDay;
+          EXPECT_TRUE(MatchesSighting(early_start, kIdPerKey, start - kDriftTolerance, start,
+                                      scan_window));
+          EXPECT_FALSE(MatchesSighting(early_start, kIdPerKey, start - kDriftTolerance - 1,
+                                       start - 1, scan_window));
+
+          // Ends half a day after it.
+          const int late_start = end - kIntervalsPerDay / 2;
+          EXPECT_TRUE(MatchesSighting(late_start, kIdPerKey, end + kDriftTolerance - 1, end - 1,
+                                      scan_window));
+          EXPECT_FALSE(MatchesSighting(late_start, kIdPerKey, end + kDriftTolerance, end,
+                                       scan_window));
+        }
+
+        class MatchingHelperTest : public ::testing::Test {
+        protected:
+            void SetUp() override {
+              std::mt19937 random(1);
+              std::vector<uint8_t> teks(static_cast<size_t>(kKeyCount) * kTekLength);
+              for (uint8_t &byte : teks) {
+                byte = static_cast<uint8_t>(random());
+              }
+
+              // Any helper derives the same IDs.
+              uint8_t no_id[kIdLength] = {0};
+              ScanRecordTime no_time = {kScanDay, 0, 0};
+              MatchingHelper id_helper(no_id, &no_time, 1, scan_window);
+
+              std::vector<uint8_t> scan_ids;
+              std::vector<ScanRecordTime> scan_times;
+              uint8_t ids[kIdPerKey * kIdLength];
+              int sighted_key_count = 0;
+              for (int i = 0; i < kKeyCount; i++) {
+                const int day = kScanDay - kKeyDays + 1 + i % kKeyDays;
+                const uint8_t *tek = &teks[i * kTekLength];
+                keys.push_back(EncodeKey(tek, day * kIntervalsPerDay, 1));
+                if (i % kRevisedKeyRatio == 0) {
+                  revised_keys.push_back(EncodeKey(tek, day * kIntervalsPerDay, 2));
+                }
+                if (day != kScanDay || (i / kKeyDays) % kSightedKeyRatio != 0) {
+                  continue;
+                }
+                ASSERT_TRUE(id_helper.GenerateIds(tek, day * kIntervalsPerDay, ids));
+                // One to three sightings, some of the same ID.
+                for (int j = 0; j <= sighted_key_count % 3; j++) {
+                  int interval = static_cast<int>(random() % kIdPerKey);
+                  if (j == 2) {
+                    interval = static_cast<int>(scan_times.back().first_interval);
+                  }
+                  scan_ids.insert(scan_ids.end(), &ids[interval * kIdLength],
+                                  &ids[(interval + 1) * kIdLength]);
+                  scan_times.push_back(ScanRecordTime{
+                      kScanDay, static_cast<uint8_t>(interval), static_cast<uint8_t>(interval)});
+                }
+                sighted_key_count++;
+              }
+              // IDs of nobody.
+              for (int i = 0; i < 10000; i++) {
+                for (int j = 0; j < kIdLength; j++) {
+                  scan_ids.push_back(static_cast<uint8_t>(random()));
+                }
+                scan_times.push_back(ScanRecordTime{kScanDay, 0, kIntervalsPerDay - 1});
+              }
+              helper.reset(new MatchingHelper(scan_ids.data(), scan_times.data(),
+                                              static_cast<int>(scan_times.size()),
+                                              scan_window));
+            }
+
+            // Matches key_file whole, then as 2 to 8 chunks, expecting the same
+            // result every time.
+            void ExpectSameMatchesInChunks(const std::string &key_file, bool apply_revised_keys) {
+              std::vector<MatchedKey> expected =
+                  helper->MatchKeyFiles({key_file}, 1, apply_revised_keys);
+              const int expected_processed_key_count = helper->LastProcessedKeyCount();
+              ASSERT_GT(expected.size(), 10u);
+              for (int thread_count = 2; thread_count <= kMaxMatchingThreadCount;
+                   thread_count++) {
+                SCOPED_TRACE(thread_count);
+                ASSERT_EQ(static_cast<size_t>(thread_count),
+                          SplitKeyFile(key_file, thread_count).size());
+                std::vector<MatchedKey> actual =
+                    helper->MatchKeyFiles({key_file}, thread_count, apply_revised_keys);
+                EXPECT_EQ(expected_processed_key_count, helper->LastProcessedKeyCount());
+                ExpectSameMatches(expected, actual);
+              }
+            }
+
+            // The keys, with the other fields, an unknown field and the revised
+            // keys between them.
+            std::string InterleavedKeyFileContents() const {
+              std::string contents;
+              size_t next_revised_key = 0;
+              for (size_t i = 0; i < keys.size(); i++) {
+                if (i % 997 == 0) {
+                  contents.append(EncodeOtherField(static_cast<int>(i / 997)));
+                }
+                if (i % 1999 == 0 && next_revised_key < revised_keys.size()) {
+                  PutField(TemporaryExposureKeyExportNano_revised_keys_tag,
+                           revised_keys[next_revised_key++], &contents);
+                }
+                PutField(TemporaryExposureKeyExportNano_keys_tag, keys[i], &contents);
+              }
+              contents.append(EncodeOtherField(4));
+              return contents;
+            }
+
+            const ScanWindow scan_window = {kScanDay * kIntervalsPerDay,
+                                            (kScanDay + 1) * kIntervalsPerDay, 12};
+            std::vector<std::string> keys;
+            std::vector<std::string> revised_keys;
+            std::unique_ptr<MatchingHelper> helper;
+        };
+
+        TEST_F(MatchingHelperTest, MatchesChunksAsWholeFile) {
+          std::string contents;
+          for (const std::string &key : keys) {
+            PutField(TemporaryExposureKeyExportNano_keys_tag, key, &contents);
+          }
+          std::string key_file = WriteKeyFile("keys_only.bin", contents);
+
+          ExpectSameMatchesInChunks(key_file, /*apply_revised_keys=*/false);
+        }
+
+        TEST_F(MatchingHelperTest, MatchesChunksWithInterleavedFieldsAsWholeFile) {
+          std::string key_file = WriteKeyFile("interleaved.bin", InterleavedKeyFileContents());
+
+          ExpectSameMatchesInChunks(key_file, /*apply_revised_keys=*/false);
+          ExpectSameMatchesInChunks(key_file, /*apply_revised_keys=*/true);
+        }
+
+        TEST_F(MatchingHelperTest, MatchesArchiveAsExtractedKeyFile) {
+          const std::string contents = InterleavedKeyFileContents();
+          std::string key_file = WriteKeyFile("interleaved.bin", contents);
+          // Inflated over many blocks.
+          std::string key_archive = WriteKeyArchive("interleaved.zip", contents);
+
+          for (bool apply_revised_keys : {false, true}) {
+            SCOPED_TRACE(apply_revised_keys);
+            std::vector<MatchedKey> expected =
+                helper->MatchKeyFiles({key_file}, 1, apply_revised_keys);
+            const int expected_processed_key_count = helper->LastProcessedKeyCount();
+            ASSERT_GT(expected.size(), 10u);
+            std::vector<MatchedKey> actual = helper->MatchKeyFiles(
+                {key_archive}, kMaxMatchingThreadCount, apply_revised_keys);
+            EXPECT_EQ(expected_processed_key_count, helper->LastProcessedKeyCount());
+            ExpectSameMatches(expected, actual);
+          }
+        }
+
+        TEST_F(MatchingHelperTest, ReadsKeyFileMetadataWhileMatching) {
+          const uint64_t end_timestamp = (kScanDay + 1) * kIntervalsPerDay * 600ull;
+          std::string contents = EncodeHeader(end_timestamp - 86400, end_timestamp);
+          for (const std::string &key : keys) {
+            PutField(TemporaryExposureKeyExportNano_keys_tag, key, &contents);
+          }
+          std::string key_file = WriteKeyFile("with_header.bin", contents);
+
+          for (int thread_count : {1, kMaxMatchingThreadCount}) {
+            SCOPED_TRACE(thread_count);
+            EXPECT_FALSE(helper->MatchKeyFiles({key_file}, thread_count, false).empty());
+            ASSERT_EQ(1u, helper->LastKeyFileMetadata().size());
+            const KeyFileMetadata &metadata = helper->LastKeyFileMetadata()[0];
+            EXPECT_TRUE(metadata.has_start_timestamp);
+            EXPECT_EQ(end_timestamp - 86400, metadata.start_timestamp);
+            EXPECT_TRUE(metadata.has_end_timestamp);
+            EXPECT_EQ(end_timestamp, metadata.end_timestamp);
+            EXPECT_EQ("US", metadata.region);
+            EXPECT_TRUE(metadata.has_batch_num);
+            EXPECT_EQ(1, metadata.batch_num);
+            EXPECT_TRUE(metadata.has_batch_size);
+            EXPECT_EQ(2, metadata.batch_size);
+            EXPECT_EQ(static_cast<size_t>(kKeyCount), metadata.key_count);
+            EXPECT_EQ(static_cast<size_t>(kKeyCount), metadata.decoded_key_count);
+            EXPECT_EQ((kScanDay - kKeyDays + 1) * kIntervalsPerDay,
+                      metadata.min_rolling_start_interval_number);
+            EXPECT_EQ(kScanDay * kIntervalsPerDay, metadata.max_rolling_start_interval_number);
+          }
+        }
+
+        // A file exported before the scan window less drift and a whole rolling
+        // period is skipped without decoding a key, however its keys would match.
+        TEST_F(MatchingHelperTest, SkipsKeyFilesExportedBeforeScanWindow) {
+          const uint64_t last_end_timestamp =
+              (scan_window.start_interval - scan_window.drift_tolerance - kIdPerKey) * 600ull;
+          for (uint64_t end_timestamp : {last_end_timestamp, last_end_timestamp + 600}) {
+            SCOPED_TRACE(end_timestamp);
+            const bool skipped = end_timestamp == last_end_timestamp;
+            std::string contents = EncodeHeader(end_timestamp - 86400, end_timestamp);
+            for (size_t i = 0; i < keys.size(); i++) {
+              if (i % kRevisedKeyRatio == 0) {
+                PutField(TemporaryExposureKeyExportNano_revised_keys_tag,
+                         revised_keys[i / kRevisedKeyRatio], &contents);
+              }
+              PutField(TemporaryExposureKeyExportNano_keys_tag, keys[i], &contents);
+            }
+            std::string key_file = WriteKeyFile("exported_before.bin", contents);
+
+            for (int thread_count : {1, kMaxMatchingThreadCount}) {
+              SCOPED_TRACE(thread_count);
+              EXPECT_EQ(skipped,
+                        helper->MatchKeyFiles({key_file}, thread_count, false).empty());
+              EXPECT_EQ(kKeyCount, helper->LastProcessedKeyCount());
+              const KeyFileMetadata &metadata = helper->LastKeyFileMetadata()[0];
+              EXPECT_EQ(static_cast<size_t>(kKeyCount), metadata.key_count);
+              EXPECT_EQ(skipped ? 0u : static_cast<size_t>(kKeyCount),
+                        metadata.decoded_key_count);
+
+              // The revised keys between the skipped keys are still matched.
+              std::vector<MatchedKey> matched_keys =
+                  helper->MatchKeyFiles({key_file}, thread_count, true);
+              ASSERT_FALSE(matched_keys.empty());
+              if (skipped) {
+                for (const MatchedKey &matched_key : matched_keys) {
+                  EXPECT_EQ(2, matched_key.key.report_type);
+                }
+              }
+            }
+          }
+        }
+
+        // Revisions in a later file apply to the keys before them, and are not
+        // counted as keys.
+        TEST_F(MatchingHelperTest, AppliesRevisionsOfEarlierFiles) {
+          std::string contents;
+          for (const std::string &key : keys) {
+            PutField(TemporaryExposureKeyExportNano_keys_tag, key, &contents);
+          }
+          std::string key_file = WriteKeyFile("keys_only.bin", contents);
+          std::vector<MatchedKey> unrevised = helper->MatchKeyFiles({key_file}, 1, false);
+          ASSERT_GT(unrevised.size(), 2u);
+          const TemporaryExposureKeyNano &revoked = unrevised[0].key;
+          const TemporaryExposureKeyNano &revised = unrevised[1].key;
+          std::string revisions;
+          PutField(TemporaryExposureKeyExportNano_revised_keys_tag,
+                   EncodeKey(revoked.key_data.bytes, revoked.rolling_start_interval_number,
+                             com_google_samples_exposurenotification_TemporaryExposureKey_ReportType_REVOKED),
+                   &revisions);
+          PutField(TemporaryExposureKeyExportNano_revised_keys_tag,
+                   EncodeKey(revised.key_data.bytes, revised.rolling_start_interval_number, 2),
+                   &revisions);
+          std::string revision_file = WriteKeyFile("revisions.bin", revisions);
+
+          for (int thread_count : {1, kMaxMatchingThreadCount}) {
+            SCOPED_TRACE(thread_count);
+            std::vector<MatchedKey> matched_keys =
+                helper->MatchKeyFiles({key_file, revision_file}, thread_count, true);
+            EXPECT_EQ(kKeyCount, helper->LastProcessedKeyCount());
+            ASSERT_EQ(unrevised.size() - 1, matched_keys.size());
+            for (const MatchedKey &matched_key : matched_keys) {
+              EXPECT_NE(0, memcmp(revoked.key_data.bytes, matched_key.key.key_data.bytes,
+                                  kTekLength));
+            }
+            // The revision is matched after the keys of the files.
+            const MatchedKey &last = matched_keys.back();
+            EXPECT_EQ(0, memcmp(revised.key_data.bytes, last.key.key_data.bytes, kTekLength));
+            EXPECT_EQ(2, last.key.report_type);
+            EXPECT_EQ(unrevised[1].sightings, last.sightings);
+          }
+        }
+
+        TEST(MatchingHelperArchiveTest, MatchesSampleArchiveAsExtractedKeyFile) {
+          // A key server archive, and the export.bin unzip extracts from it.
+          const std::string key_archive =
+              MATCHING_TESTDATA_DIR "/sample_diagnosis_key_file.zip";
+          const std::string key_file =
+              MATCHING_TESTDATA_DIR "/sample_diagnosis_key_file_export.bin";
+
+          // Sights every third key of the file.
+          std::unique_ptr<KeyFileIterator> iterator = CreateKeyFileIterator(key_file);
+          ASSERT_NE(nullptr, iterator);
+          std::vector<TemporaryExposureKeyNano> sighted_keys;
+          for (int i = 0; iterator->HasNext(); i++) {
+            std::unique_ptr<TemporaryExposureKeyNano> key = iterator->Next();
+            ASSERT_NE(nullptr, key);
+            if (i % 3 == 0) {
+              sighted_keys.push_back(*key);
+            }
+          }
+          ASSERT_FALSE(sighted_keys.empty());
+          int64_t start_interval = sighted_keys[0].rolling_start_interval_number;
+          int64_t end_interval = start_interval;
+          for (const TemporaryExposureKeyNano &key : sighted_keys) {
+            start_interval = std::min<int64_t>(start_interval, key.rolling_start_interval_number);
+            end_interval = std::max<int64_t>(end_interval,
+                                             key.rolling_start_interval_number + kIdPerKey);
+          }
+          const ScanWindow scan_window = {start_interval, end_interval, 12};
+          uint8_t no_id[kIdLength] = {0};
+          ScanRecordTime no_time = {0, 0, 0};
+          MatchingHelper id_helper(no_id, &no_time, 1, scan_window);
+          std::vector<uint8_t> scan_ids;
+          std::vector<ScanRecordTime> scan_times;
+          uint8_t ids[kIdPerKey * kIdLength];
+          for (const TemporaryExposureKeyNano &key : sighted_keys) {
+            ASSERT_TRUE(id_helper.GenerateIds(key.key_data.bytes,
+                                              key.rolling_start_interval_number, ids));
+            const int interval = key.rolling_start_interval_number + 10;
+            scan_ids.insert(scan_ids.end(), &ids[10 * kIdLength], &ids[11 * kIdLength]);
+            scan_times.push_back(ScanRecordTime{
+                static_cast<uint16_t>(interval / kIntervalsPerDay),
+                static_cast<uint8_t>(interval % kIntervalsPerDay),
+                static_cast<uint8_t>(interval % kIntervalsPerDay)});
+          }
+          MatchingHelper helper(scan_ids.data(), scan_times.data(),
+                                static_cast<int>(scan_times.size()), scan_window);
+
+          std::vector<MatchedKey> expected = helper.MatchKeyFiles({key_file}, 1, false);
+          const int expected_processed_key_count = helper.LastProcessedKeyCount();
+          EXPECT_EQ(sighted_keys.size(), expected.size());
+          std::vector<MatchedKey> actual = helper.MatchKeyFiles({key_archive}, 1, false);
+          EXPECT_EQ(expected_processed_key_count, helper.LastProcessedKeyCount());
+          ExpectSameMatches(expected, actual);
+        }
+    }  // namespace
+}  // namespace exposure
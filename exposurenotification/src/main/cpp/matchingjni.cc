@@ -15,24 +15,45 @@
  */
 
 #include <jni.h>
+#include <openssl/sha.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
 #include <string>
 #include <vector>
 
 #include "constants.h"
+#include "key_file_verifier.h"
 #include "matching_helper.h"
 #include "prefix_id_map.h"
 
+namespace {
+std::vector<uint8_t> GetByteArrayElement(JNIEnv *env, jobjectArray arrays,
+                                         int index) {
+  jbyteArray array = (jbyteArray) (env->GetObjectArrayElement(arrays, index));
+  std::vector<uint8_t> bytes;
+  if (array != nullptr) {
+    bytes.resize(env->GetArrayLength(array));
+    env->GetByteArrayRegion(array, 0, static_cast<jsize>(bytes.size()),
+                            reinterpret_cast<jbyte *>(bytes.data()));
+    env->DeleteLocalRef(array);
+  }
+  return bytes;
+}
+}  // namespace
+
 extern "C" {
 
 #define JND_PACKAGE(name) Java_com_google_samples_exposurenotification_matching_##name
 #define JND(name) JND_PACKAGE(MatchingJni_##name)
 
 JNIEXPORT jlong JNICALL JND(initNative)(JNIEnv *env, jclass clazz,
-                                        jobjectArray scan_id_records) {
+                                        jobjectArray scan_id_records,
+                                        jint scan_start_interval,
+                                        jint scan_end_interval,
+                                        jint drift_tolerance) {
   if (scan_id_records == nullptr) {
     LOG_W("Invalid input for initNative, scan records is null");
     return 0;
@@ -43,13 +64,100 @@ JNIEXPORT jlong JNICALL JND(initNative)(JNIEnv *env, jclass clazz,
     return 0;
   }
 
+  exposure::ScanWindow scan_window = {scan_start_interval, scan_end_interval,
+                                      std::max(0, drift_tolerance)};
   return reinterpret_cast<jlong>(
-      new exposure::MatchingHelper(env, scan_id_records));
+      new exposure::MatchingHelper(env, scan_id_records, scan_window));
+}
+
+JNIEXPORT jlong JNICALL JND(initDirectNative)(JNIEnv *env, jclass clazz,
+                                              jobject scan_records,
+                                              jint scan_id_count,
+                                              jint scan_start_interval,
+                                              jint scan_end_interval,
+                                              jint drift_tolerance) {
+  if (scan_records == nullptr || scan_id_count <= 0) {
+    LOG_W("Invalid input for initDirectNative, scan records is empty");
+    return 0;
+  }
+
+  const uint8_t *records =
+      static_cast<const uint8_t *>(env->GetDirectBufferAddress(scan_records));
+  jlong capacity = env->GetDirectBufferCapacity(scan_records);
+  if (records == nullptr ||
+      capacity < static_cast<jlong>(scan_id_count) * exposure::kScanRecordLength) {
+    LOG_W("Invalid input for initDirectNative, not a direct buffer of %d records",
+          scan_id_count);
+    return 0;
+  }
+
+  // Split the records into the IDs and the times they were sighted at.
+  std::vector<uint8_t> packed_ids(static_cast<size_t>(scan_id_count) * exposure::kIdLength);
+  std::vector<exposure::ScanRecordTime> times(scan_id_count);
+  for (int i = 0; i < scan_id_count; i++) {
+    const uint8_t *record = records + static_cast<size_t>(i) * exposure::kScanRecordLength;
+    const uint8_t *intervals = record + exposure::kContactRecordKeyLength;
+    times[i].day_number = static_cast<uint16_t>((record[0] << 8) | record[1]);
+    times[i].first_interval = intervals[0];
+    times[i].last_interval = intervals[1];
+    memcpy(&packed_ids[i * exposure::kIdLength], record + exposure::kDayNumberLength,
+           exposure::kIdLength);
+  }
+
+  exposure::ScanWindow scan_window = {scan_start_interval, scan_end_interval,
+                                      std::max(0, drift_tolerance)};
+  return reinterpret_cast<jlong>(new exposure::MatchingHelper(
+      packed_ids.data(), times.data(), scan_id_count, scan_window));
+}
+
+JNIEXPORT jlong JNICALL JND(initIndexFileNative)(JNIEnv *env, jclass clazz,
+                                                 jstring index_file_path,
+                                                 jlong generation,
+                                                 jint scan_start_interval,
+                                                 jint scan_end_interval,
+                                                 jint drift_tolerance,
+                                                 jboolean compact) {
+  if (index_file_path == nullptr) {
+    LOG_W("Invalid input for initIndexFileNative, path is null");
+    return 0;
+  }
+
+  const char *path_chars = env->GetStringUTFChars(index_file_path, 0);
+  std::string path(path_chars);
+  env->ReleaseStringUTFChars(index_file_path, path_chars);
+  std::unique_ptr<exposure::PrefixIdMap> prefix_id_map =
+      exposure::PrefixIdMap::OpenFile(path, generation, compact == JNI_TRUE);
+  if (prefix_id_map == nullptr) {
+    return 0;
+  }
+
+  exposure::ScanWindow scan_window = {scan_start_interval, scan_end_interval,
+                                      std::max(0, drift_tolerance)};
+  return reinterpret_cast<jlong>(
+      new exposure::MatchingHelper(std::move(prefix_id_map), scan_window));
+}
+
+JNIEXPORT jboolean JNICALL JND(writeIndexFileNative)(JNIEnv *env, jclass clazz,
+                                                     jlong native_ptr,
+                                                     jstring index_file_path,
+                                                     jlong generation) {
+  if (native_ptr == 0 || index_file_path == nullptr) {
+    LOG_W("Invalid input for writeIndexFileNative");
+    return JNI_FALSE;
+  }
+
+  const char *path_chars = env->GetStringUTFChars(index_file_path, 0);
+  std::string path(path_chars);
+  env->ReleaseStringUTFChars(index_file_path, path_chars);
+  exposure::MatchingHelper *wrapper =
+      reinterpret_cast<exposure::MatchingHelper *>(native_ptr);
+  return wrapper->WriteIndexFile(path, generation) ? JNI_TRUE : JNI_FALSE;
 }
 
 JNIEXPORT jobjectArray JNICALL
 JND(matchingNative)(JNIEnv *env, jclass clazz, jlong native_ptr,
-                    jobjectArray key_files_jstring) {
+                    jobjectArray key_files_jstring, jint thread_count,
+                    jboolean apply_revised_keys) {
   if (native_ptr == 0 || key_files_jstring == nullptr) {
     LOG_W("Invalid input for matchingNative");
     return nullptr;
@@ -70,7 +178,8 @@ JND(matchingNative)(JNIEnv *env, jclass clazz, jlong native_ptr,
 
   exposure::MatchingHelper *wrapper =
       reinterpret_cast<exposure::MatchingHelper *>(native_ptr);
-  return wrapper->Matching(env, key_files);
+  return wrapper->Matching(env, key_files, thread_count,
+                           apply_revised_keys == JNI_TRUE);
 }
 
 JNIEXPORT jintArray JNICALL JND(matchingLegacyNative)(
@@ -103,6 +212,131 @@ JNIEXPORT jint JNICALL JND(lastProcessedKeyCountNative)(JNIEnv *env,
   return wrapper->LastProcessedKeyCount();
 }
 
+JNIEXPORT jint JNICALL JND(scanIdCountNative)(JNIEnv *env, jclass clazz,
+                                              jlong native_ptr) {
+  if (native_ptr == 0) {
+    LOG_W("Invalid input for scanIdCount");
+    return -1;
+  }
+
+  exposure::MatchingHelper *wrapper =
+      reinterpret_cast<exposure::MatchingHelper *>(native_ptr);
+  return wrapper->ScanIdCount();
+}
+
+JNIEXPORT jobjectArray JNICALL JND(lastMatchReportsNative)(JNIEnv *env,
+                                                         jclass clazz,
+                                                         jlong native_ptr) {
+  if (native_ptr == 0) {
+    LOG_W("Invalid input for lastMatchReports");
+    return nullptr;
+  }
+
+  exposure::MatchingHelper *wrapper =
+      reinterpret_cast<exposure::MatchingHelper *>(native_ptr);
+  return wrapper->LastMatchReports(env);
+}
+
+JNIEXPORT jobjectArray JNICALL JND(lastRevisedKeysNative)(JNIEnv *env,
+                                                        jclass clazz,
+                                                        jlong native_ptr) {
+  if (native_ptr == 0) {
+    LOG_W("Invalid input for lastRevisedKeys");
+    return nullptr;
+  }
+
+  exposure::MatchingHelper *wrapper =
+      reinterpret_cast<exposure::MatchingHelper *>(native_ptr);
+  return wrapper->LastRevisedKeys(env);
+}
+
+JNIEXPORT jbooleanArray JNICALL JND(verifyKeyFilesNative)(
+    JNIEnv *env, jclass clazz, jobjectArray key_files_jstring,
+    jintArray check_counts, jobjectArray public_keys,
+    jintArray digest_algorithms, jobjectArray signatures,
+    jobjectArray metadata_out, jbyteArray key_files_hash_out,
+    jint thread_count) {
+  if (key_files_jstring == nullptr || check_counts == nullptr ||
+      public_keys == nullptr || digest_algorithms == nullptr ||
+      signatures == nullptr || metadata_out == nullptr) {
+    LOG_W("Invalid input for verifyKeyFilesNative");
+    return nullptr;
+  }
+  const int key_file_count = env->GetArrayLength(key_files_jstring);
+  const int check_count = env->GetArrayLength(public_keys);
+  if (env->GetArrayLength(check_counts) != key_file_count ||
+      env->GetArrayLength(metadata_out) != key_file_count ||
+      env->GetArrayLength(digest_algorithms) != check_count ||
+      env->GetArrayLength(signatures) != check_count ||
+      (key_files_hash_out != nullptr &&
+       env->GetArrayLength(key_files_hash_out) != SHA256_DIGEST_LENGTH)) {
+    LOG_W("Mismatched input for verifyKeyFilesNative");
+    return nullptr;
+  }
+  std::vector<jint> file_check_counts(key_file_count);
+  env->GetIntArrayRegion(check_counts, 0, key_file_count, file_check_counts.data());
+  std::vector<jint> digests(check_count);
+  env->GetIntArrayRegion(digest_algorithms, 0, check_count, digests.data());
+
+  std::vector<exposure::KeyFileVerification> files(key_file_count);
+  int check_index = 0;
+  for (int i = 0; i < key_file_count; i++) {
+    if (file_check_counts[i] < 0 ||
+        file_check_counts[i] > check_count - check_index) {
+      LOG_W("Mismatched input for verifyKeyFilesNative");
+      return nullptr;
+    }
+    jstring key_file_jstring =
+        (jstring) (env->GetObjectArrayElement(key_files_jstring, i));
+    const char *key_file_string = env->GetStringUTFChars(key_file_jstring, 0);
+    files[i].key_file = std::string(key_file_string);
+    env->ReleaseStringUTFChars(key_file_jstring, key_file_string);
+    env->DeleteLocalRef(key_file_jstring);
+
+    files[i].checks.resize(file_check_counts[i]);
+    for (exposure::SignatureCheck &check : files[i].checks) {
+      check.public_key = GetByteArrayElement(env, public_keys, check_index);
+      check.digest_algorithm = digests[check_index];
+      check.signature = GetByteArrayElement(env, signatures, check_index);
+      check_index++;
+    }
+  }
+  if (check_index != check_count) {
+    LOG_W("Mismatched input for verifyKeyFilesNative");
+    return nullptr;
+  }
+
+  uint8_t key_files_hash[SHA256_DIGEST_LENGTH];
+  if (!exposure::VerifyKeyFiles(
+          &files, thread_count,
+          key_files_hash_out != nullptr ? key_files_hash : nullptr)) {
+    return nullptr;
+  }
+
+  std::vector<jboolean> check_results;
+  check_results.reserve(check_count);
+  for (int i = 0; i < key_file_count; i++) {
+    for (bool result : files[i].results) {
+      check_results.push_back(result ? JNI_TRUE : JNI_FALSE);
+    }
+    const std::vector<uint8_t> &metadata = files[i].metadata;
+    jbyteArray metadata_array =
+        env->NewByteArray(static_cast<jsize>(metadata.size()));
+    env->SetByteArrayRegion(metadata_array, 0,
+                            static_cast<jsize>(metadata.size()),
+                            reinterpret_cast<const jbyte *>(metadata.data()));
+    env->SetObjectArrayElement(metadata_out, i, metadata_array);
+    env->DeleteLocalRef(metadata_array);
+  }
+  if (key_files_hash_out != nullptr) {
+    env->SetByteArrayRegion(key_files_hash_out, 0, SHA256_DIGEST_LENGTH,
+                            reinterpret_cast<const jbyte *>(key_files_hash));
+  }
+  jbooleanArray result = env->NewBooleanArray(check_count);
+  env->SetBooleanArrayRegion(result, 0, check_count, check_results.data());
+  return result;
+}
+
 JNIEXPORT void JNICALL JND(releaseNative)(JNIEnv *env, jclass clazz,
                                           jlong native_ptr) {
   if (native_ptr == 0) {
@@ -16,70 +16,689 @@
 
 #include "prefix_id_map.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <jni.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
 
 #include <algorithm>
+#include <cstddef>
+#include <limits>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 namespace exposure {
 
     namespace {
-        uint16_t GetPrefixInner(const uint8_t *id) {
-          uint16_t ret;
-          memcpy(&ret, id, sizeof(ret));
-          return ret;
+        uint32_t GetPrefixInner(const uint8_t *id, int prefix_bits) {
+          uint32_t leading_bytes = (static_cast<uint32_t>(id[0]) << 16) |
+                                   (static_cast<uint32_t>(id[1]) << 8) | id[2];
+          return leading_bytes >> (kMaxIdPrefixBits - prefix_bits);
         }
 
-        bool Compare(const std::string &lhs, const std::string &rhs) {
-          assert(lhs.size() >= 2);
-          assert(rhs.size() >= 2);
-          return GetPrefixInner(reinterpret_cast<const uint8_t *>(lhs.data())) <
-                 GetPrefixInner(reinterpret_cast<const uint8_t *>(rhs.data()));
+        // The widest prefix with no more buckets than records in a partition,
+        // above kMinIdPrefixBits.
+        int ChoosePrefixBits(int record_count) {
+          int prefix_bits = kMinIdPrefixBits;
+          while (prefix_bits < kMaxIdPrefixBits && (2 << prefix_bits) <= record_count) {
+            prefix_bits++;
+          }
+          return prefix_bits;
         }
-    }  // namespace
 
-    PrefixIdMap::PrefixIdMap(JNIEnv *env, jobjectArray ble_scan_records) {
-      memset(prefix_end_index, 0, sizeof(int) * kIdPrefixIndexSize);
-      scan_record_size = env->GetArrayLength(ble_scan_records);
+        // Layout of an index file: this header, then the prefix directory, the
+        // records, their scan record indexes, the filter fingerprints, the
+        // record fingerprints of compact mode and the record times of a
+        // partitioned map, each starting at a multiple of kIndexFileAlignment.
+        // Integers are stored in the byte order of the writer, which
+        // byte_order_mark lets the reader check. header_checksum is the CRC-32
+        // of the header bytes before it, so that a damaged header is rejected
+        // before any of its offsets or sizes is used.
+        constexpr char kIndexFileMagic[8] = {'E', 'N', 'I', 'D', 'M', 'A', 'P', '\0'};
+        constexpr uint32_t kIndexFileVersion = 6;
+        constexpr uint32_t kIndexFileByteOrderMark = 0x01020304;
+        constexpr uint64_t kIndexFileAlignment = 64;
 
-      for (int i = 0; i < scan_record_size; i++) {
+        struct IndexFileHeader {
+            char magic[8];
+            uint32_t version;
+            uint32_t header_size;
+            uint32_t byte_order_mark;
+            uint32_t record_count;
+            int64_t generation;
+            uint64_t file_size;
+            uint64_t prefix_offset;
+            uint64_t records_offset;
+            uint64_t indexes_offset;
+            uint64_t filter_offset;
+            uint64_t fingerprints_offset;
+            uint64_t times_offset;
+            uint64_t filter_seed;
+            uint32_t filter_segment_length;
+            uint32_t filter_segment_count_length;
+            uint32_t filter_array_length;
+            uint32_t prefix_bits;
+            int32_t first_day;
+            uint32_t partition_days;
+            uint32_t partition_count;
+            uint32_t header_checksum;
+        };
+        static_assert(offsetof(IndexFileHeader, header_checksum) + sizeof(uint32_t) ==
+                      sizeof(IndexFileHeader), "Checksum must end the header");
+        static_assert(sizeof(int) == sizeof(int32_t), "Index file stores int arrays");
+
+        // Day numbers of ScanRecordTime, and so the days a partitioned index can
+        // cover, are [0, kDayNumberCount).
+        constexpr int64_t kDayNumberCount =
+            static_cast<int64_t>(std::numeric_limits<uint16_t>::max()) + 1;
+
+        uint32_t IndexFileHeaderChecksum(const IndexFileHeader &header) {
+          return static_cast<uint32_t>(
+              crc32(crc32(0L, Z_NULL, 0), reinterpret_cast<const Bytef *>(&header),
+                    static_cast<uInt>(offsetof(IndexFileHeader, header_checksum))));
+        }
+
+        uint64_t AlignIndexFileOffset(uint64_t offset) {
+          return (offset + kIndexFileAlignment - 1) & ~(kIndexFileAlignment - 1);
+        }
+
+        bool WriteFully(int fd, const void *data, size_t size) {
+          const uint8_t *bytes = static_cast<const uint8_t *>(data);
+          while (size > 0) {
+            ssize_t written = write(fd, bytes, size);
+            if (written < 0) {
+              if (errno == EINTR) {
+                continue;
+              }
+              return false;
+            }
+            bytes += written;
+            size -= written;
+          }
+          return true;
+        }
+
+        // Writes section at offset, zero filling the gap from the current
+        // position.
+        bool WriteSection(int fd, uint64_t *position, uint64_t offset,
+                          const void *data, size_t size) {
+          static const uint8_t kZeros[kIndexFileAlignment] = {};
+          if (!WriteFully(fd, kZeros, offset - *position) ||
+              !WriteFully(fd, data, size)) {
+            return false;
+          }
+          *position = offset + size;
+          return true;
+        }
+
+        // Number of IDs whose lookup stages ProbeBatch interleaves.
+        constexpr size_t kProbeChunkSize = 64;
+
+        // Compares a stored record with a possibly unaligned ID in one vector
+        // compare where the target has one.
+        inline bool IdEquals(const ScanIdRecord &record, const uint8_t *id) {
+#if defined(__SSE2__)
+          __m128i equal = _mm_cmpeq_epi8(
+              _mm_load_si128(reinterpret_cast<const __m128i *>(&record)),
+              _mm_loadu_si128(reinterpret_cast<const __m128i *>(id)));
+          return _mm_movemask_epi8(equal) == 0xffff;
+#elif defined(__ARM_NEON)
+          uint8x16_t equal = vceqq_u8(vld1q_u8(reinterpret_cast<const uint8_t *>(&record)),
+                                      vld1q_u8(id));
+#if defined(__aarch64__)
+          return vminvq_u8(equal) == 0xff;
+#else
+          uint8x8_t folded = vand_u8(vget_low_u8(equal), vget_high_u8(equal));
+          return vget_lane_u64(vreinterpret_u64_u8(folded), 0) == ~UINT64_C(0);
+#endif
+#else
+          ScanIdRecord key;
+          memcpy(&key, id, sizeof(key));
+          return record.hi == key.hi && record.lo == key.lo;
+#endif
+        }
+
+        // The record fingerprint of an ID. The prefix is taken from the leading
+        // bytes, so the trailing ones are independent of the bucket.
+        inline uint64_t IdFingerprint(const uint8_t *id) {
+          uint64_t fingerprint;
+          memcpy(&fingerprint, id + sizeof(uint64_t), sizeof(fingerprint));
+          return fingerprint;
+        }
+    }  // namespace
+
+    PrefixIdMap::PrefixIdMap(JNIEnv *env, jobjectArray ble_scan_records,
+                             bool use_id_filter)
+        : PrefixIdMap() {
+      int record_count = env->GetArrayLength(ble_scan_records);
+      // Copy every record into one flat buffer first; short records are zero
+      // padded so that a probe never reads past the end of a record.
+      std::vector<uint8_t> unsorted_records(
+          static_cast<size_t>(record_count) * kIdLength, 0);
+      int short_record_count = 0;
+      for (int i = 0; i < record_count; i++) {
         jbyteArray single_id =
             (jbyteArray) env->GetObjectArrayElement(ble_scan_records, i);
-        jbyte *id_bytes = env->GetByteArrayElements(single_id, 0);
-        scan_records.push_back(std::string((char *) id_bytes, env->GetArrayLength(single_id)));
-        env->ReleaseByteArrayElements(single_id, id_bytes, 0);
+        jsize length = std::min<jsize>(env->GetArrayLength(single_id), kIdLength);
+        env->GetByteArrayRegion(
+            single_id, 0, length,
+            reinterpret_cast<jbyte *>(&unsorted_records[i * kIdLength]));
+        if (length < kIdLength) {
+          short_record_count++;
+        }
         env->DeleteLocalRef(single_id);
       }
-      std::sort(scan_records.begin(), scan_records.end(), Compare);
-      int last_prefix = 0;
+      if (short_record_count > 0) {
+        LOG_W("PrefixIdMap got %d scan records shorter than %d bytes",
+              short_record_count, kIdLength);
+      }
+      Init(unsorted_records.data(), nullptr, record_count, use_id_filter);
+    }
+
+    PrefixIdMap::PrefixIdMap(const uint8_t *packed_ids, int id_count,
+                             bool use_id_filter)
+        : PrefixIdMap() {
+      Init(packed_ids, nullptr, id_count, use_id_filter);
+    }
+
+    PrefixIdMap::PrefixIdMap(const uint8_t *packed_ids, const ScanRecordTime *times,
+                             int id_count, bool use_id_filter)
+        : PrefixIdMap() {
+      Init(packed_ids, times, id_count, use_id_filter);
+    }
+
+    PrefixIdMap::PrefixIdMap()
+        : prefix_end_index(nullptr),
+          prefix_bits(kMinIdPrefixBits),
+          first_day(0),
+          partition_days(0),
+          partition_count(1),
+          scan_records(nullptr),
+          scan_record_indexes(nullptr),
+          scan_record_size(0),
+          record_fingerprints(nullptr),
+          scan_record_times(nullptr),
+          owned_scan_records(nullptr),
+          mapped_file(nullptr),
+          mapped_file_size(0),
+          fingerprint_hits(0),
+          fingerprint_false_hits(0) {}
+
+    void PrefixIdMap::Init(const uint8_t *unsorted_records, const ScanRecordTime *times,
+                           int record_count, bool use_id_filter) {
+      scan_record_size = record_count;
+      void *storage = nullptr;
+      if (scan_record_size > 0 &&
+          posix_memalign(&storage, alignof(ScanIdRecord),
+                         sizeof(ScanIdRecord) * scan_record_size) != 0) {
+        LOG_E("PrefixIdMap failed to allocate %d scan records", scan_record_size);
+        storage = nullptr;
+        scan_record_size = 0;
+      }
+      owned_scan_records = static_cast<ScanIdRecord *>(storage);
+      owned_scan_record_indexes.resize(scan_record_size);
+
+      if (times != nullptr && scan_record_size > 0) {
+        int min_day = times[0].day_number;
+        int max_day = times[0].day_number;
+        for (int i = 1; i < scan_record_size; i++) {
+          min_day = std::min<int>(min_day, times[i].day_number);
+          max_day = std::max<int>(max_day, times[i].day_number);
+        }
+        const int day_span = max_day - min_day + 1;
+        first_day = min_day;
+        partition_days = (day_span + kMaxDayPartitions - 1) / kMaxDayPartitions;
+        partition_count = (day_span + partition_days - 1) / partition_days;
+        owned_scan_record_times.resize(scan_record_size);
+      }
+
+      // IDs are uniformly distributed, so a counting sort on the directory
+      // entry builds the directory and the sorted records in two linear passes:
+      // count every entry, turn the counts into bucket ends, then scatter each
+      // record into its bucket. The scatter is stable, so equal records keep
+      // the order of their scan record indexes.
+      prefix_bits = ChoosePrefixBits(scan_record_size / partition_count);
+      const int entry_count = partition_count << prefix_bits;
+      auto entry_of = [this, unsorted_records, times](int i) {
+        int entry = static_cast<int>(GetPrefix(&unsorted_records[i * kIdLength])) *
+                    partition_count;
+        return times == nullptr ? entry : entry + GetPartition(times[i].day_number);
+      };
+      owned_prefix_end_index.assign(entry_count, 0);
       for (int i = 0; i < scan_record_size; i++) {
-        int prefix =
-            GetPrefix(reinterpret_cast<const uint8_t *>(scan_records[i].data()));
-        while (last_prefix < prefix) {
-          prefix_end_index[last_prefix++] = i;
+        owned_prefix_end_index[entry_of(i)]++;
+      }
+      std::vector<int> next_position(entry_count);
+      int end_index = 0;
+      for (int entry = 0; entry < entry_count; entry++) {
+        next_position[entry] = end_index;
+        end_index += owned_prefix_end_index[entry];
+        owned_prefix_end_index[entry] = end_index;
+      }
+      for (int i = 0; i < scan_record_size; i++) {
+        int position = next_position[entry_of(i)]++;
+        memcpy(&owned_scan_records[position], &unsorted_records[i * kIdLength], kIdLength);
+        owned_scan_record_indexes[position] = i;
+        if (!owned_scan_record_times.empty()) {
+          owned_scan_record_times[position] = times[i];
         }
       }
-      while (last_prefix < kIdPrefixIndexSize) {
-        prefix_end_index[last_prefix++] = scan_record_size;
+      scan_records = owned_scan_records;
+      scan_record_indexes = owned_scan_record_indexes.data();
+      scan_record_times =
+          owned_scan_record_times.empty() ? nullptr : owned_scan_record_times.data();
+      prefix_end_index = owned_prefix_end_index.data();
+      if (use_id_filter && scan_record_size > 0) {
+        id_filter.Build(reinterpret_cast<const uint8_t *>(scan_records),
+                        scan_record_size, sizeof(ScanIdRecord));
+      }
+    }
+
+    PrefixIdMap::~PrefixIdMap() {
+      if (record_fingerprints != nullptr) {
+        LOG_I("PrefixIdMap compact lookups had %u fingerprint hits, %u false",
+              fingerprint_hits.load(), fingerprint_false_hits.load());
+      }
+      free(owned_scan_records);
+      if (mapped_file != nullptr) {
+        munmap(mapped_file, mapped_file_size);
       }
-      LOG_I("PrefixIdMap load %d scan records", scan_record_size);
     }
 
-    PrefixIdMap::~PrefixIdMap() { scan_records.clear(); }
+    std::unique_ptr<PrefixIdMap> PrefixIdMap::OpenFile(const std::string &path,
+                                                       int64_t generation,
+                                                       bool compact) {
+      int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0) {
+        LOG_I("PrefixIdMap has no index file at %s", path.c_str());
+        return nullptr;
+      }
+      struct stat file_stat;
+      void *mapped = MAP_FAILED;
+      size_t file_size = 0;
+      if (fstat(fd, &file_stat) == 0 &&
+          static_cast<uint64_t>(file_stat.st_size) >= sizeof(IndexFileHeader)) {
+        file_size = static_cast<size_t>(file_stat.st_size);
+        mapped = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+      }
+      close(fd);
+      if (mapped == MAP_FAILED) {
+        LOG_W("PrefixIdMap failed to map index file %s", path.c_str());
+        return nullptr;
+      }
 
-    int PrefixIdMap::GetIdIndex(const uint8_t *id) {
-      int prefix = GetPrefix(id);
-      int start_index = (prefix > 0) ? prefix_end_index[prefix - 1] : 0;
-      int end_index = prefix_end_index[prefix];
+      std::unique_ptr<PrefixIdMap> map(new PrefixIdMap());
+      map->mapped_file = mapped;
+      map->mapped_file_size = file_size;
+
+      const uint8_t *base = static_cast<const uint8_t *>(mapped);
+      IndexFileHeader header;
+      memcpy(&header, base, sizeof(header));
+      if (memcmp(header.magic, kIndexFileMagic, sizeof(kIndexFileMagic)) != 0 ||
+          header.version != kIndexFileVersion ||
+          header.header_size != sizeof(IndexFileHeader) ||
+          header.byte_order_mark != kIndexFileByteOrderMark ||
+          header.header_checksum != IndexFileHeaderChecksum(header) ||
+          header.file_size != file_size) {
+        LOG_W("PrefixIdMap ignores malformed index file %s", path.c_str());
+        return nullptr;
+      }
+      if (header.generation != generation) {
+        LOG_I("PrefixIdMap ignores index file of generation %lld, want %lld",
+              static_cast<long long>(header.generation),
+              static_cast<long long>(generation));
+        return nullptr;
+      }
+      const uint64_t record_count = header.record_count;
+      if (header.prefix_bits < kMinIdPrefixBits || header.prefix_bits > kMaxIdPrefixBits) {
+        LOG_W("PrefixIdMap ignores index file %s with %u prefix bits", path.c_str(),
+              header.prefix_bits);
+        return nullptr;
+      }
+      // Lookups compute partitions as (day_number - first_day) / partition_days,
+      // so the partitions must start at days ScanRecordTime can hold: within
+      // [first_day, kDayNumberCount) and each at least one day long.
+      const bool partitioned = header.partition_days > 0;
+      const int64_t day_span = kDayNumberCount - header.first_day;
+      if (header.first_day < 0 || day_span <= 0 ||
+          header.partition_count < 1 || header.partition_count > kMaxDayPartitions ||
+          (!partitioned && (header.partition_count != 1 || header.first_day != 0)) ||
+          (partitioned && (header.partition_days > day_span ||
+                           static_cast<int64_t>(header.partition_count - 1) *
+                               header.partition_days >= day_span))) {
+        LOG_W("PrefixIdMap ignores index file %s with %u day partitions of %u days from day %d",
+              path.c_str(), header.partition_count, header.partition_days, header.first_day);
+        return nullptr;
+      }
+      const int entry_count = static_cast<int>(header.partition_count) << header.prefix_bits;
+      // The directory must span exactly the records offset, so that a partition
+      // count other than the writer's is rejected even if the file is large
+      // enough for it.
+      if (header.records_offset !=
+          AlignIndexFileOffset(header.prefix_offset + sizeof(int) * entry_count)) {
+        LOG_W("PrefixIdMap ignores index file %s whose directory is not %d entries",
+              path.c_str(), entry_count);
+        return nullptr;
+      }
+      auto section_fits = [&header](uint64_t offset, uint64_t size) {
+        return offset % kIndexFileAlignment == 0 && offset >= sizeof(IndexFileHeader) &&
+               offset <= header.file_size && size <= header.file_size - offset;
+      };
+      if (record_count > static_cast<uint64_t>(std::numeric_limits<int>::max()) ||
+          !section_fits(header.prefix_offset, sizeof(int) * entry_count) ||
+          !section_fits(header.records_offset, sizeof(ScanIdRecord) * record_count) ||
+          !section_fits(header.indexes_offset, sizeof(int) * record_count) ||
+          !section_fits(header.filter_offset, header.filter_array_length) ||
+          !section_fits(header.fingerprints_offset, sizeof(uint64_t) * record_count) ||
+          !section_fits(header.times_offset,
+                        partitioned ? sizeof(ScanRecordTime) * record_count : 0)) {
+        LOG_W("PrefixIdMap ignores truncated index file %s", path.c_str());
+        return nullptr;
+      }
+
+      map->prefix_end_index = reinterpret_cast<const int *>(base + header.prefix_offset);
+      map->prefix_bits = static_cast<int>(header.prefix_bits);
+      map->first_day = header.first_day;
+      map->partition_days = static_cast<int>(header.partition_days);
+      map->partition_count = static_cast<int>(header.partition_count);
+      if (partitioned) {
+        map->scan_record_times =
+            reinterpret_cast<const ScanRecordTime *>(base + header.times_offset);
+      }
+      map->scan_records =
+          reinterpret_cast<const ScanIdRecord *>(base + header.records_offset);
+      map->scan_record_indexes = reinterpret_cast<const int *>(base + header.indexes_offset);
+      map->scan_record_size = static_cast<int>(record_count);
+      // A corrupt directory would send lookups out of bounds, so check it once.
+      int last_end_index = 0;
+      for (int i = 0; i < entry_count; i++) {
+        if (map->prefix_end_index[i] < last_end_index) {
+          last_end_index = -1;
+          break;
+        }
+        last_end_index = map->prefix_end_index[i];
+      }
+      if (last_end_index != map->scan_record_size) {
+        LOG_W("PrefixIdMap ignores index file %s with a corrupt directory",
+              path.c_str());
+        return nullptr;
+      }
+      if (header.filter_array_length > 0) {
+        IdFilterParams params = {header.filter_seed, header.filter_segment_length,
+                                 header.filter_segment_count_length,
+                                 header.filter_array_length};
+        if (!map->id_filter.Attach(params, base + header.filter_offset)) {
+          LOG_W("PrefixIdMap ignores the id filter of index file %s", path.c_str());
+        }
+      }
+      if (compact) {
+        map->record_fingerprints =
+            reinterpret_cast<const uint64_t *>(base + header.fingerprints_offset);
+        // Records are only read to confirm fingerprint hits, so keep the
+        // kernel from reading ahead around them.
+        const uintptr_t page_size = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+        const uintptr_t records_begin =
+            reinterpret_cast<uintptr_t>(map->scan_records) & ~(page_size - 1);
+        const uintptr_t records_end = reinterpret_cast<uintptr_t>(
+            map->scan_records + map->scan_record_size);
+        if (records_end > records_begin) {
+          madvise(reinterpret_cast<void *>(records_begin), records_end - records_begin,
+                  MADV_RANDOM);
+        }
+      }
+      LOG_I("PrefixIdMap mapped %d scan records from %s, id filter %s, %s",
+            map->scan_record_size, path.c_str(),
+            map->id_filter.IsEmpty() ? "off" : "on", compact ? "compact" : "full");
+      return map;
+    }
+
+    bool PrefixIdMap::WriteFile(const std::string &path, int64_t generation) const {
+      const IdFilterParams &filter_params = id_filter.Params();
+      const uint64_t record_count = static_cast<uint64_t>(scan_record_size);
+      IndexFileHeader header;
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, kIndexFileMagic, sizeof(kIndexFileMagic));
+      header.version = kIndexFileVersion;
+      header.header_size = sizeof(IndexFileHeader);
+      header.byte_order_mark = kIndexFileByteOrderMark;
+      header.record_count = static_cast<uint32_t>(record_count);
+      header.generation = generation;
+      const uint64_t entry_count = static_cast<uint64_t>(partition_count) << prefix_bits;
+      const uint64_t times_size =
+          scan_record_times != nullptr ? sizeof(ScanRecordTime) * record_count : 0;
+      header.prefix_bits = static_cast<uint32_t>(prefix_bits);
+      header.first_day = first_day;
+      header.partition_days = static_cast<uint32_t>(partition_days);
+      header.partition_count = static_cast<uint32_t>(partition_count);
+      header.prefix_offset = AlignIndexFileOffset(sizeof(IndexFileHeader));
+      header.records_offset =
+          AlignIndexFileOffset(header.prefix_offset + sizeof(int) * entry_count);
+      header.indexes_offset =
+          AlignIndexFileOffset(header.records_offset + sizeof(ScanIdRecord) * record_count);
+      header.filter_offset =
+          AlignIndexFileOffset(header.indexes_offset + sizeof(int) * record_count);
+      header.fingerprints_offset =
+          AlignIndexFileOffset(header.filter_offset + filter_params.array_length);
+      header.times_offset =
+          AlignIndexFileOffset(header.fingerprints_offset + sizeof(uint64_t) * record_count);
+      header.file_size = header.times_offset + times_size;
+      header.filter_seed = filter_params.seed;
+      header.filter_segment_length = filter_params.segment_length;
+      header.filter_segment_count_length = filter_params.segment_count_length;
+      header.filter_array_length = filter_params.array_length;
+      header.header_checksum = IndexFileHeaderChecksum(header);
+
+      std::vector<uint64_t> fingerprints(scan_record_size);
+      for (int i = 0; i < scan_record_size; i++) {
+        fingerprints[i] = IdFingerprint(reinterpret_cast<const uint8_t *>(&scan_records[i]));
+      }
+
+      // Write a private temporary file and rename it over path, so that a
+      // concurrent OpenFile never maps a partially written index.
+      std::string temp_path = path + ".XXXXXX";
+      int fd = mkstemp(&temp_path[0]);
+      if (fd < 0) {
+        LOG_E("PrefixIdMap failed to create index file for %s", path.c_str());
+        return false;
+      }
+      uint64_t position = 0;
+      bool written =
+          WriteSection(fd, &position, 0, &header, sizeof(header)) &&
+          WriteSection(fd, &position, header.prefix_offset, prefix_end_index,
+                       sizeof(int) * entry_count) &&
+          WriteSection(fd, &position, header.records_offset, scan_records,
+                       sizeof(ScanIdRecord) * record_count) &&
+          WriteSection(fd, &position, header.indexes_offset, scan_record_indexes,
+                       sizeof(int) * record_count) &&
+          WriteSection(fd, &position, header.filter_offset, id_filter.Fingerprints(),
+                       filter_params.array_length) &&
+          WriteSection(fd, &position, header.fingerprints_offset, fingerprints.data(),
+                       sizeof(uint64_t) * record_count) &&
+          WriteSection(fd, &position, header.times_offset, scan_record_times, times_size) &&
+          fsync(fd) == 0;
+      written = close(fd) == 0 && written;
+      if (!written || rename(temp_path.c_str(), path.c_str()) != 0) {
+        LOG_E("PrefixIdMap failed to write index file %s", path.c_str());
+        unlink(temp_path.c_str());
+        return false;
+      }
+      LOG_I("PrefixIdMap wrote %d scan records to %s", scan_record_size, path.c_str());
+      return true;
+    }
+
+    int PrefixIdMap::GetPartition(int day_number) const {
+      return (day_number - first_day) / partition_days;
+    }
+
+    bool PrefixIdMap::GetPartitionRange(const IntervalRange &intervals, int *first_partition,
+                                        int *last_partition) const {
+      if (partition_days == 0) {
+        *first_partition = 0;
+        *last_partition = 0;
+        return true;
+      }
+      if (intervals.last_interval < 0) {
+        return false;
+      }
+      const int64_t first = std::max<int64_t>(
+          std::max(intervals.first_interval, 0) / kIntervalsPerDay, first_day);
+      const int64_t last = std::min<int64_t>(
+          intervals.last_interval / kIntervalsPerDay,
+          static_cast<int64_t>(first_day) + partition_count * partition_days - 1);
+      if (first > last) {
+        return false;
+      }
+      *first_partition = GetPartition(static_cast<int>(first));
+      *last_partition = GetPartition(static_cast<int>(last));
+      return true;
+    }
+
+    void PrefixIdMap::GetBucket(uint32_t prefix, int first_partition, int last_partition,
+                                int *start_index, int *end_index) const {
+      const int first_entry = static_cast<int>(prefix) * partition_count + first_partition;
+      *start_index = (first_entry > 0) ? prefix_end_index[first_entry - 1] : 0;
+      *end_index = prefix_end_index[first_entry + last_partition - first_partition];
+    }
+
+    int PrefixIdMap::GetIdIndex(const uint8_t *id, const IntervalRange &intervals) const {
+      int first_partition, last_partition;
+      if (!GetPartitionRange(intervals, &first_partition, &last_partition) ||
+          (!id_filter.IsEmpty() && !id_filter.MayContain(id))) {
+        return -1;
+      }
+      int start_index, end_index;
+      GetBucket(GetPrefix(id), first_partition, last_partition, &start_index, &end_index);
       for (; start_index < end_index; start_index++) {
-        if (memcmp(id, scan_records[start_index].data(), exposure::kIdLength) ==
-            0) {
+        if (RecordEquals(start_index, id, intervals)) {
           return start_index;
         }
       }
       return -1;
     }
 
-    uint16_t PrefixIdMap::GetPrefix(const uint8_t *id) {
-      return GetPrefixInner(id);
+    bool PrefixIdMap::GetScanRecordIndexes(const uint8_t *id, std::vector<int> *indexes,
+                                           const IntervalRange &intervals) const {
+      int first_partition, last_partition;
+      if (!GetPartitionRange(intervals, &first_partition, &last_partition) ||
+          (!id_filter.IsEmpty() && !id_filter.MayContain(id))) {
+        return false;
+      }
+      int start_index, end_index;
+      GetBucket(GetPrefix(id), first_partition, last_partition, &start_index, &end_index);
+      bool found = false;
+      for (; start_index < end_index; start_index++) {
+        if (RecordEquals(start_index, id, intervals)) {
+          indexes->push_back(scan_record_indexes[start_index]);
+          found = true;
+        }
+      }
+      return found;
+    }
+
+    int PrefixIdMap::ProbeBatch(const uint8_t *ids, size_t n, int32_t *out_indices,
+                                const IntervalRange &intervals) const {
+      int first_partition, last_partition;
+      if (!GetPartitionRange(intervals, &first_partition, &last_partition)) {
+        std::fill(out_indices, out_indices + n, -1);
+        return 0;
+      }
+      int found_count = 0;
+      uint64_t hashes[kProbeChunkSize];
+      uint32_t candidates[kProbeChunkSize];
+      int start_indexes[kProbeChunkSize];
+      int end_indexes[kProbeChunkSize];
+      for (size_t base = 0; base < n; base += kProbeChunkSize) {
+        const size_t count = std::min(kProbeChunkSize, n - base);
+        const uint8_t *chunk = ids + base * kIdLength;
+        int32_t *out = out_indices + base;
+
+        // Stage 1: the filter drops almost every ID before the directory is read.
+        size_t candidate_count = 0;
+        if (id_filter.IsEmpty()) {
+          for (size_t i = 0; i < count; i++) {
+            out[i] = -1;
+            candidates[candidate_count++] = i;
+          }
+        } else {
+          for (size_t i = 0; i < count; i++) {
+            hashes[i] = id_filter.HashOf(chunk + i * kIdLength);
+            id_filter.Prefetch(hashes[i]);
+          }
+          for (size_t i = 0; i < count; i++) {
+            out[i] = -1;
+            candidates[candidate_count] = i;
+            candidate_count += id_filter.MayContainHash(hashes[i]) ? 1 : 0;
+          }
+        }
+
+        // Stage 2: the directory entries bounding each candidate's bucket.
+        for (size_t c = 0; c < candidate_count; c++) {
+          int first_entry = GetPrefix(chunk + candidates[c] * kIdLength) * partition_count +
+                            first_partition;
+          __builtin_prefetch(&prefix_end_index[first_entry + last_partition - first_partition]);
+          if (first_entry > 0) {
+            __builtin_prefetch(&prefix_end_index[first_entry - 1]);
+          }
+        }
+
+        // Stage 3: the first record of each non-empty bucket.
+        for (size_t c = 0; c < candidate_count; c++) {
+          GetBucket(GetPrefix(chunk + candidates[c] * kIdLength), first_partition,
+                    last_partition, &start_indexes[c], &end_indexes[c]);
+          if (start_indexes[c] >= end_indexes[c]) {
+            continue;
+          }
+          if (record_fingerprints != nullptr) {
+            __builtin_prefetch(&record_fingerprints[start_indexes[c]]);
+          } else {
+            __builtin_prefetch(&scan_records[start_indexes[c]]);
+          }
+        }
+
+        // Stage 4: resolve.
+        for (size_t c = 0; c < candidate_count; c++) {
+          const uint8_t *id = chunk + candidates[c] * kIdLength;
+          for (int index = start_indexes[c]; index < end_indexes[c]; index++) {
+            if (RecordEquals(index, id, intervals)) {
+              out[candidates[c]] = index;
+              found_count++;
+              break;
+            }
+          }
+        }
+      }
+      return found_count;
+    }
+
+    bool PrefixIdMap::RecordEquals(int index, const uint8_t *id,
+                                   const IntervalRange &intervals) const {
+      if (record_fingerprints == nullptr) {
+        if (!IdEquals(scan_records[index], id)) {
+          return false;
+        }
+      } else {
+        if (record_fingerprints[index] != IdFingerprint(id)) {
+          return false;
+        }
+        fingerprint_hits.fetch_add(1, std::memory_order_relaxed);
+        if (!IdEquals(scan_records[index], id)) {
+          fingerprint_false_hits.fetch_add(1, std::memory_order_relaxed);
+          return false;
+        }
+      }
+      // Only read for the rare match, so the times cost no cache misses on the
+      // common path.
+      return scan_record_times == nullptr || SightedWithin(scan_record_times[index], intervals);
+    }
+
+    uint32_t PrefixIdMap::GetPrefix(const uint8_t *id) const {
+      return GetPrefixInner(id, prefix_bits);
     }
 }  // namespace exposure
@@ -21,30 +21,189 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <memory>
 #include <string>
 #include <vector>
 
 #include "constants.h"
+#include "id_filter.h"
 
 namespace exposure {
-    constexpr static const int kIdPrefixIndexSize = 65536;
+    // Bounds of the number of leading ID bits that select a directory bucket.
+    // The width grows with the record count, keeping one to two records per
+    // bucket, so that the directory takes at most 4 bytes per record.
+    constexpr static const int kMinIdPrefixBits = 8;
+    constexpr static const int kMaxIdPrefixBits = 24;
+    // Upper bound of the number of day partitions; longer spans of days are
+    // grouped into partitions of several days.
+    constexpr static const int kMaxDayPartitions = 32;
+
+    // When a scan ID was sighted: the day number of its contact record, in days
+    // since the epoch, and the first and last interval of that day it was
+    // sighted in.
+    struct ScanRecordTime {
+        uint16_t day_number;
+        uint8_t first_interval;
+        uint8_t last_interval;
+    };
+    static_assert(sizeof(ScanRecordTime) == 4, "ScanRecordTime must be packed");
+
+    // The interval numbers [first_interval, last_interval] that a lookup is
+    // limited to: only scan IDs sighted within them are found.
+    struct IntervalRange {
+        int first_interval;
+        int last_interval;
+    };
+    constexpr static const IntervalRange kAllIntervals = {std::numeric_limits<int>::min(),
+                                                          std::numeric_limits<int>::max()};
+
+    inline bool SightedWithin(const ScanRecordTime &time, const IntervalRange &intervals) {
+      const int64_t day_start = static_cast<int64_t>(time.day_number) * kIntervalsPerDay;
+      return day_start + time.first_interval <= intervals.last_interval &&
+             day_start + time.last_interval >= intervals.first_interval;
+    }
+
+    // One scan ID, split into two native words so that a probe is two integer
+    // compares. hi holds bytes [0, 8) and lo bytes [8, 16) in memory order.
+    struct alignas(16) ScanIdRecord {
+        uint64_t hi;
+        uint64_t lo;
+    };
+    static_assert(sizeof(ScanIdRecord) == kIdLength, "ScanIdRecord must be one ID");
 
     class PrefixIdMap {
     public:
-        int prefix_end_index[exposure::kIdPrefixIndexSize];
-        std::vector<std::string> scan_records;
+        // Records are sorted by prefix, then by day partition, and the records of
+        // entry e = p * partition_count + partition are
+        // [prefix_end_index[e - 1], prefix_end_index[e]). The directory has
+        // partition_count << prefix_bits 32-bit entries, so the records of one
+        // prefix over a range of days are contiguous.
+        const int *prefix_end_index;
+        int prefix_bits;
+        // Partition i holds the IDs sighted on days [first_day + i *
+        // partition_days, first_day + (i + 1) * partition_days). A map built
+        // without days has a single partition and partition_days 0.
+        int first_day;
+        int partition_days;
+        int partition_count;
+        // All scan IDs, in directory order, in a single 16-byte aligned array of
+        // scan_record_size records.
+        const ScanIdRecord *scan_records;
+        // The position in ble_scan_records, or packed_ids, of each entry of
+        // scan_records.
+        const int *scan_record_indexes;
         int scan_record_size;
+        // In compact mode, bytes [8, 16) of each entry of scan_records, so that
+        // lookups compare 8 bytes per candidate and only read the full record,
+        // which stays in the mapped file until then, to confirm a match.
+        // Otherwise null.
+        const uint64_t *record_fingerprints;
+        // The sighting time of each entry of scan_records, or null if the map was
+        // built without times.
+        const ScanRecordTime *scan_record_times;
+        // Checked before the prefix table on every lookup, unless it is empty.
+        IdFilter id_filter;
 
         // scanRecordIds is a byte[][], which contains all scanned ID from database.
         // Due to we'll only try to copy its value to scan_records, so it's not
         // owned by PrefixIdMap after construction.
-        PrefixIdMap(JNIEnv *env, jobjectArray ble_scan_records);
+        // use_id_filter builds id_filter so that lookups of absent IDs, almost all
+        // of them during matching, rarely reach the prefix table.
+        PrefixIdMap(JNIEnv *env, jobjectArray ble_scan_records,
+                    bool use_id_filter = true);
+
+        // Builds the map straight from id_count IDs packed back to back, id_count *
+        // kIdLength bytes in all, without any per-ID JNI call. Scan record indexes
+        // are positions in packed_ids. packed_ids is not used after construction.
+        PrefixIdMap(const uint8_t *packed_ids, int id_count,
+                    bool use_id_filter = true);
+
+        // Same as above with the time each ID was sighted at. The map is
+        // partitioned by day, so that lookups limited to a few intervals skip the
+        // IDs of other days, and IDs not sighted within those intervals are not
+        // found.
+        PrefixIdMap(const uint8_t *packed_ids, const ScanRecordTime *times, int id_count,
+                    bool use_id_filter = true);
 
         ~PrefixIdMap();
 
-        int GetIdIndex(const uint8_t *id);
+        PrefixIdMap(const PrefixIdMap &) = delete;
+        PrefixIdMap &operator=(const PrefixIdMap &) = delete;
+
+        // Maps an index file written by WriteFile and uses it in place, so that
+        // nothing is copied or sorted and concurrent users share the page cache.
+        // Returns null if the file is missing, malformed, or was written for a
+        // generation of the scan store other than generation.
+        // compact keeps only the directory and record_fingerprints hot: the full
+        // records are paged in on fingerprint hits, about halving the resident
+        // index for stores with many sightings.
+        static std::unique_ptr<PrefixIdMap> OpenFile(const std::string &path,
+                                                     int64_t generation,
+                                                     bool compact = false);
+
+        // Persists the map, tagged with the scan store generation it was built
+        // from, for OpenFile. The file is replaced atomically, so readers see
+        // either the old or the new index.
+        bool WriteFile(const std::string &path, int64_t generation) const;
+
+        // Lookups only see the records sighted within intervals, and only read
+        // the directory entries of the partitions overlapping them.
+        int GetIdIndex(const uint8_t *id, const IntervalRange &intervals = kAllIntervals) const;
+
+        // Appends the position in ble_scan_records of every scan record equal to
+        // id to indexes. Returns true if there was at least one.
+        bool GetScanRecordIndexes(const uint8_t *id, std::vector<int> *indexes,
+                                  const IntervalRange &intervals = kAllIntervals) const;
+
+        // Looks up n consecutive IDs of kIdLength bytes and writes the GetIdIndex
+        // result of each to out_indices. The stages of all lookups are run
+        // together, prefetching filter slots, directory entries and buckets
+        // before they are read, so cache misses overlap instead of being paid one
+        // ID at a time. Returns the number of IDs found.
+        int ProbeBatch(const uint8_t *ids, size_t n, int32_t *out_indices,
+                       const IntervalRange &intervals = kAllIntervals) const;
+
+        // Returns the leading prefix_bits bits of id.
+        uint32_t GetPrefix(const uint8_t *id) const;
+
+    private:
+        PrefixIdMap();
+
+        void Init(const uint8_t *unsorted_records, const ScanRecordTime *times,
+                  int record_count, bool use_id_filter);
+
+        // Returns the partition of records sighted on day_number.
+        int GetPartition(int day_number) const;
+
+        // Sets the partitions overlapping intervals. Returns false if there are
+        // none.
+        bool GetPartitionRange(const IntervalRange &intervals, int *first_partition,
+                               int *last_partition) const;
+
+        // Sets [*start_index, *end_index) to the records of prefix in partitions
+        // [first_partition, last_partition].
+        void GetBucket(uint32_t prefix, int first_partition, int last_partition,
+                       int *start_index, int *end_index) const;
+
+        // Whether scan_records[index] is id and was sighted within intervals,
+        // checking record_fingerprints first when there are some.
+        bool RecordEquals(int index, const uint8_t *id, const IntervalRange &intervals) const;
 
-        uint16_t GetPrefix(const uint8_t *id);
+        // Backing storage of the arrays above when the map was built in memory.
+        std::vector<int> owned_prefix_end_index;
+        ScanIdRecord *owned_scan_records;
+        std::vector<int> owned_scan_record_indexes;
+        std::vector<ScanRecordTime> owned_scan_record_times;
+        // Backing storage when the map was opened from an index file.
+        void *mapped_file;
+        size_t mapped_file_size;
+        // Fingerprint hits and those the full record then rejected, for the
+        // log when a compact map is released.
+        mutable std::atomic<uint32_t> fingerprint_hits;
+        mutable std::atomic<uint32_t> fingerprint_false_hits;
     };
 }  // namespace exposure
 #endif  // LOCATION_NEARBY_CPP_EXPOSURENOTIFICATION_JNI_PREFIX_ID_MAP_H_
@@ -0,0 +1,155 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+// Times the PrefixIdMap build over random IDs against the std::sort build it
+// replaced, and batched against single ID lookups. Built with the unit tests
+// but not run by ctest:
+//   prefix_id_map_benchmark [id_count]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "prefix_id_map.h"
+
+namespace exposure {
+    namespace {
+        constexpr int kDefaultIdCount = 1000000;
+        constexpr int kRepetitions = 5;
+
+        template<typename Function>
+        double BestMilliseconds(Function function) {
+          double best = 0;
+          for (int i = 0; i < kRepetitions; i++) {
+            auto start = std::chrono::steady_clock::now();
+            function();
+            std::chrono::duration<double, std::milli> elapsed =
+                std::chrono::steady_clock::now() - start;
+            best = (i == 0) ? elapsed.count() : std::min(best, elapsed.count());
+          }
+          return best;
+        }
+
+        // The build PrefixIdMap used before the counting sort: std::sort an index
+        // permutation by directory entry, then copy the records and fill the
+        // directory in a second pass. Returns the sorted scan record indexes.
+        std::vector<int> SortBuild(const PrefixIdMap &map, const uint8_t *ids, int id_count,
+                                   std::vector<ScanIdRecord> *records,
+                                   std::vector<int> *prefix_end_index) {
+          std::vector<int> order(id_count);
+          for (int i = 0; i < id_count; i++) {
+            order[i] = i;
+          }
+          std::sort(order.begin(), order.end(), [&map, ids](int lhs, int rhs) {
+            uint32_t lhs_prefix = map.GetPrefix(&ids[lhs * kIdLength]);
+            uint32_t rhs_prefix = map.GetPrefix(&ids[rhs * kIdLength]);
+            return lhs_prefix != rhs_prefix ? lhs_prefix < rhs_prefix : lhs < rhs;
+          });
+          records->resize(id_count);
+          prefix_end_index->assign(1 << map.prefix_bits, 0);
+          for (int position = 0; position < id_count; position++) {
+            const uint8_t *id = &ids[order[position] * kIdLength];
+            memcpy(&(*records)[position], id, kIdLength);
+            (*prefix_end_index)[map.GetPrefix(id)] = position + 1;
+          }
+          for (size_t entry = 1; entry < prefix_end_index->size(); entry++) {
+            (*prefix_end_index)[entry] =
+                std::max((*prefix_end_index)[entry], (*prefix_end_index)[entry - 1]);
+          }
+          return order;
+        }
+
+        int Run(int id_count) {
+          std::mt19937 random(1);
+          std::vector<uint8_t> ids(static_cast<size_t>(id_count) * kIdLength);
+          for (uint8_t &byte : ids) {
+            byte = static_cast<uint8_t>(random());
+          }
+
+          PrefixIdMap map(ids.data(), id_count, /*use_id_filter=*/false);
+          std::vector<ScanIdRecord> records;
+          std::vector<int> prefix_end_index;
+          std::vector<int> order = SortBuild(map, ids.data(), id_count, &records, &prefix_end_index);
+          if (!std::equal(order.begin(), order.end(), map.scan_record_indexes) ||
+              !std::equal(prefix_end_index.begin(), prefix_end_index.end(),
+                          map.prefix_end_index)) {
+            fprintf(stderr, "The std::sort build differs from PrefixIdMap\n");
+            return 1;
+          }
+
+          const double counting_sort = BestMilliseconds([&ids, id_count] {
+            PrefixIdMap built(ids.data(), id_count, /*use_id_filter=*/false);
+          });
+          const double std_sort = BestMilliseconds([&map, &ids, id_count] {
+            std::vector<ScanIdRecord> sorted_records;
+            std::vector<int> end_index;
+            SortBuild(map, ids.data(), id_count, &sorted_records, &end_index);
+          });
+          const double with_filter = BestMilliseconds([&ids, id_count] {
+            PrefixIdMap built(ids.data(), id_count);
+          });
+          printf("Build of %d IDs with %d prefix bits, best of %d:\n", id_count, map.prefix_bits,
+                 kRepetitions);
+          printf("  counting sort  %8.1f ms\n", counting_sort);
+          printf("  std::sort      %8.1f ms\n", std_sort);
+          printf("  with id filter %8.1f ms\n", with_filter);
+
+          // Half of the probes are stored IDs, in random order.
+          PrefixIdMap filtered(ids.data(), id_count);
+          std::vector<uint8_t> probes(ids.size());
+          for (int i = 0; i < id_count; i++) {
+            const uint8_t *source = &ids[(random() % id_count) * kIdLength];
+            for (int j = 0; j < kIdLength; j++) {
+              probes[i * kIdLength + j] = (i % 2 == 0) ? source[j] : static_cast<uint8_t>(random());
+            }
+          }
+          std::vector<int32_t> out(id_count);
+          int single_found = 0;
+          int batch_found = 0;
+          const double single = BestMilliseconds([&] {
+            single_found = 0;
+            for (int i = 0; i < id_count; i++) {
+              single_found += filtered.GetIdIndex(&probes[i * kIdLength]) >= 0 ? 1 : 0;
+            }
+          });
+          const double batch = BestMilliseconds([&] {
+            batch_found = filtered.ProbeBatch(probes.data(), id_count, out.data());
+          });
+          if (single_found != batch_found) {
+            fprintf(stderr, "GetIdIndex found %d IDs, ProbeBatch %d\n", single_found, batch_found);
+            return 1;
+          }
+          printf("Lookup of %d IDs, %d found:\n", id_count, batch_found);
+          printf("  GetIdIndex     %8.1f ms\n", single);
+          printf("  ProbeBatch     %8.1f ms\n", batch);
+          return 0;
+        }
+    }  // namespace
+}  // namespace exposure
+
+int main(int argc, char **argv) {
+  const int id_count = argc > 1 ? atoi(argv[1]) : exposure::kDefaultIdCount;
+  if (id_count <= 0) {
+    fprintf(stderr, "Usage: %s [id_count]\n", argv[0]);
+    return 2;
+  }
+  return exposure::Run(id_count);
+}
@@ -0,0 +1,523 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "prefix_id_map.h"
+
+#include <gtest/gtest.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace exposure {
+    namespace {
+        constexpr int kIdCount = 20000;
+        constexpr int kFirstDay = 18500;
+        constexpr int kDayCount = 14;
+        constexpr int64_t kGeneration = 0x123456789abcdef;
+
+        // Random IDs, with every tenth one repeating an earlier ID so that
+        // buckets hold equal records.
+        std::vector<uint8_t> RandomIds(int id_count, std::mt19937 *random) {
+          std::vector<uint8_t> ids(static_cast<size_t>(id_count) * kIdLength);
+          for (int i = 0; i < id_count; i++) {
+            if (i > 0 && i % 10 == 0) {
+              int earlier = static_cast<int>((*random)() % i);
+              std::copy_n(&ids[earlier * kIdLength], kIdLength, &ids[i * kIdLength]);
+              continue;
+            }
+            for (int j = 0; j < kIdLength; j++) {
+              ids[i * kIdLength + j] = static_cast<uint8_t>((*random)());
+            }
+          }
+          return ids;
+        }
+
+        // Sighting times on kDayCount days from kFirstDay, each over a random
+        // part of its day.
+        std::vector<ScanRecordTime> RandomTimes(int id_count, std::mt19937 *random) {
+          std::vector<ScanRecordTime> times(id_count);
+          for (ScanRecordTime &time : times) {
+            time.day_number = static_cast<uint16_t>(kFirstDay + (*random)() % kDayCount);
+            time.first_interval = static_cast<uint8_t>((*random)() % kIntervalsPerDay);
+            time.last_interval = static_cast<uint8_t>(
+                time.first_interval + (*random)() % (kIntervalsPerDay - time.first_interval));
+          }
+          return times;
+        }
+
+        std::string IndexFilePath(const std::string &name) {
+          return testing::TempDir() + "/" + name;
+        }
+
+        std::vector<uint8_t> ReadBytes(const std::string &path) {
+          std::ifstream file(path, std::ios::binary);
+          return std::vector<uint8_t>(std::istreambuf_iterator<char>(file),
+                                      std::istreambuf_iterator<char>());
+        }
+
+        void WriteBytes(const std::string &path, const std::vector<uint8_t> &bytes) {
+          std::ofstream file(path, std::ios::binary | std::ios::trunc);
+          file.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+        }
+
+        // Overwrites the 32-bit header field at offset with value, then updates
+        // the header checksum, the CRC-32 of the header_size bytes of the header
+        // before its last four, so that only the field itself is wrong.
+        void PatchHeader(std::vector<uint8_t> *file, size_t offset, uint32_t value) {
+          memcpy(&(*file)[offset], &value, sizeof(value));
+          uint32_t header_size;
+          memcpy(&header_size, &(*file)[12], sizeof(header_size));
+          const uint32_t checksum = static_cast<uint32_t>(
+              crc32(crc32(0L, Z_NULL, 0), file->data(), header_size - sizeof(uint32_t)));
+          memcpy(&(*file)[header_size - sizeof(uint32_t)], &checksum, sizeof(checksum));
+        }
+
+        // Finds the header offset of the consecutive first_day, partition_days and
+        // partition_count fields of map.
+        size_t FindPartitionFields(const std::vector<uint8_t> &file, const PrefixIdMap &map) {
+          const int32_t fields[3] = {map.first_day, map.partition_days, map.partition_count};
+          uint32_t header_size;
+          memcpy(&header_size, &file[12], sizeof(header_size));
+          for (size_t offset = 0; offset + sizeof(fields) <= header_size; offset += 4) {
+            if (memcmp(&file[offset], fields, sizeof(fields)) == 0) {
+              return offset;
+            }
+          }
+          ADD_FAILURE() << "No partition fields in the header";
+          return 0;
+        }
+
+        // Every lookup of ids, and of as many absent IDs, gives the same result
+        // in actual as in expected, within intervals.
+        void ExpectSameLookups(const PrefixIdMap &expected, const PrefixIdMap &actual,
+                               const std::vector<uint8_t> &ids,
+                               const IntervalRange &intervals, std::mt19937 *random) {
+          const int id_count = static_cast<int>(ids.size() / kIdLength);
+          std::vector<uint8_t> lookups(ids);
+          std::vector<uint8_t> absent = RandomIds(id_count, random);
+          lookups.insert(lookups.end(), absent.begin(), absent.end());
+          std::vector<int> expected_indexes, actual_indexes;
+          for (size_t i = 0; i < lookups.size() / kIdLength; i++) {
+            const uint8_t *id = &lookups[i * kIdLength];
+            ASSERT_EQ(expected.GetIdIndex(id, intervals), actual.GetIdIndex(id, intervals))
+                << "ID " << i;
+            expected_indexes.clear();
+            actual_indexes.clear();
+            expected.GetScanRecordIndexes(id, &expected_indexes, intervals);
+            actual.GetScanRecordIndexes(id, &actual_indexes, intervals);
+            ASSERT_EQ(expected_indexes, actual_indexes) << "ID " << i;
+          }
+        }
+
+        // Checks the map against the records ordered by std::sort on their
+        // directory entry, then on their scan record index, which is the order
+        // the stable counting sort must produce.
+        void ExpectSortedAsStdSort(const PrefixIdMap &map, const std::vector<uint8_t> &ids,
+                                   const std::vector<int> &entries) {
+          const int id_count = static_cast<int>(entries.size());
+          std::vector<int> expected(id_count);
+          for (int i = 0; i < id_count; i++) {
+            expected[i] = i;
+          }
+          std::sort(expected.begin(), expected.end(), [&entries](int lhs, int rhs) {
+            return entries[lhs] != entries[rhs] ? entries[lhs] < entries[rhs] : lhs < rhs;
+          });
+
+          ASSERT_EQ(id_count, map.scan_record_size);
+          int entry = 0;
+          for (int position = 0; position < id_count; position++) {
+            const int index = expected[position];
+            ASSERT_EQ(index, map.scan_record_indexes[position]) << "at " << position;
+            ASSERT_EQ(0, memcmp(&map.scan_records[position], &ids[index * kIdLength], kIdLength))
+                << "at " << position;
+            while (map.prefix_end_index[entry] <= position) {
+              entry++;
+            }
+            ASSERT_EQ(entries[index], entry) << "at " << position;
+            ASSERT_TRUE(entry == 0 || map.prefix_end_index[entry - 1] <= position);
+          }
+          const int entry_count = map.partition_count << map.prefix_bits;
+          EXPECT_EQ(id_count, map.prefix_end_index[entry_count - 1]);
+        }
+
+        TEST(PrefixIdMapTest, OrdersIdsAsStdSort) {
+          std::mt19937 random(1);
+          std::vector<uint8_t> ids = RandomIds(kIdCount, &random);
+          PrefixIdMap map(ids.data(), kIdCount, /*use_id_filter=*/false);
+
+          std::vector<int> entries(kIdCount);
+          for (int i = 0; i < kIdCount; i++) {
+            entries[i] = static_cast<int>(map.GetPrefix(&ids[i * kIdLength]));
+          }
+          ASSERT_EQ(1, map.partition_count);
+          // No more directory entries than records, and at least half as many.
+          EXPECT_LE(1 << map.prefix_bits, kIdCount);
+          EXPECT_GT(2 << map.prefix_bits, kIdCount);
+          ExpectSortedAsStdSort(map, ids, entries);
+        }
+
+        TEST(PrefixIdMapTest, OrdersIdsByDayPartitionAsStdSort) {
+          std::mt19937 random(2);
+          std::vector<uint8_t> ids = RandomIds(kIdCount, &random);
+          std::vector<ScanRecordTime> times(kIdCount);
+          for (int i = 0; i < kIdCount; i++) {
+            times[i].day_number = static_cast<uint16_t>(kFirstDay + random() % kDayCount);
+            times[i].first_interval = 0;
+            times[i].last_interval = kIntervalsPerDay - 1;
+          }
+          PrefixIdMap map(ids.data(), times.data(), kIdCount, /*use_id_filter=*/false);
+
+          ASSERT_EQ(kFirstDay, map.first_day);
+          ASSERT_GT(map.partition_days, 0);
+          EXPECT_LE(map.partition_count << map.prefix_bits, kIdCount);
+          std::vector<int> entries(kIdCount);
+          for (int i = 0; i < kIdCount; i++) {
+            int partition = (times[i].day_number - map.first_day) / map.partition_days;
+            entries[i] = static_cast<int>(map.GetPrefix(&ids[i * kIdLength])) *
+                         map.partition_count + partition;
+          }
+          ExpectSortedAsStdSort(map, ids, entries);
+          for (int position = 0; position < kIdCount; position++) {
+            ASSERT_EQ(times[map.scan_record_indexes[position]].day_number,
+                      map.scan_record_times[position].day_number);
+          }
+        }
+
+        // A record overlaps intervals if any interval it was sighted in is among
+        // them, up to the exact first and last one.
+        TEST(PrefixIdMapTest, SightedWithinIncludesEdges) {
+          const ScanRecordTime time = {kFirstDay, 10, 20};
+          const int day_start = kFirstDay * kIntervalsPerDay;
+          EXPECT_TRUE(SightedWithin(time, {day_start + 20, day_start + 30}));
+          EXPECT_FALSE(SightedWithin(time, {day_start + 21, day_start + 30}));
+          EXPECT_TRUE(SightedWithin(time, {day_start, day_start + 10}));
+          EXPECT_FALSE(SightedWithin(time, {day_start, day_start + 9}));
+          EXPECT_TRUE(SightedWithin(time, {day_start + 15, day_start + 15}));
+          EXPECT_TRUE(SightedWithin(time, kAllIntervals));
+          EXPECT_FALSE(SightedWithin(time, {day_start - kIntervalsPerDay + 20,
+                                            day_start + 9}));
+        }
+
+        // Spans of more than kMaxDayPartitions days are grouped into partitions of
+        // several days. Lookups limited to intervals around every partition
+        // boundary must find exactly the IDs sighted within them.
+        TEST(PrefixIdMapTest, FindsIdsAtDayPartitionBoundaries) {
+          constexpr int kLongDayCount = 100;
+          std::mt19937 random(11);
+          std::vector<uint8_t> ids(static_cast<size_t>(kIdCount) * kIdLength);
+          for (uint8_t &byte : ids) {
+            byte = static_cast<uint8_t>(random());
+          }
+          std::vector<ScanRecordTime> times(kIdCount);
+          for (int i = 0; i < kIdCount; i++) {
+            times[i].day_number = static_cast<uint16_t>(kFirstDay + i % kLongDayCount);
+            times[i].first_interval = static_cast<uint8_t>(random() % kIntervalsPerDay);
+            times[i].last_interval = static_cast<uint8_t>(
+                times[i].first_interval + random() % (kIntervalsPerDay - times[i].first_interval));
+          }
+          PrefixIdMap map(ids.data(), times.data(), kIdCount);
+          ASSERT_EQ(kFirstDay, map.first_day);
+          ASSERT_EQ(4, map.partition_days);
+          ASSERT_EQ(25, map.partition_count);
+
+          std::vector<IntervalRange> ranges;
+          const int first_interval = kFirstDay * kIntervalsPerDay;
+          const int end_interval = (kFirstDay + kLongDayCount) * kIntervalsPerDay;
+          ranges.push_back({first_interval, first_interval});
+          ranges.push_back({first_interval - 1, first_interval});
+          ranges.push_back({end_interval - 1, end_interval - 1});
+          ranges.push_back({end_interval - 1, end_interval});
+          ranges.push_back({end_interval, end_interval + kIntervalsPerDay});
+          ranges.push_back({first_interval - kIntervalsPerDay, first_interval - 1});
+          for (int partition = 1; partition < map.partition_count; partition++) {
+            const int boundary =
+                (kFirstDay + partition * map.partition_days) * kIntervalsPerDay;
+            ranges.push_back({boundary - 1, boundary - 1});
+            ranges.push_back({boundary, boundary});
+            ranges.push_back({boundary - 1, boundary});
+            ranges.push_back({boundary - kIntervalsPerDay, boundary + kIntervalsPerDay - 1});
+          }
+
+          std::vector<int32_t> out(kIdCount);
+          for (const IntervalRange &range : ranges) {
+            SCOPED_TRACE(testing::Message()
+                         << "intervals " << range.first_interval << " to " << range.last_interval);
+            int expected_found = 0;
+            for (const ScanRecordTime &time : times) {
+              expected_found += SightedWithin(time, range) ? 1 : 0;
+            }
+            EXPECT_EQ(expected_found, map.ProbeBatch(ids.data(), kIdCount, out.data(), range));
+            for (int i = 0; i < kIdCount; i++) {
+              ASSERT_EQ(SightedWithin(times[i], range), out[i] >= 0) << "ID " << i;
+              ASSERT_EQ(out[i], map.GetIdIndex(&ids[i * kIdLength], range)) << "ID " << i;
+            }
+          }
+        }
+
+        TEST(PrefixIdMapTest, FindsEveryIdAndDuplicate) {
+          std::mt19937 random(3);
+          std::vector<uint8_t> ids = RandomIds(kIdCount, &random);
+          PrefixIdMap map(ids.data(), kIdCount);
+
+          std::vector<int> indexes;
+          for (int i = 0; i < kIdCount; i++) {
+            const uint8_t *id = &ids[i * kIdLength];
+            int position = map.GetIdIndex(id);
+            ASSERT_GE(position, 0) << "ID " << i;
+            EXPECT_EQ(0, memcmp(&map.scan_records[position], id, kIdLength));
+            indexes.clear();
+            ASSERT_TRUE(map.GetScanRecordIndexes(id, &indexes));
+            EXPECT_NE(std::find(indexes.begin(), indexes.end(), i), indexes.end());
+            EXPECT_TRUE(std::is_sorted(indexes.begin(), indexes.end()));
+          }
+        }
+
+        TEST(PrefixIdMapTest, WriteFileRoundTrips) {
+          std::mt19937 random(4);
+          std::vector<uint8_t> ids = RandomIds(kIdCount, &random);
+          std::vector<ScanRecordTime> times = RandomTimes(kIdCount, &random);
+          PrefixIdMap plain(ids.data(), kIdCount);
+          PrefixIdMap partitioned(ids.data(), times.data(), kIdCount);
+
+          for (const PrefixIdMap *map : {&plain, &partitioned}) {
+            const std::string path = IndexFilePath("round_trip.idx");
+            ASSERT_TRUE(map->WriteFile(path, kGeneration));
+            std::unique_ptr<PrefixIdMap> opened = PrefixIdMap::OpenFile(path, kGeneration);
+            ASSERT_NE(nullptr, opened);
+            EXPECT_EQ(map->scan_record_size, opened->scan_record_size);
+            EXPECT_EQ(map->prefix_bits, opened->prefix_bits);
+            EXPECT_EQ(map->first_day, opened->first_day);
+            EXPECT_EQ(map->partition_days, opened->partition_days);
+            EXPECT_EQ(map->partition_count, opened->partition_count);
+            EXPECT_EQ(map->id_filter.IsEmpty(), opened->id_filter.IsEmpty());
+            EXPECT_EQ(map->scan_record_times == nullptr, opened->scan_record_times == nullptr);
+            ExpectSameLookups(*map, *opened, ids, kAllIntervals, &random);
+            const int first_interval = (kFirstDay + 3) * kIntervalsPerDay + 50;
+            ExpectSameLookups(*map, *opened, ids,
+                              {first_interval, first_interval + 2 * kIntervalsPerDay}, &random);
+          }
+        }
+
+        TEST(PrefixIdMapTest, OpenFileRejectsOtherGenerationAndMissingFile) {
+          std::mt19937 random(5);
+          std::vector<uint8_t> ids = RandomIds(kIdCount, &random);
+          PrefixIdMap map(ids.data(), kIdCount);
+          const std::string path = IndexFilePath("generation.idx");
+          ASSERT_TRUE(map.WriteFile(path, kGeneration));
+
+          EXPECT_EQ(nullptr, PrefixIdMap::OpenFile(path, kGeneration + 1));
+          EXPECT_NE(nullptr, PrefixIdMap::OpenFile(path, kGeneration));
+          EXPECT_EQ(nullptr, PrefixIdMap::OpenFile(IndexFilePath("missing.idx"), kGeneration));
+        }
+
+        TEST(PrefixIdMapTest, OpenFileRejectsTruncatedFile) {
+          std::mt19937 random(6);
+          std::vector<uint8_t> ids = RandomIds(kIdCount, &random);
+          PrefixIdMap map(ids.data(), kIdCount);
+          const std::string path = IndexFilePath("truncated.idx");
+          ASSERT_TRUE(map.WriteFile(path, kGeneration));
+          const std::vector<uint8_t> file = ReadBytes(path);
+
+          for (size_t size : {file.size() - 1, file.size() / 2, static_cast<size_t>(64),
+                              static_cast<size_t>(0)}) {
+            WriteBytes(path, std::vector<uint8_t>(file.begin(), file.begin() + size));
+            EXPECT_EQ(nullptr, PrefixIdMap::OpenFile(path, kGeneration)) << size << " bytes";
+          }
+        }
+
+        TEST(PrefixIdMapTest, OpenFileRejectsBadVersionAndChecksum) {
+          std::mt19937 random(7);
+          std::vector<uint8_t> ids = RandomIds(kIdCount, &random);
+          PrefixIdMap map(ids.data(), kIdCount);
+          const std::string path = IndexFilePath("header.idx");
+          ASSERT_TRUE(map.WriteFile(path, kGeneration));
+          const std::vector<uint8_t> file = ReadBytes(path);
+
+          // The version follows the 8-byte magic.
+          std::vector<uint8_t> other_version(file);
+          other_version[8]++;
+          WriteBytes(path, other_version);
+          EXPECT_EQ(nullptr, PrefixIdMap::OpenFile(path, kGeneration));
+
+          // Bumped with a valid checksum, the version alone is rejected.
+          uint32_t version;
+          memcpy(&version, &file[8], sizeof(version));
+          PatchHeader(&other_version, 8, version + 1);
+          WriteBytes(path, other_version);
+          EXPECT_EQ(nullptr, PrefixIdMap::OpenFile(path, kGeneration));
+
+          // Any other header byte, here one of the record count, breaks the
+          // checksum.
+          std::vector<uint8_t> damaged(file);
+          damaged[20] ^= 1;
+          WriteBytes(path, damaged);
+          EXPECT_EQ(nullptr, PrefixIdMap::OpenFile(path, kGeneration));
+
+          // A corrupt directory with a valid header.
+          std::vector<uint8_t> bad_directory(file);
+          uint64_t prefix_offset;
+          memcpy(&prefix_offset, &file[40], sizeof(prefix_offset));
+          const int32_t end_index = std::numeric_limits<int32_t>::max();
+          memcpy(&bad_directory[prefix_offset], &end_index, sizeof(end_index));
+          WriteBytes(path, bad_directory);
+          EXPECT_EQ(nullptr, PrefixIdMap::OpenFile(path, kGeneration));
+
+          WriteBytes(path, file);
+          EXPECT_NE(nullptr, PrefixIdMap::OpenFile(path, kGeneration));
+        }
+
+        TEST(PrefixIdMapTest, OpenFileRejectsBadDayPartitions) {
+          std::mt19937 random(8);
+          std::vector<uint8_t> ids = RandomIds(kIdCount, &random);
+          std::vector<ScanRecordTime> times = RandomTimes(kIdCount, &random);
+          PrefixIdMap map(ids.data(), times.data(), kIdCount);
+          const std::string path = IndexFilePath("partitions.idx");
+          ASSERT_TRUE(map.WriteFile(path, kGeneration));
+          const std::vector<uint8_t> file = ReadBytes(path);
+          const size_t first_day = FindPartitionFields(file, map);
+          const size_t partition_days = first_day + 4;
+          const size_t partition_count = first_day + 8;
+
+          struct Patch {
+              size_t offset;
+              uint32_t value;
+          };
+          const Patch patches[] = {
+              {first_day, static_cast<uint32_t>(-1)},
+              {first_day, 65536},
+              // Partitions past the last day number.
+              {first_day, 65536 - kDayCount + 1},
+              {partition_days, 0},
+              {partition_days, 65536},
+              {partition_days, 0x80000000u},
+              {partition_days, 65536 / (kDayCount - 1)},
+              // Same directory size with partitions, and other sizes.
+              {partition_count, static_cast<uint32_t>(map.partition_count - 1)},
+              {partition_count, static_cast<uint32_t>(map.partition_count + 1)},
+              {partition_count, 0},
+          };
+          for (const Patch &patch : patches) {
+            std::vector<uint8_t> patched(file);
+            PatchHeader(&patched, patch.offset, patch.value);
+            WriteBytes(path, patched);
+            EXPECT_EQ(nullptr, PrefixIdMap::OpenFile(path, kGeneration))
+                << "field at " << patch.offset << " set to " << patch.value;
+          }
+
+          // A header patched with its own values still opens.
+          std::vector<uint8_t> patched(file);
+          PatchHeader(&patched, partition_days, static_cast<uint32_t>(map.partition_days));
+          WriteBytes(path, patched);
+          EXPECT_NE(nullptr, PrefixIdMap::OpenFile(path, kGeneration));
+        }
+
+        TEST(PrefixIdMapTest, ProbeBatchMatchesSingleLookups) {
+          std::mt19937 random(10);
+          std::vector<uint8_t> ids = RandomIds(kIdCount, &random);
+          std::vector<uint8_t> absent = RandomIds(kIdCount, &random);
+
+          for (bool use_id_filter : {false, true}) {
+            SCOPED_TRACE(use_id_filter ? "id filter" : "no id filter");
+            PrefixIdMap map(ids.data(), kIdCount, use_id_filter);
+            // Batches shorter than, equal to and around multiples of the 64 IDs
+            // whose lookups are interleaved.
+            for (size_t n : {0, 1, 2, 7, 63, 64, 65, 130, 1000}) {
+              // Hits, including every tenth ID, which repeats an earlier one,
+              // mixed with misses.
+              std::vector<uint8_t> probes(n * kIdLength);
+              for (size_t i = 0; i < n; i++) {
+                const std::vector<uint8_t> &source = random() % 3 == 0 ? absent : ids;
+                const size_t index = random() % kIdCount;
+                std::copy_n(&source[index * kIdLength], kIdLength, &probes[i * kIdLength]);
+              }
+              std::vector<int32_t> out(n + 1, -2);
+              const int found = map.ProbeBatch(probes.data(), n, out.data());
+
+              int expected_found = 0;
+              std::vector<int> indexes;
+              for (size_t i = 0; i < n; i++) {
+                const uint8_t *id = &probes[i * kIdLength];
+                const int expected = map.GetIdIndex(id);
+                ASSERT_EQ(expected, out[i]) << "n " << n << " probe " << i;
+                indexes.clear();
+                EXPECT_EQ(expected >= 0, map.GetScanRecordIndexes(id, &indexes));
+                if (expected >= 0) {
+                  expected_found++;
+                  EXPECT_EQ(indexes.front(), map.scan_record_indexes[expected]);
+                }
+              }
+              EXPECT_EQ(expected_found, found) << "n " << n;
+              EXPECT_EQ(-2, out[n]) << "wrote past the batch of " << n;
+            }
+          }
+        }
+
+        // IDs equal to one of ids in bytes [8, 16), the compact fingerprint, and
+        // in the prefix, but not in the bytes between.
+        std::vector<uint8_t> FingerprintCollisions(const std::vector<uint8_t> &ids, int count) {
+          std::vector<uint8_t> collisions(ids.begin(), ids.begin() + count * kIdLength);
+          for (int i = 0; i < count; i++) {
+            collisions[i * kIdLength + 5] ^= 0x5a;
+          }
+          return collisions;
+        }
+
+        TEST(PrefixIdMapTest, CompactFileProbesAsFullMap) {
+          std::mt19937 random(9);
+          std::vector<uint8_t> ids = RandomIds(kIdCount, &random);
+          std::vector<ScanRecordTime> times = RandomTimes(kIdCount, &random);
+          std::vector<uint8_t> probes(ids);
+          std::vector<uint8_t> absent = RandomIds(kIdCount, &random);
+          probes.insert(probes.end(), absent.begin(), absent.end());
+          // Without the ID filter every collision reaches the record compare.
+          std::vector<uint8_t> collisions = FingerprintCollisions(ids, 1000);
+          probes.insert(probes.end(), collisions.begin(), collisions.end());
+          const size_t probe_count = probes.size() / kIdLength;
+
+          for (bool use_id_filter : {false, true}) {
+            SCOPED_TRACE(use_id_filter ? "id filter" : "no id filter");
+            PrefixIdMap map(ids.data(), times.data(), kIdCount, use_id_filter);
+            const std::string path = IndexFilePath("compact.idx");
+            ASSERT_TRUE(map.WriteFile(path, kGeneration));
+            std::unique_ptr<PrefixIdMap> compact =
+                PrefixIdMap::OpenFile(path, kGeneration, /*compact=*/true);
+            ASSERT_NE(nullptr, compact);
+            ASSERT_NE(nullptr, compact->record_fingerprints);
+
+            const int first_interval = (kFirstDay + 5) * kIntervalsPerDay + 20;
+            for (const IntervalRange &intervals :
+                {kAllIntervals, IntervalRange{first_interval, first_interval + 100}}) {
+              std::vector<int32_t> expected(probe_count), actual(probe_count);
+              const int expected_found =
+                  map.ProbeBatch(probes.data(), probe_count, expected.data(), intervals);
+              EXPECT_EQ(expected_found,
+                        compact->ProbeBatch(probes.data(), probe_count, actual.data(), intervals));
+              EXPECT_EQ(expected, actual);
+              for (size_t i = kIdCount * 2; i < probe_count; i++) {
+                ASSERT_EQ(-1, actual[i]) << "collision " << i - kIdCount * 2;
+                ASSERT_EQ(-1, compact->GetIdIndex(&probes[i * kIdLength], intervals));
+              }
+            }
+          }
+        }
+    }  // namespace
+}  // namespace exposure
@@ -0,0 +1,146 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "rpik_hkdf.h"
+
+#include <string.h>
+
+#include "sha256_kernel.h"
+
+namespace exposure {
+
+    namespace {
+        constexpr int kHmacInnerPad = 0x36;
+        constexpr int kHmacOuterPad = 0x5c;
+
+        // Number of keys whose compressions are issued in one kernel call.
+        constexpr size_t kRpikChunkSize = 16;
+
+        // Pads a message of message_length bytes, already placed at the start of
+        // block, that follows one block of HMAC pad. The total hashed length is
+        // therefore kSha256BlockSize + message_length.
+        void PadHmacBlock(uint8_t *block, size_t message_length) {
+          static_assert(kSha256DigestLength + 9 <= kSha256BlockSize,
+                        "Message must fit in one block");
+          memset(block + message_length, 0, kSha256BlockSize - message_length);
+          block[message_length] = 0x80;
+          uint64_t bit_length = (kSha256BlockSize + message_length) * 8;
+          for (int i = 0; i < 8; i++) {
+            block[kSha256BlockSize - 1 - i] = static_cast<uint8_t>(bit_length >> (8 * i));
+          }
+        }
+
+        Sha256State CompressPad(const uint8_t *key, size_t key_length, int pad) {
+          uint8_t block[kSha256BlockSize];
+          memset(block, pad, sizeof(block));
+          for (size_t i = 0; i < key_length; i++) {
+            block[i] ^= key[i];
+          }
+          Sha256State state;
+          memcpy(state.h, kSha256InitialState, sizeof(state.h));
+          Sha256CompressBlocks(&state, block, 1);
+          return state;
+        }
+
+        // Everything that only depends on the constant salt and info.
+        struct RpikHkdfConstants {
+            // HMAC states after the inner and outer pad of the empty salt, which
+            // HMAC zero-extends to a full block.
+            Sha256State extract_inner;
+            Sha256State extract_outer;
+            // The single block of the expand step's inner hash: info || 0x01.
+            uint8_t expand_block[kSha256BlockSize];
+
+            RpikHkdfConstants() {
+              extract_inner = CompressPad(nullptr, 0, kHmacInnerPad);
+              extract_outer = CompressPad(nullptr, 0, kHmacOuterPad);
+              memcpy(expand_block, kHkdfInfo, kHkdfInfoLength);
+              expand_block[kHkdfInfoLength] = 0x01;
+              PadHmacBlock(expand_block, kHkdfInfoLength + 1);
+            }
+        };
+
+        const RpikHkdfConstants &GetConstants() {
+          static const RpikHkdfConstants constants;
+          return constants;
+        }
+
+        void DeriveRpikChunk(const uint8_t *teks, size_t n, uint8_t *rpiks) {
+          const RpikHkdfConstants &constants = GetConstants();
+          Sha256State states[2 * kRpikChunkSize];
+          uint8_t blocks[2 * kRpikChunkSize][kSha256BlockSize];
+          uint8_t prk[kSha256DigestLength];
+
+          // Extract, inner hash: H(zero-key ^ ipad || tek).
+          for (size_t i = 0; i < n; i++) {
+            states[i] = constants.extract_inner;
+            memcpy(blocks[i], teks + i * kTekLength, kTekLength);
+            PadHmacBlock(blocks[i], kTekLength);
+          }
+          Sha256CompressBlocks(states, blocks[0], n);
+
+          // Extract, outer hash: PRK = H(zero-key ^ opad || inner).
+          for (size_t i = 0; i < n; i++) {
+            Sha256StateToBytes(states[i], blocks[i]);
+            PadHmacBlock(blocks[i], kSha256DigestLength);
+            states[i] = constants.extract_outer;
+          }
+          Sha256CompressBlocks(states, blocks[0], n);
+
+          // Expand, HMAC pads keyed by PRK. Inner pads go to [0, n), outer pads
+          // to [n, 2n).
+          for (size_t i = 0; i < n; i++) {
+            Sha256StateToBytes(states[i], prk);
+            memset(blocks[i], kHmacInnerPad, kSha256BlockSize);
+            memset(blocks[n + i], kHmacOuterPad, kSha256BlockSize);
+            for (int j = 0; j < kSha256DigestLength; j++) {
+              blocks[i][j] ^= prk[j];
+              blocks[n + i][j] ^= prk[j];
+            }
+          }
+          for (size_t i = 0; i < 2 * n; i++) {
+            memcpy(states[i].h, kSha256InitialState, sizeof(states[i].h));
+          }
+          Sha256CompressBlocks(states, blocks[0], 2 * n);
+
+          // Expand, inner hash of info || 0x01.
+          for (size_t i = 0; i < n; i++) {
+            memcpy(blocks[i], constants.expand_block, kSha256BlockSize);
+          }
+          Sha256CompressBlocks(states, blocks[0], n);
+
+          // Expand, outer hash: T(1) = H(PRK ^ opad || inner). RPIK is its
+          // first kRpikLength bytes.
+          for (size_t i = 0; i < n; i++) {
+            Sha256StateToBytes(states[i], blocks[n + i]);
+            PadHmacBlock(blocks[n + i], kSha256DigestLength);
+          }
+          Sha256CompressBlocks(&states[n], blocks[n], n);
+          for (size_t i = 0; i < n; i++) {
+            Sha256StateToBytes(states[n + i], prk);
+            memcpy(rpiks + i * kRpikLength, prk, kRpikLength);
+          }
+        }
+    }  // namespace
+
+    void DeriveRpiks(const uint8_t *teks, size_t n, uint8_t *rpiks) {
+      static_assert(kRpikLength <= kSha256DigestLength, "RPIK longer than T(1)");
+      for (size_t i = 0; i < n; i += kRpikChunkSize) {
+        size_t chunk = (n - i < kRpikChunkSize) ? n - i : kRpikChunkSize;
+        DeriveRpikChunk(teks + i * kTekLength, chunk, rpiks + i * kRpikLength);
+      }
+    }
+}  // namespace exposure
@@ -0,0 +1,35 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LOCATION_NEARBY_CPP_EXPOSURENOTIFICATION_JNI_RPIK_HKDF_H_
+#define LOCATION_NEARBY_CPP_EXPOSURENOTIFICATION_JNI_RPIK_HKDF_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+
+namespace exposure {
+    // Derives RPIK <- HKDF-SHA256(tek, NULL, UTF8("EN-RPIK"), 16) for n keys.
+    // teks holds n * kTekLength bytes and rpiks receives n * kRpikLength bytes.
+    //
+    // Equivalent to calling BoringSSL's HKDF once per key, but specialized for
+    // the fixed salt and info: the HMAC pads of the empty salt are precomputed,
+    // every step fits in a single SHA-256 block, and the compressions of all
+    // keys in the batch are run through the multi-lane kernel together.
+    void DeriveRpiks(const uint8_t *teks, size_t n, uint8_t *rpiks);
+}  // namespace exposure
+#endif  // LOCATION_NEARBY_CPP_EXPOSURENOTIFICATION_JNI_RPIK_HKDF_H_
@@ -0,0 +1,74 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#include "rpik_hkdf.h"
+
+#include <gtest/gtest.h>
+#include <openssl/digest.h>
+#include <openssl/hkdf.h>
+
+#include <random>
+#include <vector>
+
+#include "cpu_features.h"
+
+namespace exposure {
+    namespace {
+        // TEK and RPIK of the specification's test vectors, see TestVectors.java.
+        constexpr uint8_t kTek[kTekLength] = {0x75, 0xc7, 0x34, 0xc6, 0xdd, 0x1a, 0x78, 0x2d,
+                                              0xe7, 0xa9, 0x65, 0xda, 0x5e, 0xb9, 0x31, 0x25};
+        constexpr uint8_t kRpik[kRpikLength] = {0x18, 0x5a, 0xd9, 0x1d, 0xb6, 0x9e, 0xc7, 0xdd,
+                                                0x04, 0x89, 0x60, 0xf1, 0xf3, 0xba, 0x61, 0x75};
+
+        TEST(RpikHkdf, DerivesSpecRpik) {
+          for (bool hardware : {true, false}) {
+            DisableHardwareCryptoForTesting(!hardware);
+            std::vector<uint8_t> rpik(kRpikLength);
+            DeriveRpiks(kTek, 1, rpik.data());
+            DisableHardwareCryptoForTesting(false);
+            EXPECT_EQ(std::vector<uint8_t>(kRpik, kRpik + kRpikLength), rpik)
+                << (hardware ? "hardware" : "portable");
+          }
+        }
+
+        // Batches whose sizes are not multiples of the lane count or of the
+        // chunk size must give the RPIKs of BoringSSL's HKDF called per key.
+        TEST(RpikHkdf, BatchMatchesHkdf) {
+          std::mt19937 random(5);
+          for (bool hardware : {true, false}) {
+            for (size_t n : {1, 2, 3, 5, 15, 16, 17, 31, 33, 50}) {
+              std::vector<uint8_t> teks(n * kTekLength);
+              for (uint8_t &byte : teks) {
+                byte = static_cast<uint8_t>(random());
+              }
+              DisableHardwareCryptoForTesting(!hardware);
+              std::vector<uint8_t> rpiks(n * kRpikLength);
+              DeriveRpiks(teks.data(), n, rpiks.data());
+              DisableHardwareCryptoForTesting(false);
+
+              std::vector<uint8_t> expected(n * kRpikLength);
+              for (size_t i = 0; i < n; i++) {
+                ASSERT_EQ(1, HKDF(&expected[i * kRpikLength], kRpikLength, EVP_sha256(),
+                                  &teks[i * kTekLength], kTekLength, /*salt=*/nullptr, 0,
+                                  reinterpret_cast<const uint8_t *>(kHkdfInfo),
+                                  kHkdfInfoLength));
+              }
+              EXPECT_EQ(expected, rpiks) << (hardware ? "hardware" : "portable") << " n " << n;
+            }
+          }
+        }
+    }  // namespace
+}  // namespace exposure
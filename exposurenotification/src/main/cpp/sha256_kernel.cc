@@ -0,0 +1,116 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "sha256_kernel.h"
+
+#include "cpu_features.h"
+
+namespace exposure {
+    const uint32_t kSha256InitialState[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                             0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                             0x1f83d9ab, 0x5be0cd19};
+
+    const uint32_t kSha256RoundConstants[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+        0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+        0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+        0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+        0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+        0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+        0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+        0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+        0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+    namespace {
+        inline uint32_t RotateRight(uint32_t x, int n) {
+          return (x >> n) | (x << (32 - n));
+        }
+
+        inline uint32_t LoadBigEndian32(const uint8_t *p) {
+          return (static_cast<uint32_t>(p[0]) << 24) |
+                 (static_cast<uint32_t>(p[1]) << 16) |
+                 (static_cast<uint32_t>(p[2]) << 8) | static_cast<uint32_t>(p[3]);
+        }
+
+        void Sha256CompressPortable(Sha256State *state, const uint8_t *block) {
+          uint32_t w[64];
+          for (int i = 0; i < 16; i++) {
+            w[i] = LoadBigEndian32(block + i * 4);
+          }
+          for (int i = 16; i < 64; i++) {
+            uint32_t s0 = RotateRight(w[i - 15], 7) ^ RotateRight(w[i - 15], 18) ^
+                          (w[i - 15] >> 3);
+            uint32_t s1 = RotateRight(w[i - 2], 17) ^ RotateRight(w[i - 2], 19) ^
+                          (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+          }
+          uint32_t a = state->h[0], b = state->h[1], c = state->h[2],
+              d = state->h[3], e = state->h[4], f = state->h[5], g = state->h[6],
+              h = state->h[7];
+          for (int i = 0; i < 64; i++) {
+            uint32_t s1 = RotateRight(e, 6) ^ RotateRight(e, 11) ^ RotateRight(e, 25);
+            uint32_t ch = (e & f) ^ (~e & g);
+            uint32_t t1 = h + s1 + ch + kSha256RoundConstants[i] + w[i];
+            uint32_t s0 = RotateRight(a, 2) ^ RotateRight(a, 13) ^ RotateRight(a, 22);
+            uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t t2 = s0 + maj;
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+          }
+          state->h[0] += a;
+          state->h[1] += b;
+          state->h[2] += c;
+          state->h[3] += d;
+          state->h[4] += e;
+          state->h[5] += f;
+          state->h[6] += g;
+          state->h[7] += h;
+        }
+    }  // namespace
+
+    void Sha256CompressBlocks(Sha256State *states, const uint8_t *blocks,
+                              size_t n) {
+      if (CpuHasSha256()) {
+#if defined(__i386__) || defined(__x86_64__)
+        Sha256CompressBlocksShaNi(states, blocks, n);
+        return;
+#elif defined(__aarch64__)
+        Sha256CompressBlocksArmv8(states, blocks, n);
+        return;
+#endif
+      }
+      for (size_t i = 0; i < n; i++) {
+        Sha256CompressPortable(&states[i], blocks + i * kSha256BlockSize);
+      }
+    }
+
+    void Sha256StateToBytes(const Sha256State &state, uint8_t *out) {
+      for (int i = 0; i < 8; i++) {
+        out[i * 4] = static_cast<uint8_t>(state.h[i] >> 24);
+        out[i * 4 + 1] = static_cast<uint8_t>(state.h[i] >> 16);
+        out[i * 4 + 2] = static_cast<uint8_t>(state.h[i] >> 8);
+        out[i * 4 + 3] = static_cast<uint8_t>(state.h[i]);
+      }
+    }
+}  // namespace exposure
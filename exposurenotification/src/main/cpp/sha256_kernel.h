@@ -0,0 +1,55 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LOCATION_NEARBY_CPP_EXPOSURENOTIFICATION_JNI_SHA256_KERNEL_H_
+#define LOCATION_NEARBY_CPP_EXPOSURENOTIFICATION_JNI_SHA256_KERNEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace exposure {
+    constexpr static const int kSha256BlockSize = 64;
+    constexpr static const int kSha256DigestLength = 32;
+
+    // Number of independent compressions the hardware kernels run in lockstep.
+    constexpr static const int kSha256Lanes = 2;
+
+    extern const uint32_t kSha256InitialState[8];
+
+    extern const uint32_t kSha256RoundConstants[64];
+
+    struct Sha256State {
+        uint32_t h[8];
+    };
+
+    // Runs one SHA-256 compression for each of the n (state, block) pairs, where
+    // blocks holds n consecutive kSha256BlockSize byte blocks. The pairs are
+    // independent, which lets the hardware kernels interleave them.
+    void Sha256CompressBlocks(Sha256State *states, const uint8_t *blocks,
+                              size_t n);
+
+    // Writes the big-endian digest bytes of state into out.
+    void Sha256StateToBytes(const Sha256State &state, uint8_t *out);
+
+    // Architecture specific kernels, see sha256_kernel_x86.cc and
+    // sha256_kernel_armv8.cc. Only defined on the matching architecture.
+    void Sha256CompressBlocksShaNi(Sha256State *states, const uint8_t *blocks,
+                                   size_t n);
+
+    void Sha256CompressBlocksArmv8(Sha256State *states, const uint8_t *blocks,
+                                   size_t n);
+}  // namespace exposure
+#endif  // LOCATION_NEARBY_CPP_EXPOSURENOTIFICATION_JNI_SHA256_KERNEL_H_
@@ -0,0 +1,86 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// ARMv8 SHA2 kernel. This file is compiled with -march=armv8-a+crypto (see
+// CMakeLists.txt) and is only entered after CpuHasSha256() confirmed support
+// at runtime.
+
+#include "sha256_kernel.h"
+
+#if defined(__aarch64__)
+
+#include <arm_neon.h>
+
+namespace exposure {
+
+    namespace {
+        // Compresses kLanes independent blocks in lockstep, see the SHA-NI
+        // kernel for the rationale.
+        template <int kLanes>
+        inline __attribute__((always_inline)) void CompressLanes(
+            Sha256State *states, const uint8_t *blocks) {
+          uint32x4_t abcd[kLanes], efgh[kLanes], abcd_save[kLanes],
+              efgh_save[kLanes];
+          uint32x4_t msg[kLanes][4], wk[kLanes], tmp[kLanes];
+
+          for (int l = 0; l < kLanes; l++) {
+            abcd[l] = vld1q_u32(&states[l].h[0]);
+            efgh[l] = vld1q_u32(&states[l].h[4]);
+            abcd_save[l] = abcd[l];
+            efgh_save[l] = efgh[l];
+            for (int i = 0; i < 4; i++) {
+              msg[l][i] = vreinterpretq_u32_u8(
+                  vrev32q_u8(vld1q_u8(blocks + l * kSha256BlockSize + i * 16)));
+            }
+          }
+
+          for (int g = 0; g < 16; g++) {
+            const uint32x4_t k = vld1q_u32(&kSha256RoundConstants[g * 4]);
+            for (int l = 0; l < kLanes; l++) {
+              wk[l] = vaddq_u32(msg[l][g % 4], k);
+              if (g < 12) {
+                msg[l][g % 4] = vsha256su0q_u32(msg[l][g % 4], msg[l][(g + 1) % 4]);
+              }
+              tmp[l] = abcd[l];
+              abcd[l] = vsha256hq_u32(abcd[l], efgh[l], wk[l]);
+              efgh[l] = vsha256h2q_u32(efgh[l], tmp[l], wk[l]);
+              if (g < 12) {
+                msg[l][g % 4] = vsha256su1q_u32(msg[l][g % 4], msg[l][(g + 2) % 4],
+                                                msg[l][(g + 3) % 4]);
+              }
+            }
+          }
+
+          for (int l = 0; l < kLanes; l++) {
+            vst1q_u32(&states[l].h[0], vaddq_u32(abcd[l], abcd_save[l]));
+            vst1q_u32(&states[l].h[4], vaddq_u32(efgh[l], efgh_save[l]));
+          }
+        }
+    }  // namespace
+
+    void Sha256CompressBlocksArmv8(Sha256State *states, const uint8_t *blocks,
+                                   size_t n) {
+      size_t i = 0;
+      for (; i + kSha256Lanes <= n; i += kSha256Lanes) {
+        CompressLanes<kSha256Lanes>(&states[i], blocks + i * kSha256BlockSize);
+      }
+      for (; i < n; i++) {
+        CompressLanes<1>(&states[i], blocks + i * kSha256BlockSize);
+      }
+    }
+}  // namespace exposure
+
+#endif  // defined(__aarch64__)
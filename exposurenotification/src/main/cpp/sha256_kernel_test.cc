@@ -0,0 +1,216 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#include "sha256_kernel.h"
+
+#include <gtest/gtest.h>
+#include <string.h>
+
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "cpu_features.h"
+
+namespace exposure {
+    namespace {
+        typedef void (*CompressFunction)(Sha256State *states, const uint8_t *blocks, size_t n);
+
+        void CompressPortable(Sha256State *states, const uint8_t *blocks, size_t n) {
+          DisableHardwareCryptoForTesting(true);
+          Sha256CompressBlocks(states, blocks, n);
+          DisableHardwareCryptoForTesting(false);
+        }
+
+        // The portable compression, forced whatever the CPU supports, and the
+        // hardware kernel of this architecture if the CPU has it.
+        std::vector<std::pair<std::string, CompressFunction>> Kernels() {
+          std::vector<std::pair<std::string, CompressFunction>> kernels = {
+              {"portable", CompressPortable}};
+          if (CpuHasSha256()) {
+#if defined(__i386__) || defined(__x86_64__)
+            kernels.emplace_back("SHA-NI", Sha256CompressBlocksShaNi);
+#elif defined(__aarch64__)
+            kernels.emplace_back("ARMv8", Sha256CompressBlocksArmv8);
+#endif
+          }
+          return kernels;
+        }
+
+        std::vector<uint8_t> FromHex(const std::string &hex) {
+          std::vector<uint8_t> bytes(hex.size() / 2);
+          for (size_t i = 0; i < bytes.size(); i++) {
+            bytes[i] = static_cast<uint8_t>(std::stoi(hex.substr(2 * i, 2), nullptr, 16));
+          }
+          return bytes;
+        }
+
+        std::vector<uint8_t> Bytes(const std::string &text) {
+          return std::vector<uint8_t>(text.begin(), text.end());
+        }
+
+        std::vector<uint8_t> Range(int first, int end) {
+          std::vector<uint8_t> bytes;
+          for (int i = first; i < end; i++) {
+            bytes.push_back(static_cast<uint8_t>(i));
+          }
+          return bytes;
+        }
+
+        // SHA-256 of message, padded as FIPS 180-4 section 5.1.1 and run one
+        // block at a time through compress.
+        std::vector<uint8_t> Sha256(CompressFunction compress,
+                                    const std::vector<uint8_t> &message) {
+          std::vector<uint8_t> padded(message);
+          padded.push_back(0x80);
+          while (padded.size() % kSha256BlockSize != kSha256BlockSize - 8) {
+            padded.push_back(0);
+          }
+          const uint64_t bit_length = static_cast<uint64_t>(message.size()) * 8;
+          for (int i = 7; i >= 0; i--) {
+            padded.push_back(static_cast<uint8_t>(bit_length >> (8 * i)));
+          }
+          Sha256State state;
+          memcpy(state.h, kSha256InitialState, sizeof(state.h));
+          for (size_t offset = 0; offset < padded.size(); offset += kSha256BlockSize) {
+            compress(&state, &padded[offset], 1);
+          }
+          std::vector<uint8_t> digest(kSha256DigestLength);
+          Sha256StateToBytes(state, digest.data());
+          return digest;
+        }
+
+        std::vector<uint8_t> HmacSha256(CompressFunction compress, std::vector<uint8_t> key,
+                                        const std::vector<uint8_t> &message) {
+          if (key.size() > kSha256BlockSize) {
+            key = Sha256(compress, key);
+          }
+          key.resize(kSha256BlockSize, 0);
+          std::vector<uint8_t> inner(key), outer(key);
+          for (int i = 0; i < kSha256BlockSize; i++) {
+            inner[i] ^= 0x36;
+            outer[i] ^= 0x5c;
+          }
+          inner.insert(inner.end(), message.begin(), message.end());
+          std::vector<uint8_t> inner_digest = Sha256(compress, inner);
+          outer.insert(outer.end(), inner_digest.begin(), inner_digest.end());
+          return Sha256(compress, outer);
+        }
+
+        // RFC 5869 extract then expand; writes the PRK into prk.
+        std::vector<uint8_t> HkdfSha256(CompressFunction compress, const std::vector<uint8_t> &ikm,
+                                        const std::vector<uint8_t> &salt,
+                                        const std::vector<uint8_t> &info, size_t length,
+                                        std::vector<uint8_t> *prk) {
+          *prk = HmacSha256(compress, salt, ikm);
+          std::vector<uint8_t> okm, t;
+          for (uint8_t counter = 1; okm.size() < length; counter++) {
+            std::vector<uint8_t> message(t);
+            message.insert(message.end(), info.begin(), info.end());
+            message.push_back(counter);
+            t = HmacSha256(compress, *prk, message);
+            okm.insert(okm.end(), t.begin(), t.end());
+          }
+          okm.resize(length);
+          return okm;
+        }
+
+        // FIPS 180-4 examples, plus the empty message and the million 'a'
+        // message of the NIST test vectors.
+        TEST(Sha256Kernel, MatchesFips180Vectors) {
+          const std::vector<std::pair<std::vector<uint8_t>, std::string>> vectors = {
+              {Bytes(""), "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"},
+              {Bytes("abc"), "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"},
+              {Bytes("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"),
+               "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"},
+              {Bytes("abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmn"
+                     "hijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu"),
+               "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1"},
+              {std::vector<uint8_t>(1000000, 'a'),
+               "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0"}};
+          for (const auto &kernel : Kernels()) {
+            for (size_t i = 0; i < vectors.size(); i++) {
+              EXPECT_EQ(FromHex(vectors[i].second), Sha256(kernel.second, vectors[i].first))
+                  << kernel.first << " vector " << i;
+            }
+          }
+        }
+
+        // RFC 5869 appendix A.1 to A.3, the SHA-256 cases.
+        TEST(Sha256Kernel, MatchesRfc5869Vectors) {
+          struct HkdfVector {
+              std::vector<uint8_t> ikm, salt, info;
+              std::string prk, okm;
+          };
+          const std::vector<HkdfVector> vectors = {
+              {std::vector<uint8_t>(22, 0x0b), Range(0x00, 0x0d), Range(0xf0, 0xfa),
+               "077709362c2e32df0ddc3f0dc47bba6390b6c73bb50f9c3122ec844ad7c2b3e5",
+               "3cb25f25faacd57a90434f64d0362f2a2d2d0a90cf1a5a4c5db02d56ecc4c5bf"
+               "34007208d5b887185865"},
+              {Range(0x00, 0x50), Range(0x60, 0xb0), Range(0xb0, 0x100),
+               "06a6b88c5853361a06104c9ceb35b45cef760014904671014a193f40c15fc244",
+               "b11e398dc80327a1c8e7f78c596a49344f012eda2d4efad8a050cc4c19afa97c"
+               "59045a99cac7827271cb41c65e590e09da3275600c2f09b8367793a9aca3db71"
+               "cc30c58179ec3e87c14c01d5c1f3434f1d87"},
+              {std::vector<uint8_t>(22, 0x0b), {}, {},
+               "19ef24a32c717b167f33a91d6f648bdf96596776afdb6377ac434c1c293ccb04",
+               "8da4e775a563c18f715f802a063c5a31b8a11f5c5ee1879ec3454e5f3c738d2d"
+               "9d201395faa4b61a96c8"}};
+          for (const auto &kernel : Kernels()) {
+            for (size_t i = 0; i < vectors.size(); i++) {
+              const HkdfVector &vector = vectors[i];
+              std::vector<uint8_t> prk;
+              EXPECT_EQ(FromHex(vector.okm),
+                        HkdfSha256(kernel.second, vector.ikm, vector.salt, vector.info,
+                                   vector.okm.size() / 2, &prk))
+                  << kernel.first << " vector " << i;
+              EXPECT_EQ(FromHex(vector.prk), prk) << kernel.first << " vector " << i;
+            }
+          }
+        }
+
+        // Compressing n independent pairs in one call, for n below, at and
+        // above a multiple of the lane count, equals compressing them one by one
+        // with the portable code.
+        TEST(Sha256Kernel, LanesMatchSingleCompressions) {
+          std::mt19937 random(7);
+          for (const auto &kernel : Kernels()) {
+            for (size_t n = 1; n <= 4 * kSha256Lanes + 1; n++) {
+              std::vector<Sha256State> states(n), expected(n);
+              std::vector<uint8_t> blocks(n * kSha256BlockSize);
+              for (size_t i = 0; i < n; i++) {
+                for (uint32_t &word : states[i].h) {
+                  word = random();
+                }
+              }
+              for (uint8_t &byte : blocks) {
+                byte = static_cast<uint8_t>(random());
+              }
+              expected = states;
+              for (size_t i = 0; i < n; i++) {
+                CompressPortable(&expected[i], &blocks[i * kSha256BlockSize], 1);
+              }
+              kernel.second(states.data(), blocks.data(), n);
+              for (size_t i = 0; i < n; i++) {
+                EXPECT_EQ(0, memcmp(expected[i].h, states[i].h, sizeof(states[i].h)))
+                    << kernel.first << " n " << n << " lane " << i;
+              }
+            }
+          }
+        }
+    }  // namespace
+}  // namespace exposure
@@ -0,0 +1,114 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// SHA extensions kernel. This file is compiled with -msha -msse4.1 (see
+// CMakeLists.txt) and is only entered after CpuHasSha256() confirmed support
+// at runtime.
+
+#include "sha256_kernel.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+
+#include <immintrin.h>
+
+namespace exposure {
+
+    namespace {
+        // Compresses kLanes independent blocks in lockstep. Every step is written
+        // as a loop over the lanes so that the sha256rnds2 chains of different
+        // lanes overlap in the pipeline.
+        template <int kLanes>
+        inline __attribute__((always_inline)) void CompressLanes(
+            Sha256State *states, const uint8_t *blocks) {
+          const __m128i byte_swap_mask =
+              _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+          __m128i abef[kLanes], cdgh[kLanes], abef_save[kLanes], cdgh_save[kLanes];
+          __m128i msg[kLanes][4], tmp[kLanes], wk[kLanes];
+
+          for (int l = 0; l < kLanes; l++) {
+            __m128i dcba = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(&states[l].h[0]));
+            __m128i hgfe = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(&states[l].h[4]));
+            dcba = _mm_shuffle_epi32(dcba, 0xB1);
+            hgfe = _mm_shuffle_epi32(hgfe, 0x1B);
+            abef[l] = _mm_alignr_epi8(dcba, hgfe, 8);
+            cdgh[l] = _mm_blend_epi16(hgfe, dcba, 0xF0);
+            abef_save[l] = abef[l];
+            cdgh_save[l] = cdgh[l];
+            for (int i = 0; i < 4; i++) {
+              msg[l][i] = _mm_shuffle_epi8(
+                  _mm_loadu_si128(reinterpret_cast<const __m128i *>(
+                      blocks + l * kSha256BlockSize + i * 16)),
+                  byte_swap_mask);
+            }
+          }
+
+          // Four rounds per group; the message schedule for group g + 1 is
+          // completed during group g, using the four rotating msg registers.
+          for (int g = 0; g < 16; g++) {
+            const __m128i k = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(&kSha256RoundConstants[g * 4]));
+            for (int l = 0; l < kLanes; l++) {
+              wk[l] = _mm_add_epi32(msg[l][g % 4], k);
+              cdgh[l] = _mm_sha256rnds2_epu32(cdgh[l], abef[l], wk[l]);
+            }
+            if (g >= 3 && g <= 14) {
+              for (int l = 0; l < kLanes; l++) {
+                tmp[l] = _mm_alignr_epi8(msg[l][g % 4], msg[l][(g + 3) % 4], 4);
+                msg[l][(g + 1) % 4] = _mm_add_epi32(msg[l][(g + 1) % 4], tmp[l]);
+                msg[l][(g + 1) % 4] =
+                    _mm_sha256msg2_epu32(msg[l][(g + 1) % 4], msg[l][g % 4]);
+              }
+            }
+            for (int l = 0; l < kLanes; l++) {
+              wk[l] = _mm_shuffle_epi32(wk[l], 0x0E);
+              abef[l] = _mm_sha256rnds2_epu32(abef[l], cdgh[l], wk[l]);
+            }
+            if (g >= 1 && g <= 12) {
+              for (int l = 0; l < kLanes; l++) {
+                msg[l][(g + 3) % 4] =
+                    _mm_sha256msg1_epu32(msg[l][(g + 3) % 4], msg[l][g % 4]);
+              }
+            }
+          }
+
+          for (int l = 0; l < kLanes; l++) {
+            abef[l] = _mm_add_epi32(abef[l], abef_save[l]);
+            cdgh[l] = _mm_add_epi32(cdgh[l], cdgh_save[l]);
+            __m128i feba = _mm_shuffle_epi32(abef[l], 0x1B);
+            __m128i dchg = _mm_shuffle_epi32(cdgh[l], 0xB1);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(&states[l].h[0]),
+                             _mm_blend_epi16(feba, dchg, 0xF0));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(&states[l].h[4]),
+                             _mm_alignr_epi8(dchg, feba, 8));
+          }
+        }
+    }  // namespace
+
+    void Sha256CompressBlocksShaNi(Sha256State *states, const uint8_t *blocks,
+                                   size_t n) {
+      size_t i = 0;
+      for (; i + kSha256Lanes <= n; i += kSha256Lanes) {
+        CompressLanes<kSha256Lanes>(&states[i], blocks + i * kSha256BlockSize);
+      }
+      for (; i < n; i++) {
+        CompressLanes<1>(&states[i], blocks + i * kSha256BlockSize);
+      }
+    }
+}  // namespace exposure
+
+#endif  // defined(__i386__) || defined(__x86_64__)
@@ -620,6 +620,25 @@ public class ContactTracingFeature {
         return true;
     }
 
+    /**
+     * Whether native matching persists the scan ID index it builds and maps it on later runs while
+     * {@link com.google.samples.exposurenotification.storage.ContactRecordDataStore#getGeneration}
+     * is unchanged. The generation is derived from the stored records, so the index is reused
+     * across runs until a record changes.
+     */
+    public static boolean matchingWithPersistedScanIdIndex() {
+        return true;
+    }
+
+    /**
+     * Whether native matching keeps only 64-bit fingerprints of the scan IDs in memory and reads
+     * the full IDs from the mapped index file to confirm a match. Only applies with {@link
+     * #matchingWithPersistedScanIdIndex}.
+     */
+    public static boolean matchingWithCompactScanIdIndex() {
+        return true;
+    }
+
     /**
      * Maximum number of keys that will be passed to native for matching in one native matching call
      */
@@ -627,6 +646,20 @@ public class ContactTracingFeature {
         return 10000;
     }
 
+    /**
+     * Maximum number of threads used by native matching to process key files in parallel.
+     */
+    public static int matchingWithNativeThreadCount() {
+        return Math.min(4, Runtime.getRuntime().availableProcessors());
+    }
+
+    /**
+     * Maximum number of threads used to verify the signatures of key files in parallel.
+     */
+    public static int signatureVerificationThreadCount() {
+        return Math.min(4, Runtime.getRuntime().availableProcessors());
+    }
+
     /**
      * If enabled, will start supporting revocation and change of status for report type.
      */
@@ -24,6 +24,7 @@ import androidx.annotation.Nullable;
 import androidx.annotation.VisibleForTesting;
 
 import com.google.common.collect.ImmutableList;
+import com.google.common.collect.ImmutableListMultimap;
 import com.google.samples.Clock;
 import com.google.samples.Clock.DefaultClock;
 import com.google.samples.Hex;
@@ -56,6 +57,7 @@ import com.google.samples.exposurenotification.storage.TekMetadataRecord;
 
 import org.joda.time.Duration;
 
+import java.io.File;
 import java.io.IOException;
 import java.text.SimpleDateFormat;
 import java.util.ArrayList;
@@ -64,9 +66,11 @@ import java.util.Collections;
 import java.util.Comparator;
 import java.util.HashMap;
 import java.util.Iterator;
+import java.util.LinkedHashSet;
 import java.util.List;
 import java.util.Locale;
 import java.util.Set;
+import java.util.TreeSet;
 
 import static com.google.samples.exposurenotification.ExposureNotificationEnums.Infectiousness.INFECTIOUSNESS_STANDARD;
 import static com.google.samples.exposurenotification.ble.data.RollingProximityIdValidator.getValidWindowEndIntervalNumber;
@@ -101,6 +105,8 @@ public class ExposureMatchingTracer {
 
     static final Comparator<SightingRecordWithMetadata> BY_TIME_ASCENDING =
             (sr1, sr2) -> sr1.sightingRecord().getEpochSeconds() - sr2.sightingRecord().getEpochSeconds();
+    // Scan ID index persisted by the native matcher between matching requests.
+    private static final String SCAN_ID_INDEX_FILE_NAME = "en_scan_id_index";
     private static final SimpleDateFormat dataFormat =
             new SimpleDateFormat("MM-dd HH:mm:ss", Locale.ENGLISH);
 
@@ -208,12 +214,66 @@ public class ExposureMatchingTracer {
         Log.log.atInfo().log("%s Native pre-filter started.", instanceLogTag);
         long startTime = System.currentTimeMillis();
         try (ContactRecordDataStore contactRecordDataStore = ContactRecordDataStore.open(context)) {
-            List<byte[]> idList = contactRecordDataStore.getAllRawIds();
-            try (MatchingJni matchingJni = new MatchingJni(context, idList.toArray(new byte[0][]))) {
+            // Read the generation before the IDs, so that an index written from them is never
+            // newer than its tag says.
+            long generation = contactRecordDataStore.getGeneration();
+            String indexFilePath =
+                    new File(context.getNoBackupFilesDir(), SCAN_ID_INDEX_FILE_NAME).getPath();
+            Pair<DayNumber, DayNumber> dayNumberRange = contactRecordDataStore.getDayNumberRange();
+            int scanStartIntervalNumber =
+                    dayNumberRange == null
+                            ? 0
+                            : TemporaryExposureKeySupport.getRollingStartIntervalNumber(
+                            dayNumberRange.first);
+            int scanEndIntervalNumber =
+                    dayNumberRange == null
+                            ? 0
+                            : TemporaryExposureKeySupport.getRollingStartIntervalNumber(
+                            dayNumberRange.second.getValue() + 1);
+            boolean persistIndex = ContactTracingFeature.matchingWithPersistedScanIdIndex();
+            MatchingJni indexedMatchingJni = null;
+            if (persistIndex) {
+                indexedMatchingJni =
+                        MatchingJni.openIndexFile(
+                                context,
+                                indexFilePath,
+                                generation,
+                                scanStartIntervalNumber,
+                                scanEndIntervalNumber);
+            }
+            if (indexedMatchingJni == null) {
+                indexedMatchingJni =
+                        new MatchingJni(
+                                context,
+                                contactRecordDataStore.getAllScanRecordsDirect(),
+                                scanStartIntervalNumber,
+                                scanEndIntervalNumber);
+                if (persistIndex
+                        && indexedMatchingJni.writeIndexFile(indexFilePath, generation)
+                        && ContactTracingFeature.matchingWithCompactScanIdIndex()) {
+                    // Match against the file just written, so that the full IDs are not held in
+                    // memory for the rest of the run.
+                    MatchingJni mappedMatchingJni =
+                            MatchingJni.openIndexFile(
+                                    context,
+                                    indexFilePath,
+                                    generation,
+                                    scanStartIntervalNumber,
+                                    scanEndIntervalNumber);
+                    if (mappedMatchingJni != null) {
+                        indexedMatchingJni.close();
+                        indexedMatchingJni = mappedMatchingJni;
+                    }
+                }
+            }
+            try (MatchingJni matchingJni = indexedMatchingJni) {
                 Set<TemporaryExposureKey> matchedKeyList;
                 if (ContactTracingFeature.useNativeKeyParser()) {
                     matchedKeyList = matchingJni.matching(matchingRequest.diagnosisKeyFiles());
                     diagnosisKeyCount = matchingJni.getLastProcessedKeyCount();
+                    matchedKeyList =
+                            addPreviouslyMatchedRevisions(
+                                    matchedKeyList, matchingJni.getLastRevisedKeys());
                 } else {
                     try (CloseableIterable<TemporaryExposureKey> temporaryExposureKeys =
                                  matchingRequest.diagnosisKeys()) {
@@ -234,13 +294,51 @@ public class ExposureMatchingTracer {
                                 instanceLogTag,
                                 matchedKeyList.size(),
                                 diagnosisKeyCount,
-                                idList.size(),
+                                matchingJni.getScanIdCount(),
                                 (System.currentTimeMillis() - startTime) / 1000f);
-                return traceWithJava(matchedKeyList);
+                return traceWithJava(
+                        matchedKeyList,
+                        ContactTracingFeature.useNativeKeyParser()
+                                ? matchingJni.getLastMatchedIds()
+                                : ImmutableListMultimap.of());
             }
         }
     }
 
+    /**
+     * Adds to {@code matchedKeys} those of {@code revisedKeys} that matched in an earlier request,
+     * revoked ones included, so that {@link #traceWithJava} updates the report type of their stored
+     * results without matching them again.
+     */
+    private Set<TemporaryExposureKey> addPreviouslyMatchedRevisions(
+            Set<TemporaryExposureKey> matchedKeys, Set<TemporaryExposureKey> revisedKeys)
+            throws StorageException {
+        if (revisedKeys.isEmpty()) {
+            return matchedKeys;
+        }
+        byte[] tokenRoot =
+                ExposureResultStorage.encodeTokenRoot(
+                        matchingRequest.packageName(),
+                        matchingRequest.signatureHash(),
+                        matchingRequest.token());
+        Set<TemporaryExposureKey> keys = new LinkedHashSet<>(matchedKeys);
+        int previouslyMatchedCount = 0;
+        try (ExposureResultStorage exposureResultStore = ExposureResultStorage.open(context)) {
+            for (TemporaryExposureKey revisedKey : revisedKeys) {
+                if (exposureResultStore.hasResult(tokenRoot, revisedKey.getKeyData())) {
+                    keys.add(revisedKey);
+                    previouslyMatchedCount++;
+                }
+            }
+        }
+        Log.log
+                .atInfo()
+                .log(
+                        "%s %d of %d revised keys matched in an earlier request.",
+                        instanceLogTag, previouslyMatchedCount, revisedKeys.size());
+        return keys;
+    }
+
     private boolean traceWithPreFilter() {
         Log.log.atInfo().log("%s Java pre-filter started.", instanceLogTag);
         try (ContactRecordDataStore contactRecordDataStore = ContactRecordDataStore.open(context);
@@ -298,9 +396,21 @@ public class ExposureMatchingTracer {
         return false;
     }
 
-    @SuppressLint("WrongConstant")
     private boolean traceWithJava(Iterable<TemporaryExposureKey> diagnosisKeys)
             throws StorageException, CryptoException {
+        return traceWithJava(diagnosisKeys, ImmutableListMultimap.of());
+    }
+
+    /**
+     * Same as {@link #traceWithJava(Iterable)}, deriving and looking up only the RPIs in {@code
+     * nativeMatchedIds} for the keys the native matcher found sightings of, instead of all their
+     * RPIs.
+     */
+    @SuppressLint("WrongConstant")
+    private boolean traceWithJava(
+            Iterable<TemporaryExposureKey> diagnosisKeys,
+            ImmutableListMultimap<TemporaryExposureKey, MatchingJni.MatchedId> nativeMatchedIds)
+            throws StorageException, CryptoException {
         Log.log.atInfo().log("%s Java tracing started.", instanceLogTag);
         if (ContactTracingFeature.moreLogForMatching()) {
             int keyCount = 0;
@@ -418,19 +528,23 @@ public class ExposureMatchingTracer {
                     }
                 }
 
-                // Generates all possibly valid RPIs for this key.
+                RollingProximityIdGenerator idGenerator =
+                        idGeneratorFactory.getInstance(
+                                aesEcbEncryptor,
+                                diagnosisKey.getKeyData(),
+                                diagnosisKey.getRollingStartIntervalNumber(),
+                                TemporaryExposureKeySupport.getMaxPossibleRollingEndIntervalNumber(
+                                        diagnosisKey),
+                                (int) ContactTracingFeature.rollingProximityIdKeySizeBytes(),
+                                ContactTracingFeature.rpikHkdfInfoString(),
+                                ContactTracingFeature.rpidAesPaddedString());
+                List<MatchingJni.MatchedId> matchedIds = nativeMatchedIds.get(diagnosisKey);
+                // Generates all possibly valid RPIs for this key, or only those the native matcher
+                // sighted, as no other can have a sighting.
                 List<GeneratedRollingProximityId> rollingProximityIds =
-                        idGeneratorFactory
-                                .getInstance(
-                                        aesEcbEncryptor,
-                                        diagnosisKey.getKeyData(),
-                                        diagnosisKey.getRollingStartIntervalNumber(),
-                                        TemporaryExposureKeySupport.getMaxPossibleRollingEndIntervalNumber(
-                                                diagnosisKey),
-                                        (int) ContactTracingFeature.rollingProximityIdKeySizeBytes(),
-                                        ContactTracingFeature.rpikHkdfInfoString(),
-                                        ContactTracingFeature.rpidAesPaddedString())
-                                .generateIds(reusedEncryptedOutput);
+                        matchedIds.isEmpty()
+                                ? idGenerator.generateIds(reusedEncryptedOutput)
+                                : generateSightedIds(idGenerator, diagnosisKey, matchedIds);
 
                 TemporaryExposureKey diagnosisKeyIgnoringRollingPeriod =
                         new TemporaryExposureKey.TemporaryExposureKeyBuilder()
@@ -469,7 +583,7 @@ public class ExposureMatchingTracer {
                                 metadataGeneratorFactory,
                                 contactRecordDataStore,
                                 contactRecordLookUpTable,
-                                rollingProximityIds.subList(0, diagnosisKey.getRollingPeriod()),
+                                getIdsInRollingPeriod(rollingProximityIds, diagnosisKey),
                                 diagnosisKey,
                                 /*aggregateSightings=*/ false);
 
@@ -481,7 +595,7 @@ public class ExposureMatchingTracer {
                                     metadataGeneratorFactory,
                                     contactRecordDataStore,
                                     contactRecordLookUpTable,
-                                    rollingProximityIds.subList(0, diagnosisKey.getRollingPeriod()),
+                                    getIdsInRollingPeriod(rollingProximityIds, diagnosisKey),
                                     diagnosisKey,
                                     /*aggregateSightings=*/ ContactTracingFeature.aggregateSightingsFromSingleScan());
                 } else {
@@ -530,6 +644,43 @@ public class ExposureMatchingTracer {
         return foundMatches;
     }
 
+    /**
+     * Returns the RPIs of {@code diagnosisKey} at the interval offsets of {@code matchedIds}, in
+     * interval order.
+     */
+    private static List<GeneratedRollingProximityId> generateSightedIds(
+            RollingProximityIdGenerator idGenerator,
+            TemporaryExposureKey diagnosisKey,
+            List<MatchingJni.MatchedId> matchedIds)
+            throws CryptoException {
+        TreeSet<Integer> intervalOffsets = new TreeSet<>();
+        for (MatchingJni.MatchedId matchedId : matchedIds) {
+            intervalOffsets.add(matchedId.intervalOffset);
+        }
+        List<GeneratedRollingProximityId> rollingProximityIds = new ArrayList<>();
+        for (int intervalOffset : intervalOffsets) {
+            int intervalNumber = diagnosisKey.getRollingStartIntervalNumber() + intervalOffset;
+            rollingProximityIds.add(
+                    GeneratedRollingProximityId.create(
+                            idGenerator.generateId(intervalNumber), intervalNumber));
+        }
+        return rollingProximityIds;
+    }
+
+    /** Returns those of {@code rollingProximityIds} within the rolling period of the key. */
+    private static List<GeneratedRollingProximityId> getIdsInRollingPeriod(
+            List<GeneratedRollingProximityId> rollingProximityIds, TemporaryExposureKey diagnosisKey) {
+        int rollingEndIntervalNumber =
+                diagnosisKey.getRollingStartIntervalNumber() + diagnosisKey.getRollingPeriod();
+        List<GeneratedRollingProximityId> idsInRollingPeriod = new ArrayList<>();
+        for (GeneratedRollingProximityId rollingProximityId : rollingProximityIds) {
+            if (rollingProximityId.intervalNumber() < rollingEndIntervalNumber) {
+                idsInRollingPeriod.add(rollingProximityId);
+            }
+        }
+        return idsInRollingPeriod;
+    }
+
     @VisibleForTesting
     static boolean storeValidReportTransition(
             ExposureResultStorage exposureResultStore,
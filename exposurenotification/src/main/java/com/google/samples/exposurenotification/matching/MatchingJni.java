@@ -18,14 +18,20 @@ package com.google.samples.exposurenotification.matching;
 
 import android.content.Context;
 import android.util.Pair;
+import androidx.annotation.Nullable;
+import com.google.common.base.Preconditions;
+import com.google.common.collect.ImmutableListMultimap;
 import com.google.common.collect.ImmutableSet;
 import com.google.protobuf.InvalidProtocolBufferException;
 import com.google.samples.exposurenotification.ExposureKeyExportProto;
 import com.google.samples.exposurenotification.Log;
+import com.google.samples.exposurenotification.data.DayNumber;
+import com.google.samples.exposurenotification.data.RollingProximityId;
 import com.google.samples.exposurenotification.nearby.TemporaryExposureKey;
 import com.google.samples.exposurenotification.data.fileformat.TemporaryExposureKeyConverter;
 import com.google.samples.exposurenotification.features.ContactTracingFeature;
 
+import java.nio.ByteBuffer;
 import java.util.HashSet;
 import java.util.List;
 import java.util.Set;
@@ -33,27 +39,136 @@ import java.util.Set;
 /** Implements generate id and key matching under native code. */
 public class MatchingJni implements AutoCloseable {
 
-    private static native long initNative(byte[][] bleScanResults);
+    /**
+     * Creates the native matcher. Only RPIs of intervals that fall into a key's rolling period
+     * plus {@code driftToleranceIntervals}, and that can have been sighted within {@code
+     * [scanStartIntervalNumber, scanEndIntervalNumber)}, are derived and looked up.
+     */
+    private static native long initNative(
+            byte[][] bleScanResults,
+            int scanStartIntervalNumber,
+            int scanEndIntervalNumber,
+            int driftToleranceIntervals);
+
+    /**
+     * Same as {@link #initNative} for the first {@code scanIdCount} scan records of a direct
+     * buffer, {@link #SCAN_RECORD_LENGTH} bytes each. An ID of a diagnosis key only matches scan
+     * IDs sighted within {@code driftToleranceIntervals} of its interval.
+     */
+    private static native long initDirectNative(
+            ByteBuffer scanRecords,
+            int scanIdCount,
+            int scanStartIntervalNumber,
+            int scanEndIntervalNumber,
+            int driftToleranceIntervals);
+
+    /**
+     * Same as {@link #initNative} over an index file written by {@link #writeIndexFileNative},
+     * which is mapped instead of being rebuilt. Returns 0 if the file is missing, malformed or of a
+     * generation other than {@code generation}.
+     */
+    private static native long initIndexFileNative(
+            String indexFilePath,
+            long generation,
+            int scanStartIntervalNumber,
+            int scanEndIntervalNumber,
+            int driftToleranceIntervals,
+            boolean compact);
+
+    /** Persists the scan ID index of {@code nativePtr}, tagged with {@code generation}. */
+    private static native boolean writeIndexFileNative(
+            long nativePtr, String indexFilePath, long generation);
 
     /**
      * Returns the {@link ExposureKeyExportProto.TemporaryExposureKey} array. Each element is the a
      * serialized byte array and can be converted by {@link
-     * ExposureKeyExportProto.TemporaryExposureKey#parseFrom(byte[])}
+     * ExposureKeyExportProto.TemporaryExposureKey#parseFrom(byte[])}. Key files are matched on at
+     * most {@code threadCount} threads; the order of the result does not depend on it. A key file
+     * may also be a diagnosis key zip archive, whose export.bin is inflated as it is read.
+     *
+     * <p>With {@code applyRevisedKeys}, a key that has a revision among the {@code revised_keys}
+     * of the key files is matched as that revision, and dropped without deriving its RPIs if the
+     * revision is {@code REVOKED}: the revisions of all key files are read before any key is
+     * matched. Revisions of keys that are not in the key files are matched on their own.
      */
-    private static native byte[][] matchingNative(long nativePtr, String[] keyFiles);
+    private static native byte[][] matchingNative(
+            long nativePtr, String[] keyFiles, int threadCount, boolean applyRevisedKeys);
 
     private static native int[] matchingLegacyNative(
             long nativePtr, byte[][] tempKeys, int[] rollingStartIntervalNumber, int currentKeyIndex);
 
     /**
-     * Returns the processed key count which are filtered by invoking {@link #matchingNative}. If the
-     * {@code nativePtr} is invalid, returns -1.
+     * Returns the processed key count which are filtered by invoking {@link #matchingNative}, the
+     * keys of the key files without their revisions. If the {@code nativePtr} is invalid, returns
+     * -1.
      */
     private static native int lastProcessedKeyCountNative(long nativePtr);
 
+    /**
+     * Returns, for each key returned by the last {@link #matchingNative} call and in the same order,
+     * the flattened (interval offset, scan record index) pairs of all its sighted RPIs. Returns null
+     * if no key matched.
+     */
+    private static native int[][] lastMatchReportsNative(long nativePtr);
+
+    /**
+     * Returns every revision applied by the last {@link #matchingNative} call, revoked keys
+     * included, as serialized {@link ExposureKeyExportProto.TemporaryExposureKey}s. Returns null
+     * if there were none.
+     */
+    private static native byte[][] lastRevisedKeysNative(long nativePtr);
+
+    /** Returns the number of scan IDs matched against, or -1 if {@code nativePtr} is invalid. */
+    private static native int scanIdCountNative(long nativePtr);
+
     private static native void releaseNative(long nativePtr);
 
+    /**
+     * Reads each key file once to check its signatures, see {@link #verifyKeyFiles}. Returns
+     * whether each check verified, or null if a key file could not be read or is malformed.
+     */
+    @Nullable
+    private static native boolean[] verifyKeyFilesNative(
+            String[] keyFiles,
+            int[] checkCounts,
+            byte[][] publicKeys,
+            int[] digestAlgorithms,
+            byte[][] signatures,
+            byte[][] metadataOut,
+            @Nullable byte[] keyFilesHashOut,
+            int threadCount);
+
+    /** An RPI of a matched key that is equal to one of the scan records given to the matcher. */
+    public static final class MatchedId {
+        /** Interval of the RPI, relative to the key's rolling start interval number. */
+        public final int intervalOffset;
+        /** Index of the scan record among the scan IDs given to the constructor. */
+        public final int scanRecordIndex;
+
+        MatchedId(int intervalOffset, int scanRecordIndex) {
+            this.intervalOffset = intervalOffset;
+            this.scanRecordIndex = scanRecordIndex;
+        }
+    }
+
+    /** Length in bytes of one scan ID in a packed buffer. */
+    public static final int SCAN_ID_LENGTH = RollingProximityId.MIN_ID.length;
+
+    /**
+     * Length in bytes of one scan record in a packed buffer: a {@link DayNumber} and a scan ID, then
+     * the first and last interval of that day the ID was sighted in.
+     */
+    public static final int SCAN_RECORD_LENGTH = DayNumber.getSizeBytes() + SCAN_ID_LENGTH + 2;
+
+    /** Digest of a signature check passed to {@link #verifyKeyFiles}, ECDSA with SHA-256. */
+    public static final int DIGEST_SHA256 = 1;
+    /** Digest of a signature check passed to {@link #verifyKeyFiles}, ECDSA with SHA-512. */
+    public static final int DIGEST_SHA512 = 2;
+
     private final long nativePtr;
+    private ImmutableListMultimap<TemporaryExposureKey, MatchedId> lastMatchedIds =
+            ImmutableListMultimap.of();
+    private ImmutableSet<TemporaryExposureKey> lastRevisedKeys = ImmutableSet.of();
 
     public static boolean loadNativeLibrary(Context context) {
         System.loadLibrary("matching");
@@ -61,36 +176,176 @@ public class MatchingJni implements AutoCloseable {
     }
 
     public MatchingJni(Context context, byte[][] bleScanResults) {
+        this(context, bleScanResults, 0, Integer.MAX_VALUE);
+    }
+
+    /**
+     * Creates a matcher for scan records that were all sighted within the interval numbers
+     * {@code [scanStartIntervalNumber, scanEndIntervalNumber)}.
+     */
+    public MatchingJni(
+            Context context,
+            byte[][] bleScanResults,
+            int scanStartIntervalNumber,
+            int scanEndIntervalNumber) {
+        loadNativeLibrary(context);
+        this.nativePtr =
+                initNative(
+                        bleScanResults,
+                        scanStartIntervalNumber,
+                        scanEndIntervalNumber,
+                        ContactTracingFeature.tkMatchingClockDriftRollingPeriods());
+        Log.log.atInfo().log("MatchingJni get native ptr %d", nativePtr);
+    }
+
+    /**
+     * Creates a matcher over the scan records, as returned by {@link
+     * com.google.samples.exposurenotification.storage.ContactRecordDataStore#getAllScanRecordsDirect},
+     * packed back to back between the position and the limit of the direct buffer {@code
+     * scanRecords}. Scan record indexes are positions of the records in the buffer.
+     */
+    public MatchingJni(
+            Context context,
+            ByteBuffer scanRecords,
+            int scanStartIntervalNumber,
+            int scanEndIntervalNumber) {
         loadNativeLibrary(context);
-        this.nativePtr = initNative(bleScanResults);
+        Preconditions.checkArgument(scanRecords.isDirect(), "Scan records must be in a direct buffer");
+        this.nativePtr =
+                initDirectNative(
+                        scanRecords.slice(),
+                        scanRecords.remaining() / SCAN_RECORD_LENGTH,
+                        scanStartIntervalNumber,
+                        scanEndIntervalNumber,
+                        ContactTracingFeature.tkMatchingClockDriftRollingPeriods());
+        Log.log.atInfo().log("MatchingJni get native ptr %d", nativePtr);
+    }
+
+    private MatchingJni(long nativePtr) {
+        this.nativePtr = nativePtr;
         Log.log.atInfo().log("MatchingJni get native ptr %d", nativePtr);
     }
 
+    /**
+     * Opens a matcher over the index file written by {@link #writeIndexFile} for the scan store
+     * {@code generation}, or returns null if there is no such file. The index is mapped rather than
+     * rebuilt, and scan record indexes refer to the scan IDs it was built from. With {@link
+     * ContactTracingFeature#matchingWithCompactScanIdIndex} only 64-bit fingerprints of the scan IDs
+     * are kept in memory, and the full IDs are read from the file to confirm a match.
+     */
+    @Nullable
+    public static MatchingJni openIndexFile(
+            Context context,
+            String indexFilePath,
+            long generation,
+            int scanStartIntervalNumber,
+            int scanEndIntervalNumber) {
+        loadNativeLibrary(context);
+        long nativePtr =
+                initIndexFileNative(
+                        indexFilePath,
+                        generation,
+                        scanStartIntervalNumber,
+                        scanEndIntervalNumber,
+                        ContactTracingFeature.tkMatchingClockDriftRollingPeriods(),
+                        ContactTracingFeature.matchingWithCompactScanIdIndex());
+        return nativePtr == 0 ? null : new MatchingJni(nativePtr);
+    }
+
+    /**
+     * Persists the scan ID index for {@link #openIndexFile}, tagged with the scan store {@code
+     * generation} the scan IDs were read at. Returns false if the file could not be written.
+     */
+    public boolean writeIndexFile(String indexFilePath, long generation) {
+        return writeIndexFileNative(nativePtr, indexFilePath, generation);
+    }
+
+    public int getScanIdCount() {
+        return scanIdCountNative(nativePtr);
+    }
+
     public ImmutableSet<TemporaryExposureKey> matching(List<String> keyFiles) {
-        byte[][] protoArray = matchingNative(nativePtr, keyFiles.toArray(new String[0]));
+        byte[][] protoArray =
+                matchingNative(
+                        nativePtr,
+                        keyFiles.toArray(new String[0]),
+                        ContactTracingFeature.matchingWithNativeThreadCount(),
+                        ContactTracingFeature.supportRevocationAndChangeStatusReportType());
+        lastRevisedKeys = convertKeys(lastRevisedKeysNative(nativePtr));
         if (protoArray == null) {
             Log.log.atInfo().log("MatchingJni get nullable key set from native.");
+            lastMatchedIds = ImmutableListMultimap.of();
             return ImmutableSet.of();
         }
 
+        int[][] matchReports = lastMatchReportsNative(nativePtr);
         ImmutableSet.Builder<TemporaryExposureKey> keySet = new ImmutableSet.Builder<>();
-        for (byte[] proto : protoArray) {
-            try {
-                ExposureKeyExportProto.TemporaryExposureKey key =
-                        ExposureKeyExportProto.TemporaryExposureKey.parseFrom(proto);
-                TemporaryExposureKey convertedKey = new TemporaryExposureKeyConverter().convert(key);
-                if (convertedKey == null) {
-                    Log.log.atWarning().log("MatchingJni failed to convert the proto key.");
-                    continue;
+        ImmutableListMultimap.Builder<TemporaryExposureKey, MatchedId> matchedIds =
+                ImmutableListMultimap.builder();
+        for (int i = 0; i < protoArray.length; i++) {
+            TemporaryExposureKey convertedKey = convertKey(protoArray[i]);
+            if (convertedKey == null) {
+                continue;
+            }
+            keySet.add(convertedKey);
+            if (matchReports != null && i < matchReports.length) {
+                int[] matchReport = matchReports[i];
+                for (int j = 0; j + 1 < matchReport.length; j += 2) {
+                    matchedIds.put(convertedKey, new MatchedId(matchReport[j], matchReport[j + 1]));
                 }
+            }
+        }
+        lastMatchedIds = matchedIds.build();
+        return keySet.build();
+    }
+
+    /**
+     * Returns the revisions, from the {@code revised_keys} of the key files, that the last {@link
+     * #matching} call applied, revoked keys included. Revoked keys are never returned by {@link
+     * #matching}, so callers use these to update the report type of keys matched by earlier calls.
+     */
+    public ImmutableSet<TemporaryExposureKey> getLastRevisedKeys() {
+        return lastRevisedKeys;
+    }
+
+    private static ImmutableSet<TemporaryExposureKey> convertKeys(@Nullable byte[][] protoArray) {
+        if (protoArray == null) {
+            return ImmutableSet.of();
+        }
+        ImmutableSet.Builder<TemporaryExposureKey> keySet = new ImmutableSet.Builder<>();
+        for (byte[] proto : protoArray) {
+            TemporaryExposureKey convertedKey = convertKey(proto);
+            if (convertedKey != null) {
                 keySet.add(convertedKey);
-            } catch (InvalidProtocolBufferException e) {
-                Log.log.atWarning().withCause(e).log("MatchingJni failed to parse the proto byte.");
             }
         }
         return keySet.build();
     }
 
+    @Nullable
+    private static TemporaryExposureKey convertKey(byte[] proto) {
+        try {
+            ExposureKeyExportProto.TemporaryExposureKey key =
+                    ExposureKeyExportProto.TemporaryExposureKey.parseFrom(proto);
+            TemporaryExposureKey convertedKey = new TemporaryExposureKeyConverter().convert(key);
+            if (convertedKey == null) {
+                Log.log.atWarning().log("MatchingJni failed to convert the proto key.");
+            }
+            return convertedKey;
+        } catch (InvalidProtocolBufferException e) {
+            Log.log.atWarning().withCause(e).log("MatchingJni failed to parse the proto byte.");
+            return null;
+        }
+    }
+
+    /**
+     * Returns the sighted RPIs of every key returned by the last {@link #matching} call, so that
+     * callers can look up the sightings directly instead of deriving and probing all RPIs again.
+     */
+    public ImmutableListMultimap<TemporaryExposureKey, MatchedId> getLastMatchedIds() {
+        return lastMatchedIds;
+    }
+
     public Pair<Integer, Set<TemporaryExposureKey>> matchingLegacy(
             Iterable<TemporaryExposureKey> temporaryExposureKeys) {
         int matchingWithNativeBufferKeySize =
@@ -143,6 +398,39 @@ public class MatchingJni implements AutoCloseable {
         }
     }
 
+    /**
+     * Checks ECDSA signatures against {@code keyFiles}, which may also be diagnosis key zip
+     * archives, reading each of them only once. Key file {@code i} is checked against the next
+     * {@code checkCounts[i]} entries of {@code publicKeys}, X.509 encoded, {@code
+     * digestAlgorithms}, {@link #DIGEST_SHA256} or {@link #DIGEST_SHA512}, and {@code signatures},
+     * DER encoded. Stores into {@code metadataOut[i]} the {@link
+     * ExposureKeyExportProto.TemporaryExposureKeyExport} of key file {@code i} without its keys,
+     * serialized, and into {@code keyFilesHashOut}, unless it is null, the SHA-256 of all key files
+     * in order. Key files are verified on at most {@link
+     * ContactTracingFeature#signatureVerificationThreadCount} threads.
+     *
+     * @return whether each check verified, or null if a key file could not be read or is malformed
+     */
+    @Nullable
+    static boolean[] verifyKeyFiles(
+            String[] keyFiles,
+            int[] checkCounts,
+            byte[][] publicKeys,
+            int[] digestAlgorithms,
+            byte[][] signatures,
+            byte[][] metadataOut,
+            @Nullable byte[] keyFilesHashOut) {
+        return verifyKeyFilesNative(
+                keyFiles,
+                checkCounts,
+                publicKeys,
+                digestAlgorithms,
+                signatures,
+                metadataOut,
+                keyFilesHashOut,
+                ContactTracingFeature.signatureVerificationThreadCount());
+    }
+
     public int getLastProcessedKeyCount() {
         return lastProcessedKeyCountNative(nativePtr);
     }
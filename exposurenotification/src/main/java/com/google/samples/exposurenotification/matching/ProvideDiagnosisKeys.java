@@ -24,14 +24,13 @@ import com.google.samples.exposurenotification.ExposureKeyExportProto.TEKSignatu
 import com.google.samples.exposurenotification.features.ContactTracingFeature;
 
 import java.io.File;
-import java.io.FileInputStream;
-import java.io.FileOutputStream;
 import java.io.IOException;
 import java.io.InputStream;
 import java.util.ArrayList;
+import java.util.Enumeration;
 import java.util.zip.ZipEntry;
 import java.util.zip.ZipException;
-import java.util.zip.ZipInputStream;
+import java.util.zip.ZipFile;
 
 /**
  * This class is a heavily modified version of the original code which accepts a list of signed
@@ -55,6 +54,8 @@ public class ProvideDiagnosisKeys {
         KeyFileSignature keyFileSignature = unzip(context, signedKeyFile);
         ArrayList<KeyFileSignature> signatures = Lists.newArrayList(keyFileSignature);
 
+        // The files are verified natively.
+        MatchingJni.loadNativeLibrary(context);
         SignatureVerifier signatureVerifier = new SignatureVerifier();
         try {
             return signatureVerifier.verify(callingPackage, signatures);
@@ -64,78 +65,53 @@ public class ProvideDiagnosisKeys {
     }
 
     /**
-     * Unzips a diagnosis keys zip file into an internal folder to allow for
-     * verification of the signature and processing of the keys by {@link MatchingJni}
+     * Reads the signatures of a diagnosis keys zip file and checks that it holds exactly the
+     * expected entries, to allow for verification of the signature by {@link SignatureVerifier}.
      * <p>
-     * FIXME: This code is NOT threadsafe and is incomplete as it exists. Key files are extracted
-     * to a folder and those keys + signatures are not cleaned up here (or anywhere else in the
-     * provided snippets). After matching occurs, these files should be removed by whatever
-     * system is running the key matching process.
+     * Nothing is extracted: export.bin stays in the archive, and is inflated as it is read when
+     * the archive itself is passed to {@link MatchingJni#verifyKeyFiles} or {@link
+     * MatchingJni#matching}.
      *
      * @param context           The context to use
      * @param diagnosisKeysFile The zip file
      * @return A {@link KeyFileSignature} that can be verified by {@link SignatureVerifier}
      */
     static KeyFileSignature unzip(Context context, File diagnosisKeysFile) {
-        File targetFolder = new File(context.getFilesDir(), "en_diagnosis_keys");
-        if (!targetFolder.mkdirs()) {
-            throw new RuntimeException("Can't create folder for keys");
-        }
-
-        ArrayList<KeyFileSignature> results = new ArrayList<>();
-        byte[] buffer = new byte[2048];
         TEKSignatureList signatureList = null;
-        File keyFile = null;
-
-        try {
-            // We use a ZipInputStream, rather than a ZipFile, to minimize the memory footprint.
-            ZipInputStream zipStream = new ZipInputStream(new FileInputStream(diagnosisKeysFile));
+        boolean hasKeyFile = false;
 
-            ZipEntry entry;
-            while ((entry = zipStream.getNextEntry()) != null) {
+        // A ZipFile reads the central directory, so export.bin is not inflated here.
+        try (ZipFile zipFile = new ZipFile(diagnosisKeysFile)) {
+            Enumeration<? extends ZipEntry> entries = zipFile.entries();
+            while (entries.hasMoreElements()) {
+                ZipEntry entry = entries.nextElement();
                 String entryName = getValidatedName(entry);
                 if (entryName.equals(ContactTracingFeature.diagnosisKeySignatureFileName())) {
                     if (signatureList != null) {
-                        deleteFile(targetFolder);
                         throw new IllegalStateException("Archive contains multiple " + entryName);
                     }
-                    signatureList =
-                            TEKSignatureList.parseFrom(zipStream);
+                    try (InputStream signatureStream = zipFile.getInputStream(entry)) {
+                        signatureList = TEKSignatureList.parseFrom(signatureStream);
+                    }
                 } else if (entryName.equals(ContactTracingFeature.diagnosisKeyBinFileName())) {
-                    if (keyFile != null) {
-                        deleteFile(targetFolder);
+                    if (hasKeyFile) {
                         throw new IllegalStateException("Archive contains multiple " + entryName);
                     }
-                    keyFile = new File(targetFolder, "export.bin");
-
-                    if (!keyFile.createNewFile()) {
-                        deleteFile(targetFolder);
-                        throw new RuntimeException(
-                                "Can't create file " + keyFile.getAbsolutePath());
-                    }
-                    try (FileOutputStream output = new FileOutputStream(keyFile.getAbsolutePath())) {
-                        int len;
-                        while ((len = zipStream.read(buffer)) > 0) {
-                            output.write(buffer, 0, len);
-                        }
-                    }
+                    hasKeyFile = true;
                 } else {
-                    deleteFile(targetFolder);
                     throw new IllegalStateException("Invalid key file entry " + entryName);
                 }
             }
         } catch (IOException e) {
-            deleteFile(targetFolder);
-            throw new RuntimeException("Failed to extract diagnosis keys from " +
+            throw new RuntimeException("Failed to read diagnosis keys from " +
                     diagnosisKeysFile.getAbsolutePath(), e);
         }
 
-        if (keyFile == null || signatureList == null) {
-            deleteFile(targetFolder);
+        if (!hasKeyFile || signatureList == null) {
             throw new RuntimeException("Invalid file content: " +
                     diagnosisKeysFile.getAbsolutePath());
         }
-        return KeyFileSignature.create(keyFile, signatureList);
+        return KeyFileSignature.create(diagnosisKeysFile, signatureList);
     }
 
     /**
@@ -162,29 +138,16 @@ public class ProvideDiagnosisKeys {
         return name;
     }
 
-    private static boolean deleteFile(File file) {
-        if (file.isDirectory()) {
-            File[] children = file.listFiles();
-            if (children != null) {
-                for (File child : children) {
-                    deleteFile(child);
-                }
-            }
-        }
-
-        return file.delete();
-    }
-
     @AutoValue
     abstract static class KeyFileSignature implements SignatureVerifier.KeyExport {
-        static KeyFileSignature create(File keyFile, TEKSignatureList signatureList) {
-            return new AutoValue_ProvideDiagnosisKeys_KeyFileSignature(keyFile, signatureList);
+        static KeyFileSignature create(File archiveFile, TEKSignatureList signatureList) {
+            return new AutoValue_ProvideDiagnosisKeys_KeyFileSignature(archiveFile, signatureList);
         }
 
         /**
-         * The file of the diagnosis keys.
+         * The zip file holding the diagnosis keys.
          */
-        abstract File keyFile();
+        abstract File archiveFile();
 
         /**
          * The signature list that was read from export.sig file.
@@ -193,8 +156,8 @@ public class ProvideDiagnosisKeys {
         public abstract TEKSignatureList signatureList();
 
         @Override
-        public InputStream openKeyInputStream() throws IOException {
-            return new FileInputStream(keyFile());
+        public String keyFilePath() {
+            return archiveFile().getAbsolutePath();
         }
     }
 }
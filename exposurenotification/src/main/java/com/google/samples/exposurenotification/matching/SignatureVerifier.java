@@ -37,15 +37,9 @@ import com.google.samples.exposurenotification.matching.ProvideDiagnosisKeys.Key
 
 import java.io.File;
 import java.io.IOException;
-import java.io.InputStream;
-import java.io.PipedInputStream;
-import java.io.PipedOutputStream;
-import java.security.InvalidKeyException;
 import java.security.KeyFactory;
-import java.security.MessageDigest;
 import java.security.NoSuchAlgorithmException;
 import java.security.PublicKey;
-import java.security.Signature;
 import java.security.SignatureException;
 import java.security.spec.InvalidKeySpecException;
 import java.security.spec.X509EncodedKeySpec;
@@ -55,14 +49,10 @@ import java.util.HashMap;
 import java.util.HashSet;
 import java.util.List;
 import java.util.Map;
-import java.util.concurrent.ExecutionException;
-import java.util.concurrent.ExecutorService;
-import java.util.concurrent.Executors;
-import java.util.concurrent.Future;
 
 /**
- * Verified signatures of diagnosis key files, given a raw input stream to the file, and a metadata
- * proto object.
+ * Verified signatures of diagnosis key files, given the path of the file, and a metadata proto
+ * object. The files are read natively by {@link MatchingJni#verifyKeyFiles}.
  */
 public class SignatureVerifier {
 
@@ -77,25 +67,26 @@ public class SignatureVerifier {
         TEKSignatureList signatureList();
 
         /**
-         * Opens input stream for diagnosis key file. Caller of this method is responsible for closing
-         * it.
+         * Path of the diagnosis key file, or of the zip archive holding it as export.bin.
          */
-        InputStream openKeyInputStream() throws IOException;
+        String keyFilePath();
     }
 
     public static final String KEY_VERSION_JOINER = "-";
 
-    // map of supported signature algorithms - add as necessary
-    private static final ImmutableMap<String, String> OID_TO_NAME_MAP =
+    // map of supported signature algorithms, all ECDSA, to their digest - add as necessary
+    private static final ImmutableMap<String, Integer> OID_TO_DIGEST_MAP =
             ImmutableMap.of(
-                    "1.2.840.10045.4.3.2", "SHA256withECDSA",
-                    "1.2.840.10045.4.3.4", "SHA512withECDSA");
+                    "1.2.840.10045.4.3.2", MatchingJni.DIGEST_SHA256,
+                    "1.2.840.10045.4.3.4", MatchingJni.DIGEST_SHA512);
 
-    private static final int STREAMING_BYTE_BUFFER_SIZE = 4096;
+    private static final int SHA256_DIGEST_LENGTH = 32;
 
     @Nullable
     private byte[] keyFilesHash;
     @Nullable
+    private ImmutableList<TemporaryExposureKeyExport> keyMetadataList;
+    @Nullable
     private String debugPublicKey;
 
     /**
@@ -110,8 +101,7 @@ public class SignatureVerifier {
      * @return {@code true} if the files were properly signed, {@code false} otherwise
      */
     public boolean verify(String callingPackage, List<? extends KeyExport> exports)
-            throws NoSuchAlgorithmException, InvalidKeySpecException, IOException, InvalidKeyException,
-            SignatureException, ExecutionException, InterruptedException {
+            throws NoSuchAlgorithmException, InvalidKeySpecException, IOException, SignatureException {
         Preconditions.checkArgument(!exports.isEmpty());
 
         // all chunks in batch must be present to verify
@@ -130,10 +120,12 @@ public class SignatureVerifier {
             throw new SignatureException("no public key found for package " + callingPackage);
         }
 
-        ExecutorService executor = Executors.newSingleThreadExecutor();
-        MessageDigest keyHash = MessageDigest.getInstance("SHA-256");
-
-        for (KeyExport export : exports) {
+        SignatureChecks signatureChecks = new SignatureChecks();
+        String[] keyFiles = new String[exports.size()];
+        int[] checkCounts = new int[exports.size()];
+        List<List<Verification>> exportVerifications = new ArrayList<>(exports.size());
+        for (int i = 0; i < exports.size(); i++) {
+            KeyExport export = exports.get(i);
             TEKSignatureList tekSignatures = export.signatureList();
             if (tekSignatures.getSignaturesCount() == 0) {
                 throw new SignatureException("data is unsigned");
@@ -142,52 +134,52 @@ public class SignatureVerifier {
             // create list of verifications for each rotation. only one verification within the rotation
             // has to verify successfully. within each cosigned set, all keys must verify successfully for
             // the set to verify.
+            int firstCheck = signatureChecks.size();
             List<Verification> setVerifications = new ArrayList<>(partnerKeySet.cosignSets.size());
             for (CosignSet cosignSet : partnerKeySet.cosignSets) {
-                setVerifications.add(createCosignatureVerifications(tekSignatures, cosignSet));
+                Verification verification = createCosignatureVerifications(tekSignatures, cosignSet);
+                verification.addChecks(signatureChecks);
+                setVerifications.add(verification);
             }
+            exportVerifications.add(setVerifications);
+            keyFiles[i] = export.keyFilePath();
+            checkCounts[i] = signatureChecks.size() - firstCheck;
+        }
 
-            // read bytes, and simultaneously update all signatures and divert them to another thread
-            // where we will be reconstructing the metadata from those bytes
-            TemporaryExposureKeyExport keyMetadata;
-            try (PipedInputStream in = new PipedInputStream(STREAMING_BYTE_BUFFER_SIZE)) {
-                Future<TemporaryExposureKeyExport> protoDecodeFuture;
-                try (PipedOutputStream out = new PipedOutputStream(in);
-                     InputStream is = export.openKeyInputStream()) {
-                    protoDecodeFuture =
-                            executor.submit(() -> TemporaryExposureKeyFileMetadataParser.parse(in));
-
-                    // read stream and divert to secondary pipe and every signature
-                    byte[] buffer = new byte[STREAMING_BYTE_BUFFER_SIZE];
-                    int len = is.read(buffer);
-                    while (len != -1) {
-                        out.write(buffer, 0, len);
-                        if (ContactTracingFeature.calculateDiagnosisKeyHash()) {
-                            keyHash.update(buffer, 0, len);
-                        }
-                        for (Verification verification : setVerifications) {
-                            verification.update(buffer, 0, len);
-                        }
-                        len = is.read(buffer);
-                    }
-                }
-
-                // finalize signature verification - only one set needs to match
-                boolean matched = false;
-                for (Verification verification : setVerifications) {
-                    if (verification.verify()) {
-                        matched = true;
-                        break;
-                    }
-                }
-                if (!matched) {
-                    Log.log.atWarning().log("The necessary signatures did not verify");
-                    return false;
+        // read every file once, hashing it for all signatures and the key files hash while
+        // reconstructing the metadata from the same bytes
+        byte[][] keyMetadataBytes = new byte[exports.size()][];
+        byte[] keyHash =
+                ContactTracingFeature.calculateDiagnosisKeyHash()
+                        ? new byte[SHA256_DIGEST_LENGTH]
+                        : null;
+        boolean[] checkResults =
+                signatureChecks.verify(keyFiles, checkCounts, keyMetadataBytes, keyHash);
+        if (checkResults == null) {
+            throw new IOException("failed to read diagnosis key files");
+        }
+        ImmutableList.Builder<TemporaryExposureKeyExport> verifiedKeyMetadata =
+                ImmutableList.builder();
+
+        for (int i = 0; i < exports.size(); i++) {
+            TEKSignatureList tekSignatures = exports.get(i).signatureList();
+
+            // finalize signature verification - only one set needs to match
+            boolean matched = false;
+            for (Verification verification : exportVerifications.get(i)) {
+                if (verification.verify(checkResults)) {
+                    matched = true;
+                    break;
                 }
-
-                // retrieve metadata generated on other thread, and only now can we close the input stream
-                keyMetadata = protoDecodeFuture.get();
             }
+            if (!matched) {
+                Log.log.atWarning().log("The necessary signatures did not verify");
+                return false;
+            }
+
+            TemporaryExposureKeyExport keyMetadata =
+                    TemporaryExposureKeyExport.parseFrom(keyMetadataBytes[i]);
+            verifiedKeyMetadata.add(keyMetadata);
 
             if (keyMetadata.getBatchSize() > ContactTracingFeature.signatureMaxAllowedBatchGroupSize()) {
                 throw new UnsupportedOperationException(
@@ -322,8 +314,9 @@ public class SignatureVerifier {
         }
 
         if (ContactTracingFeature.calculateDiagnosisKeyHash()) {
-            keyFilesHash = keyHash.digest();
+            keyFilesHash = keyHash;
         }
+        keyMetadataList = verifiedKeyMetadata.build();
         Log.log.atInfo().log("Signature verification succeeded");
         return true;
     }
@@ -338,6 +331,17 @@ public class SignatureVerifier {
         return keyFilesHash;
     }
 
+    /**
+     * Gets the metadata read from each key file when it was verified, in order. If not
+     * available, returns an empty list.
+     */
+    public List<TemporaryExposureKeyExport> getKeyMetadata() {
+        if (keyMetadataList == null) {
+            return ImmutableList.of();
+        }
+        return keyMetadataList;
+    }
+
     public void setDebugPublicKey(@Nullable String debugPublicKey) {
         this.debugPublicKey = debugPublicKey;
     }
@@ -433,7 +437,7 @@ public class SignatureVerifier {
 
     private static Verification createCosignatureVerifications(
             TEKSignatureList tekSignatures, CosignSet cosignSet)
-            throws NoSuchAlgorithmException, InvalidKeyException, SignatureException {
+            throws NoSuchAlgorithmException, SignatureException {
         Preconditions.checkArgument(tekSignatures.getSignaturesCount() > 0);
         Preconditions.checkArgument(!cosignSet.keys.isEmpty());
 
@@ -491,15 +495,14 @@ public class SignatureVerifier {
             }
 
             // create verifier for public key and add to the list
-            String signatureAlgorithmName = OID_TO_NAME_MAP.get(info.getSignatureAlgorithm());
-            if (signatureAlgorithmName == null) {
+            Integer digestAlgorithm = OID_TO_DIGEST_MAP.get(info.getSignatureAlgorithm());
+            if (digestAlgorithm == null) {
                 throw new NoSuchAlgorithmException(
                         "unsupported signature OID: " + info.getSignatureAlgorithm());
             }
-            Signature signatureAttempt = Signature.getInstance(signatureAlgorithmName);
-            signatureAttempt.initVerify(publicKey);
             cosignatureVerificationsBuilder.add(
-                    new SignatureVerification(signatureAttempt, tekSignature.getSignature().toByteArray()));
+                    new SignatureVerification(
+                            publicKey, digestAlgorithm, tekSignature.getSignature().toByteArray()));
         }
 
         // check all public keys are being verified with none left out
@@ -556,9 +559,9 @@ public class SignatureVerifier {
 
     private interface Verification {
 
-        void update(byte[] data, int off, int len) throws SignatureException;
+        void addChecks(SignatureChecks checks);
 
-        boolean verify() throws SignatureException;
+        boolean verify(boolean[] checkResults);
     }
 
     /**
@@ -568,11 +571,11 @@ public class SignatureVerifier {
     private static class FailedVerification implements Verification {
 
         @Override
-        public void update(byte[] data, int off, int len) {
+        public void addChecks(SignatureChecks checks) {
         }
 
         @Override
-        public boolean verify() {
+        public boolean verify(boolean[] checkResults) {
             return false;
         }
     }
@@ -587,16 +590,16 @@ public class SignatureVerifier {
         }
 
         @Override
-        public void update(byte[] data, int off, int len) throws SignatureException {
+        public void addChecks(SignatureChecks checks) {
             for (Verification verification : cosignatures) {
-                verification.update(data, off, len);
+                verification.addChecks(checks);
             }
         }
 
         @Override
-        public boolean verify() throws SignatureException {
+        public boolean verify(boolean[] checkResults) {
             for (Verification verification : cosignatures) {
-                if (!verification.verify()) {
+                if (!verification.verify(checkResults)) {
                     return false;
                 }
             }
@@ -607,22 +610,68 @@ public class SignatureVerifier {
 
     private static class SignatureVerification implements Verification {
 
-        private final Signature signature;
+        private final PublicKey publicKey;
+        private final int digestAlgorithm;
         private final byte[] comparison;
+        private int checkIndex = -1;
 
-        private SignatureVerification(Signature signature, byte[] comparison) {
-            this.signature = signature;
+        private SignatureVerification(PublicKey publicKey, int digestAlgorithm, byte[] comparison) {
+            this.publicKey = publicKey;
+            this.digestAlgorithm = digestAlgorithm;
             this.comparison = comparison;
         }
 
         @Override
-        public void update(byte[] data, int off, int len) throws SignatureException {
-            signature.update(data, off, len);
+        public void addChecks(SignatureChecks checks) {
+            checkIndex = checks.add(publicKey, digestAlgorithm, comparison);
         }
 
         @Override
-        public boolean verify() throws SignatureException {
-            return signature.verify(comparison);
+        public boolean verify(boolean[] checkResults) {
+            return checkIndex >= 0 && checkResults[checkIndex];
+        }
+    }
+
+    /**
+     * The signatures to check against all key files, in the order of the files, so that each file
+     * is read once for all of them by {@link MatchingJni#verifyKeyFiles}.
+     */
+    private static class SignatureChecks {
+
+        private final List<byte[]> publicKeys = new ArrayList<>();
+        private final List<Integer> digestAlgorithms = new ArrayList<>();
+        private final List<byte[]> signatures = new ArrayList<>();
+
+        /** Adds a check of the current key file and returns its index in the results. */
+        private int add(PublicKey publicKey, int digestAlgorithm, byte[] signature) {
+            publicKeys.add(publicKey.getEncoded());
+            digestAlgorithms.add(digestAlgorithm);
+            signatures.add(signature);
+            return publicKeys.size() - 1;
+        }
+
+        private int size() {
+            return publicKeys.size();
+        }
+
+        @Nullable
+        private boolean[] verify(
+                String[] keyFiles,
+                int[] checkCounts,
+                byte[][] metadataOut,
+                @Nullable byte[] keyFilesHashOut) {
+            int[] digestAlgorithmArray = new int[digestAlgorithms.size()];
+            for (int i = 0; i < digestAlgorithmArray.length; i++) {
+                digestAlgorithmArray[i] = digestAlgorithms.get(i);
+            }
+            return MatchingJni.verifyKeyFiles(
+                    keyFiles,
+                    checkCounts,
+                    publicKeys.toArray(new byte[0][]),
+                    digestAlgorithmArray,
+                    signatures.toArray(new byte[0][]),
+                    metadataOut,
+                    keyFilesHashOut);
         }
     }
 
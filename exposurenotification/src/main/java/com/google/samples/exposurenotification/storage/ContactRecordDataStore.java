@@ -17,6 +17,7 @@
 package com.google.samples.exposurenotification.storage;
 
 import android.content.Context;
+import android.util.Pair;
 
 import androidx.annotation.Nullable;
 import androidx.annotation.VisibleForTesting;
@@ -25,6 +26,7 @@ import com.google.common.collect.Iterables;
 import com.google.protobuf.ByteString;
 import com.google.protobuf.InvalidProtocolBufferException;
 import com.google.samples.exposurenotification.Log;
+import com.google.samples.exposurenotification.ble.data.TimeIntervalNumberUtility;
 import com.google.samples.exposurenotification.nearby.ScannedPacket;
 import com.google.samples.exposurenotification.nearby.ScannedPacket.ScannedPacketBuilder;
 import com.google.samples.exposurenotification.nearby.ScannedPacket.ScannedPacketContent;
@@ -33,6 +35,7 @@ import com.google.samples.exposurenotification.data.DayNumber;
 import com.google.samples.exposurenotification.data.RollingProximityId;
 import com.google.samples.exposurenotification.features.ContactTracingFeature;
 
+import org.joda.time.Duration;
 import org.joda.time.Instant;
 
 import java.nio.ByteBuffer;
@@ -53,7 +56,13 @@ import static java.util.concurrent.TimeUnit.MILLISECONDS;
 @SuppressWarnings("NewApi")
 public class ContactRecordDataStore implements AutoCloseable {
 
+    private static final long FNV_OFFSET_BASIS = 0xcbf29ce484222325L;
+    private static final long FNV_PRIME = 0x100000001b3L;
+
     private final Map<byte[], byte[]> store = new HashMap<>();
+    // Sum of recordHash over the stored records, kept up to date as records are put so that
+    // getGeneration is derived from the records themselves without reading them.
+    private long recordsHash = 0;
 
     private ContactRecordDataStore(Context context) throws StorageException {
     }
@@ -178,6 +187,64 @@ public class ContactRecordDataStore implements AutoCloseable {
         return rawIds;
     }
 
+    /**
+     * Gets the generation of the stored IDs. It is derived from the record count and a hash of
+     * every stored key and value, so it changes whenever a record is added, removed or updated,
+     * and is the same for the same records however often the store is reopened. An index built
+     * from {@link #getAllScanRecordsDirect()} is still valid while it is unchanged.
+     */
+    public long getGeneration() {
+        synchronized (store) {
+            return store.size() * FNV_PRIME + recordsHash;
+        }
+    }
+
+    /**
+     * Gets the same records as {@link #getAllRawIds()}, in the same order, packed back to back into
+     * one direct buffer so that native code can read them in place instead of one {@code byte[]}
+     * per ID. Each record is its key, a {@link DayNumber} followed by the raw ID, then one byte each
+     * for the first and last interval of that day the ID was sighted in.
+     */
+    public ByteBuffer getAllScanRecordsDirect() {
+        int keyLength = DayNumber.getSizeBytes() + RollingProximityId.MIN_ID.length;
+        int intervalsPerDay = TimeIntervalNumberUtility.numIntervalsPer(Duration.standardDays(1));
+        synchronized (store) {
+            ByteBuffer scanRecords = ByteBuffer.allocateDirect(store.size() * (keyLength + 2));
+            for (Entry<byte[], byte[]> entry : store.entrySet()) {
+                byte[] key = entry.getKey();
+                if (key == null || key.length != keyLength) {
+                    continue;
+                }
+                int dayStartIntervalNumber =
+                        DayNumber.getValueFrom(ByteBuffer.wrap(key)) * intervalsPerDay;
+                int firstInterval = intervalsPerDay - 1;
+                int lastInterval = 0;
+                try {
+                    for (SightingRecord sightingRecord :
+                            ContactRecordValue.parseFrom(entry.getValue()).getSightingRecordsList()) {
+                        int interval =
+                                TimeIntervalNumberUtility.getTimeIntervalNumber(
+                                        Duration.standardSeconds(
+                                                sightingRecord.getEpochSeconds() & 0xFFFFFFFFL))
+                                        - dayStartIntervalNumber;
+                        firstInterval = Math.min(firstInterval, Math.max(interval, 0));
+                        lastInterval = Math.max(lastInterval, Math.min(interval, intervalsPerDay - 1));
+                    }
+                } catch (InvalidProtocolBufferException e) {
+                    Log.log.atSevere().withCause(e).log("Error reading sightings of a record");
+                }
+                if (firstInterval > lastInterval) {
+                    // Without readable sightings the ID may have been sighted at any time that day.
+                    firstInterval = 0;
+                    lastInterval = intervalsPerDay - 1;
+                }
+                scanRecords.put(key).put((byte) firstInterval).put((byte) lastInterval);
+            }
+            scanRecords.flip();
+            return scanRecords;
+        }
+    }
+
     /**
      * Adds or updates a contact record value with the key given by {@code dayNumber} and {@code
      * rollingProximityId}.
@@ -186,8 +253,14 @@ public class ContactRecordDataStore implements AutoCloseable {
     public void putRecord(
             DayNumber dayNumber, RollingProximityId rollingProximityId, ContactRecordValue value) {
         ContactRecordKey key = new ContactRecordKey(dayNumber, rollingProximityId);
+        byte[] keyBytes = key.getBytes();
+        byte[] valueBytes = value.toByteArray();
         synchronized (store) {
-            store.put(key.getBytes(), value.toByteArray());
+            byte[] previousValueBytes = store.put(keyBytes, valueBytes);
+            if (previousValueBytes != null) {
+                recordsHash -= recordHash(keyBytes, previousValueBytes);
+            }
+            recordsHash += recordHash(keyBytes, valueBytes);
         }
     }
 
@@ -270,6 +343,22 @@ public class ContactRecordDataStore implements AutoCloseable {
         putRecord(dayNumber, rollingProximityId, updatedValue);
     }
 
+    /**
+     * 64-bit FNV-1a hash of a record's key, its length, then its value. Records are combined by
+     * adding their hashes, which does not depend on the order of the store.
+     */
+    private static long recordHash(byte[] key, byte[] value) {
+        long hash = FNV_OFFSET_BASIS;
+        for (byte b : key) {
+            hash = (hash ^ (b & 0xFF)) * FNV_PRIME;
+        }
+        hash = (hash ^ key.length) * FNV_PRIME;
+        for (byte b : value) {
+            hash = (hash ^ (b & 0xFF)) * FNV_PRIME;
+        }
+        return hash;
+    }
+
     private static boolean isSameScanCycle(
             SightingRecord.Builder sightingRecordBuilder, int sightingTimeSeconds) {
         // Simple heuristic that considering a new sighting packet to be in the same scan cycle of a
@@ -392,6 +481,30 @@ public class ContactRecordDataStore implements AutoCloseable {
         return 0;
     }
 
+    /**
+     * Gets the first and last {@link DayNumber} for which contact records are stored, or null if
+     * the store is empty.
+     */
+    @Nullable
+    public Pair<DayNumber, DayNumber> getDayNumberRange() {
+        int firstDayNumber = Integer.MAX_VALUE;
+        int lastDayNumber = Integer.MIN_VALUE;
+        synchronized (store) {
+            for (byte[] key : store.keySet()) {
+                if (key == null) {
+                    continue;
+                }
+                int dayNumber = DayNumber.getValueFrom(ByteBuffer.wrap(key));
+                firstDayNumber = Math.min(firstDayNumber, dayNumber);
+                lastDayNumber = Math.max(lastDayNumber, dayNumber);
+            }
+        }
+        if (firstDayNumber > lastDayNumber) {
+            return null;
+        }
+        return Pair.create(new DayNumber(firstDayNumber), new DayNumber(lastDayNumber));
+    }
+
     /**
      * An immutable data class represents a contact record. The key-value pair data can be accessed
      * through {@link #getKey()} and {@link #getValue()}.